@@ -0,0 +1,388 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "compiler.h"
+#include "memory.h"
+
+// The emitted C keeps the bytecode: it is rebuilt into the functions' chunks at startup, so run() and jit_step can
+// still read operands, constants and lines from it. every instruction becomes a few lines of C under a label,
+// jumps become gotos, and the operand stack, whose depth is known at every instruction, becomes locals the
+// C compiler can keep in registers. the number cases of arithmetic, comparisons and branches are inline, the rest
+// runs through jit_step, and calls and returns that switch frames are left to run(), which comes back into the C
+// of the next frame. there is no dispatch between the instructions of a function.
+
+// <---- emitting ----->
+typedef struct {
+    FunctionObj** functions; // the script first, then every function nested in it
+    int count;
+    int capacity;
+} FunctionList;
+
+static void collect_functions(FunctionObj* function, FunctionList* list) {
+    if (list->count == list->capacity) {
+        list->capacity = GROW_CAPACITY(list->capacity);
+        list->functions = realloc(list->functions, list->capacity * sizeof(FunctionObj*));
+    }
+    list->functions[list->count++] = function;
+    ValueArray* constants = &function->body.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->arr[i])) {
+            collect_functions(AS_FUNCTION(constants->arr[i]), list);
+        }
+    }
+}
+
+static int function_id(FunctionList* list, FunctionObj* function) {
+    for (int i = 0; i < list->count; i++) {
+        if (list->functions[i] == function) {
+            return i;
+        }
+    }
+    return -1; // unreachable, every function was collected
+}
+
+static void emit_string_literal(FILE* out, const char* chars, int length) {
+    fputc('"', out);
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char) chars[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < ' ' || c > '~') {
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void emit_data(FILE* out, FunctionObj* function, int id) {
+    Chunk* chunk = &function->body;
+    fprintf(out, "static const uint8_t code_%i[] = {", id);
+    for (int i = 0; i < chunk->count; i++) {
+        fprintf(out, i % 16 == 0 ? "\n    %i," : " %i,", chunk->codes[i]);
+    }
+    fprintf(out, "\n};\nstatic const int lines_%i[] = {", id);
+    for (int i = 0; i < chunk->count; i++) {
+        fprintf(out, i % 16 == 0 ? "\n    %i," : " %i,", chunk->lines[i]);
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+// labels are only emitted where something jumps to or run() enters the function, the rest would be unused
+static void find_labels(Chunk* chunk, int* depths, bool* labels, bool* entries) {
+    entries[0] = labels[0] = true;
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        if (depths[offset] == -1) {
+            continue;
+        }
+        if (is_jump(chunk->codes[offset])) {
+            labels[jump_target(chunk, offset)] = true;
+        } else if (chunk->codes[offset] == OP_CALL) {
+            // where run() comes back after a call that pushed a frame
+            int next = offset + instruction_length(chunk, offset);
+            entries[next] = labels[next] = true;
+        }
+    }
+}
+
+// the operand stack lives in the locals s0, s1, ... and is only written to the vm stack for what reads it there:
+// jit_step, run() and the gc
+static void emit_flush(FILE* out, int depth) {
+    for (int i = 0; i < depth; i++) {
+        fprintf(out, "    stack[%i] = s%i;\n", i, i);
+    }
+    fprintf(out, "    vm->sp = stack + %i;\n", depth);
+}
+
+static void emit_reload(FILE* out, int depth) {
+    for (int i = 0; i < depth; i++) {
+        fprintf(out, "    s%i = stack[%i];\n", i, i);
+    }
+}
+
+// runs the instruction through jit_step
+static void emit_step(FILE* out, int offset, int depth, int next_depth) {
+    emit_flush(out, depth);
+    fprintf(out, "    if (jit_step(vm, frame, code + %i) == JIT_FAILED) return RESULT_ERROR;\n", offset);
+    emit_reload(out, next_depth);
+}
+
+static void emit_branch_step(FILE* out, Chunk* chunk, int offset, int depth, int next_depth) {
+    uint8_t code = chunk->codes[offset];
+    emit_flush(out, depth);
+    fprintf(out, "    step = jit_step(vm, frame, code + %i);\n", offset);
+    fprintf(out, "    if (step == JIT_FAILED) return RESULT_ERROR;\n");
+    fprintf(out, "    if (step == JIT_BRANCH) {\n");
+    emit_reload(out, code == OP_FOR_ITER ? depth : next_depth); // an exhausted for loop pushes nothing
+    fprintf(out, "    goto L%i;\n    }\n", jump_target(chunk, offset));
+    emit_reload(out, next_depth);
+}
+
+// leaves the instruction to run()
+static void emit_exit(FILE* out, int offset, int depth) {
+    emit_flush(out, depth);
+    fprintf(out, "    frame->ip = code + %i;\n    return RESULT_SUCCESS;\n", offset);
+}
+
+// the number case of an instruction inline, anything else through jit_step
+static void emit_number_case(FILE* out, Chunk* chunk, int offset, int depth, const char* test, const char* result) {
+    int a = depth - 2;
+    int b = depth - 1;
+    fprintf(out, "    if (IS_NUMBER(s%i) && IS_NUMBER(s%i)", a, b);
+    fprintf(out, test, b);
+    fprintf(out, ") s%i = ", a);
+    fprintf(out, result, a, b);
+    fprintf(out, ";\n    else {\n");
+    emit_step(out, offset, depth, depth + stack_effect(chunk, offset));
+    fprintf(out, "    }\n");
+}
+
+static void emit_instruction(FILE* out, Chunk* chunk, int offset, int depth) {
+    uint8_t* ip = chunk->codes + offset;
+    int next_depth = depth + stack_effect(chunk, offset);
+    int top = depth - 1;
+    switch (ip[0]) {
+        case OP_CONSTANT: {
+            Value constant = chunk->constants.arr[ip[1]];
+            if (IS_NUMBER(constant)) {
+                fprintf(out, "    s%i = VAR_NUMBER(%.17g);\n", depth, AS_NUMBER(constant));
+            } else {
+                fprintf(out, "    s%i = constants[%i];\n", depth, ip[1]);
+            }
+            break;
+        }
+        case OP_NIL: fprintf(out, "    s%i = VAR_NIL;\n", depth); break;
+        case OP_TRUE: fprintf(out, "    s%i = VAR_BOOL(true);\n", depth); break;
+        case OP_FALSE: fprintf(out, "    s%i = VAR_BOOL(false);\n", depth); break;
+        case OP_POP_TOP:
+        case OP_END_FOR: break;
+        case OP_LOAD_LOCAL: fprintf(out, "    s%i = slots[%i];\n", depth, ip[1]); break;
+        case OP_STORE_FAST:
+        case OP_ASSIGN_LOCAL: fprintf(out, "    slots[%i] = s%i;\n", ip[1], top); break;
+        case OP_LOAD_SCRIPT: fprintf(out, "    s%i = vm->stack[%i];\n", depth, ip[1]); break;
+        case OP_ASSIGN_SCRIPT: fprintf(out, "    vm->stack[%i] = s%i;\n", ip[1], top); break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+            emit_number_case(out, chunk, offset, depth, "", "VAR_NUMBER(AS_NUMBER(s%i) + AS_NUMBER(s%i))");
+            break;
+        case OP_SUB:
+        case OP_SUB_NUM:
+            emit_number_case(out, chunk, offset, depth, "", "VAR_NUMBER(AS_NUMBER(s%i) - AS_NUMBER(s%i))");
+            break;
+        case OP_MUL:
+        case OP_MUL_NUM:
+            emit_number_case(out, chunk, offset, depth, "", "VAR_NUMBER(AS_NUMBER(s%i) * AS_NUMBER(s%i))");
+            break;
+        case OP_DIV: // dividing by 0 is an error, raised by jit_step
+            emit_number_case(out, chunk, offset, depth, " && AS_NUMBER(s%i) != 0",
+                             "VAR_NUMBER(AS_NUMBER(s%i) / AS_NUMBER(s%i))");
+            break;
+        case OP_MODULO:
+            emit_number_case(out, chunk, offset, depth, "", "VAR_NUMBER(fmod(AS_NUMBER(s%i), AS_NUMBER(s%i)))");
+            break;
+        case OP_LESS_THAN:
+        case OP_LESS_THAN_NUM:
+            emit_number_case(out, chunk, offset, depth, "", "VAR_BOOL(AS_NUMBER(s%i) < AS_NUMBER(s%i))");
+            break;
+        case OP_GREATER_THAN:
+        case OP_GREATER_THAN_NUM:
+            emit_number_case(out, chunk, offset, depth, "", "VAR_BOOL(AS_NUMBER(s%i) > AS_NUMBER(s%i))");
+            break;
+        case OP_COMPARE:
+            emit_number_case(out, chunk, offset, depth, "", "VAR_BOOL(AS_NUMBER(s%i) == AS_NUMBER(s%i))");
+            break;
+        case OP_NEGATE:
+            fprintf(out, "    if (IS_NUMBER(s%i)) s%i = VAR_NUMBER(-AS_NUMBER(s%i));\n    else {\n", top, top, top);
+            emit_step(out, offset, depth, next_depth);
+            fprintf(out, "    }\n");
+            break;
+        case OP_NOT:
+            fprintf(out, "    if (IS_BOOL(s%i)) s%i = VAR_BOOL(!AS_BOOL(s%i));\n    else {\n", top, top, top);
+            emit_step(out, offset, depth, next_depth);
+            fprintf(out, "    }\n");
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+            fprintf(out, "    if (!is_truthy(s%i)) goto L%i;\n", top, jump_target(chunk, offset));
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+            fprintf(out, "    if (IS_NUMBER(s%i) && IS_NUMBER(s%i)) {\n", depth - 2, depth - 1);
+            fprintf(out, "        if (!(AS_NUMBER(s%i) %s AS_NUMBER(s%i))) goto L%i;\n    } else {\n",
+                    depth - 2, ip[0] == OP_JUMP_IF_NOT_LESS ? "<" : ">", depth - 1, jump_target(chunk, offset));
+            emit_branch_step(out, chunk, offset, depth, next_depth);
+            fprintf(out, "    }\n");
+            break;
+        case OP_JUMP:
+        case OP_JUMP_BACKWARD:
+            fprintf(out, "    goto L%i;\n", jump_target(chunk, offset));
+            break;
+        case OP_INCREMENT_LOCAL:
+            fprintf(out, "    if (IS_NUMBER(slots[%i])) slots[%i] = VAR_NUMBER(AS_NUMBER(slots[%i]) + %.17g);\n    else {\n",
+                    ip[1], ip[1], ip[1], AS_NUMBER(chunk->constants.arr[ip[2]]));
+            emit_step(out, offset, depth, next_depth);
+            fprintf(out, "    }\n");
+            break;
+        case OP_FOR_ITER:
+            emit_branch_step(out, chunk, offset, depth, next_depth);
+            break;
+        case OP_CALL: {
+            // calls of native functions and methods run in place, the ones that push a frame go back to run()
+            int callee = depth - ip[1] - 1;
+            fprintf(out, "    if (IS_NATIVE(s%i) || IS_NATIVE_METHOD(s%i)) {\n", callee, callee);
+            emit_step(out, offset, depth, next_depth);
+            fprintf(out, "    } else {\n");
+            emit_exit(out, offset, depth);
+            fprintf(out, "    }\n");
+            break;
+        }
+        case OP_RETURN:
+        case OP_HALT:
+            emit_exit(out, offset, depth);
+            break;
+        default: // the instructions with no inline version
+            emit_step(out, offset, depth, next_depth);
+            break;
+    }
+}
+
+static void emit_function(FILE* out, FunctionObj* function, int id) {
+    Chunk* chunk = &function->body;
+    int max_depth;
+    int* depths = compute_stack_depths(chunk, &max_depth);
+    bool* labels = (bool*) calloc(chunk->count + 1, sizeof(bool));
+    bool* entries = (bool*) calloc(chunk->count + 1, sizeof(bool));
+    find_labels(chunk, depths, labels, entries);
+    bool uses_constants = false;
+    bool uses_step = false;
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        uint8_t code = chunk->codes[offset];
+        uses_constants |= code == OP_CONSTANT && !IS_NUMBER(chunk->constants.arr[chunk->codes[offset + 1]]);
+        uses_step |= code == OP_FOR_ITER || code == OP_JUMP_IF_NOT_LESS || code == OP_JUMP_IF_NOT_GREATER;
+    }
+
+    fprintf(out, "static InterpretResult run_%i(VM* vm, StackFrame* frame) {\n", id);
+    fprintf(out, "    uint8_t* code = frame->function->body.codes;\n");
+    if (uses_constants) {
+        fprintf(out, "    Value* constants = frame->function->body.constants.arr;\n");
+    }
+    if (function->localCount > 0) {
+        fprintf(out, "    Value* slots = frame->slots;\n");
+    }
+    fprintf(out, "    Value* stack = frame->slots + %u; // the operand stack, past the locals\n", function->localCount);
+    for (int i = 0; i < max_depth; i++) {
+        fprintf(out, i == 0 ? "    Value s0" : ", s%i", i);
+    }
+    fprintf(out, max_depth > 0 ? ";\n" : "");
+    if (uses_step) {
+        fprintf(out, "    JitStep step;\n");
+    }
+    fprintf(out, "    switch (frame->ip - code) {\n");
+    for (int offset = 0; offset < chunk->count; offset++) {
+        if (entries[offset]) {
+            fprintf(out, "    case %i:\n", offset);
+            emit_reload(out, depths[offset]);
+            fprintf(out, "    goto L%i;\n", offset);
+        }
+    }
+    fprintf(out, "    default:\n        return RESULT_SUCCESS; // run() interprets from anywhere else\n");
+    fprintf(out, "    }\n");
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        if (depths[offset] == -1) {
+            continue; // unreachable
+        }
+        if (labels[offset]) {
+            fprintf(out, "L%i:\n", offset);
+        }
+        emit_instruction(out, chunk, offset, depths[offset]);
+    }
+    fprintf(out, "}\n\n");
+    free(depths);
+    free(labels);
+    free(entries);
+}
+
+static void emit_loader(FILE* out, FunctionList* list, FunctionObj* function, int id) {
+    fprintf(out, "static FunctionObj* load_%i(void) {\n", id);
+    fprintf(out, "    FunctionObj* function = aot_function(");
+    emit_string_literal(out, function->name->value, function->name->length);
+    fprintf(out, ", %i, %s, code_%i, lines_%i, %i, run_%i);\n", function->name->length,
+            function->type == FN_SCRIPT ? "FN_SCRIPT" : "FN_FUNCTION", id, id, function->body.count, id);
+    fprintf(out, "    function->localCount = %u;\n", function->localCount);
+    fprintf(out, "    function->maxStackSize = %i;\n", function->maxStackSize);
+    for (unsigned int i = 0; i < function->upvalueCount; i++) {
+        fprintf(out, "    aot_upvalue(function, %s, %i);\n",
+                function->upvalues[i].isLocal ? "true" : "false", function->upvalues[i].index);
+    }
+    ValueArray* constants = &function->body.constants;
+    for (int i = 0; i < constants->count; i++) {
+        Value constant = constants->arr[i];
+        fprintf(out, "    aot_constant(function, ");
+        if (IS_NUMBER(constant)) {
+            fprintf(out, "VAR_NUMBER(%.17g)", AS_NUMBER(constant));
+        } else if (IS_STRING(constant)) {
+            // names stay interned, so the emitted program compares them the way the interpreter does
+            fprintf(out, "VAR_OBJ(%s(", AS_STRING(constant)->interned ? "intern_string" : "create_string_obj");
+            emit_string_literal(out, AS_STRING(constant)->value, AS_STRING(constant)->length);
+            fprintf(out, ", %i))", AS_STRING(constant)->length);
+        } else if (IS_FUNCTION(constant)) {
+            fprintf(out, "VAR_OBJ(load_%i())", function_id(list, AS_FUNCTION(constant)));
+        } else {
+            fprintf(out, "VAR_NIL"); // the compiler only makes number, string and function constants
+        }
+        fprintf(out, ");\n");
+    }
+    fprintf(out, "    return function;\n}\n\n");
+}
+
+void emit_c(FunctionObj* script, FILE* out) {
+    FunctionList list = {NULL, 0, 0};
+    collect_functions(script, &list);
+
+    fprintf(out, "// generated by shipc --emit-c, build it together with every file of shipc but main.c\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+    // nested functions come after the function they are declared in, so they are emitted from the back
+    for (int id = list.count - 1; id >= 0; id--) {
+        FunctionObj* function = list.functions[id];
+        fprintf(out, "// <---- %.*s ----->\n", function->name->length, function->name->value);
+        emit_data(out, function, id);
+        emit_function(out, function, id);
+        emit_loader(out, &list, function, id);
+    }
+    fprintf(out, "int main(void) {\n    return aot_main(load_0());\n}\n");
+    free(list.functions);
+}
+// <------------------------------------>
+
+
+// <---- runtime of the emitted code ----->
+FunctionObj* aot_function(const char* name, int length, FunctionType type, const uint8_t* codes, const int* lines,
+                          int count, AotFunction run) {
+    FunctionObj* function = create_func_obj(name, length, type);
+    for (int i = 0; i < count; i++) {
+        write_chunk(&function->body, codes[i], lines[i]);
+    }
+    function->aot = (void*) run;
+    return function;
+}
+
+void aot_upvalue(FunctionObj* function, bool is_local, uint8_t index) {
+    function->upvalues[function->upvalueCount].isLocal = is_local;
+    function->upvalues[function->upvalueCount].index = index;
+    function->upvalueCount++;
+}
+
+void aot_constant(FunctionObj* function, Value constant) {
+    add_constant(&function->body, constant);
+}
+
+int aot_main(FunctionObj* script) {
+    static VM vm; // the value stack is too big for the c stack
+    init_vm(&vm);
+    InterpretResult result = interpret(&vm, script);
+    free_vm(&vm);
+    return result == RESULT_SUCCESS ? 0 : 1;
+}
+// <------------------------------------>
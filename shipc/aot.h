@@ -0,0 +1,31 @@
+#pragma once
+#ifndef SHIP_AOT_H_
+#define SHIP_AOT_H_
+
+#include <math.h>
+#include <stdio.h>
+
+#include "vm.h"
+#include "objects.h"
+#include "jit.h"
+
+// ahead of time translation of a compiled script to C, see aot.c. shipc --emit-c prints a translation unit that
+// builds the script's functions at startup and runs them on the vm, with every function's bytecode turned into
+// straight C code. it is built against the runtime: every file of shipc but main.c.
+
+// a function translated to C. called by run() when it enters a frame of the function or returns to one, it runs
+// from frame->ip until it reaches a call or return that switches frames, and leaves that instruction to run().
+// frame->ip and vm->sp are up to date when it returns
+typedef InterpretResult (*AotFunction)(VM* vm, StackFrame* frame);
+
+// prints the C translation of the script and the functions nested in it
+void emit_c(FunctionObj* script, FILE* out);
+
+// used by the emitted code
+FunctionObj* aot_function(const char* name, int length, FunctionType type, const uint8_t* codes, const int* lines,
+                          int count, AotFunction run);
+void aot_upvalue(FunctionObj* function, bool is_local, uint8_t index);
+void aot_constant(FunctionObj* function, Value constant);
+int aot_main(FunctionObj* script);
+
+#endif // !SHIP_AOT_H_
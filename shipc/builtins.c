@@ -10,21 +10,21 @@
     if (got < min) return VAR_OBJ(create_err_obj("Not Enough Parameters", 21, ERR_SYNTAX)); \
     if (got > max) return VAR_OBJ(create_err_obj("Too much arguments given", 24, ERR_SYNTAX)) \
 
-static Value validate_attr(StringObj* attr_obj, const char* real_attr, int real_attr_length, NativeFn fn) {
+static NativeFn validate_attr(StringObj* attr_obj, const char* real_attr, int real_attr_length, NativeFn fn) {
     if (attr_obj->length == real_attr_length && memcmp(attr_obj->value, real_attr, real_attr_length) == 0) {
-        return VAR_OBJ(create_native_method_obj(fn));
+        return fn;
     }
-    return VAR_OBJ(create_err_obj("Object has no attribute", 23, ERR_NAME));
+    return NULL;
 }
 
 #define RUN_ATTR(attr_name, attr_length, func) validate_attr(attr_given, attr_name, attr_length, func)
 #define ATTRIBUTE_HOST(args) *args
-#define ATTRIBUTE_ARGS(args) (args + 2);
+#define ATTRIBUTE_ARGS(args) (args + 1);
 
 #define ERROR(str, type) return VAR_OBJ(create_err_obj(str, strlen(str), type));
 
 
-// args[0] will always be the value the builtin is called on it
+// args[0] will always be the value the builtin is called on it, the call arguments follow it
 // For example: 4.to_str(14) -> Value[4, 14]
 
 /*----------------------
@@ -111,11 +111,11 @@ static Value Number_upto(int arg_count, Value* args) {
     return VAR_OBJ(arr);
 }
 
-static Value num_attrs(StringObj* attr_given) {
+static NativeFn num_attrs(StringObj* attr_given) {
     switch(attr_given->value[0]) {
         case 't': {
             if (attr_given->length == 1) {
-                return VAR_OBJ(create_err_obj("Number has no attribute", 23, ERR_NAME));
+                return NULL;
             }
             switch(attr_given->value[1]) {
                 case 'o':
@@ -128,7 +128,7 @@ static Value num_attrs(StringObj* attr_given) {
         case 'u': return RUN_ATTR("upto", 4, Number_upto);
         case 'o': return RUN_ATTR("odd", 3, Number_odd);
         case 'n': return RUN_ATTR("next", 4, Number_next);
-        default: return VAR_OBJ(create_err_obj("Number has no attribute", 23, ERR_NAME));
+        default: return NULL;
     }
 
 }
@@ -143,32 +143,66 @@ static Value num_attrs(StringObj* attr_given) {
  */
 static Value String_length(int arg_count, Value* args) {
     REQ_ARGS(0, arg_count, 0);
-    StringObj* str = AS_STRING(*args);
-    return VAR_NUMBER(str->length);
+    return VAR_NUMBER(string_length(AS_OBJ(*args))); // a rope is not flattened for it
 }
 
 static Value String_copy(int arg_count, Value* args) {
     REQ_ARGS(0, arg_count, 0);
-    StringObj* str = AS_STRING(*args);
-    StringObj* copy = create_string_obj(str->value, str->length);
-    return VAR_OBJ(copy);
+    return *args; // strings are immutable, the string is as good as a copy of it
 }
 
 static Value String_capitalize(int arg_count, Value* args) {
     REQ_ARGS(0, arg_count, 0);
     StringObj* original = AS_STRING(*args);
+    if (original->length == 0 || (original->value[0] & 0xDF) == original->value[0]) {
+        return *args; // nothing changes
+    }
     StringObj* str = create_string_obj(original->value, original->length);
     *str->value = *str->value & 0xDF;
     return VAR_OBJ(str);
 }
 
-static Value string_attrs(StringObj* attr_given) {
+/*
+ * Joins an array of strings into one, with the string it is called on between each two of them.
+ * the result is allocated once, so it is the way to build a string out of many pieces
+ */
+static Value String_join(int arg_count, Value* args) {
+    REQ_ARGS(1, arg_count, 1);
+    Value parts_value = *ATTRIBUTE_ARGS(args);
+    if (!IS_ARRAY(parts_value)) {
+        ERROR("join(array) expected an array", ERR_TYPE);
+    }
+    StringObj* separator = AS_STRING(*args);
+    ValueArray* parts = AS_ARRAY(parts_value)->values;
+    int length = 0;
+    for (int i = 0; i < parts->count; i++) {
+        if (!IS_STRING(parts->arr[i])) {
+            ERROR("join(array) expected an array of strings", ERR_TYPE);
+        }
+        length += string_length(AS_OBJ(parts->arr[i])) + (i > 0 ? separator->length : 0);
+    }
+
+    StringObj* joined = allocate_string(length);
+    int at = 0;
+    for (int i = 0; i < parts->count; i++) {
+        if (i > 0) {
+            memcpy(joined->value + at, separator->value, separator->length);
+            at += separator->length;
+        }
+        StringObj* part = AS_STRING(parts->arr[i]);
+        memcpy(joined->value + at, part->value, part->length);
+        at += part->length;
+    }
+    return VAR_OBJ(joined);
+}
+
+static NativeFn string_attrs(StringObj* attr_given) {
     switch(attr_given->value[0]) {
         case 'l': return RUN_ATTR("len", 3, String_length);
         case 't': return RUN_ATTR("title", 5, String_capitalize);
         case 'c': return RUN_ATTR("copy", 4, String_copy);
-        default:
-            ERROR("String has no attribute", ERR_NAME);
+        case 'j': return RUN_ATTR("join", 4, String_join);
+        default: return NULL;
     }
 }
 
@@ -212,12 +246,12 @@ static Value Array_length(int arg_count, Value* args) {
     return VAR_NUMBER(arr->values->count);
 }
 
-static Value array_attrs(StringObj* attr_given) {
+static NativeFn array_attrs(StringObj* attr_given) {
     switch(attr_given->value[0]) {
         case 'l': return RUN_ATTR("len", 3, Array_length);
         case 'p': {
             if (attr_given->length == 1) {
-                ERROR("Number has no attribute", ERR_NAME);
+                return NULL;
             }
             switch(attr_given->value[1]) {
                 case 'o':
@@ -225,24 +259,44 @@ static Value array_attrs(StringObj* attr_given) {
                 case 'u': return RUN_ATTR("push", 4, Array_push);
             }
         }
-        default:
-            ERROR("Array has no attribute", ERR_NAME);
+        default: return NULL;
+    }
+}
+
+NativeFn get_builtin_method(Value attr_host, StringObj* attr_given) {
+    switch (receiver_kind(attr_host)) {
+        case RECEIVER_NUMBER: return num_attrs(attr_given);
+        case RECEIVER_STRING: return string_attrs(attr_given);
+        case RECEIVER_ARRAY: return array_attrs(attr_given);
+        default: return NULL;
+    }
+}
+
+NativeFn get_cached_builtin_method(AttrCache* cache, Value attr_host, StringObj* attr_given) {
+    int kind = receiver_kind(attr_host);
+    if (kind < 0) {
+        return NULL;
+    }
+    if (cache->methods[kind] == NULL) {
+        // first time this receiver kind reaches the site, match the name once
+        cache->methods[kind] = get_builtin_method(attr_host, attr_given);
     }
+    return cache->methods[kind];
 }
 
-Value get_builtin_attr(Value attr_host, StringObj* attr_given) {
-    switch (attr_host.type) {
-        case VAL_NUMBER: return num_attrs(attr_given);
+Value builtin_attr_error(Value attr_host) {
+    switch (VALUE_TYPE(attr_host)) {
+        case VAL_NUMBER: ERROR("Number has no attribute", ERR_NAME);
         case VAL_OBJ: {
             switch(AS_OBJ(attr_host)->type) {
-                case OBJ_STRING: return string_attrs(attr_given);
-                case OBJ_ARRAY: return array_attrs(attr_given);
+                case OBJ_ROPE:
+                case OBJ_STRING: ERROR("String has no attribute", ERR_NAME);
+                case OBJ_ARRAY: ERROR("Array has no attribute", ERR_NAME);
                 default:
                     ERROR("Not implemented; builtins.c", ERR_NAME);
             }
         }
         default: {
-            printf("not implemented; builtins.c");
             ERROR("Not implemented; builtins.c", ERR_NAME);
         }
     }
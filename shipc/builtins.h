@@ -5,7 +5,22 @@
 #include "objects.h"
 
 
+// the receiver kind of a value with builtin attributes, -1 if it has none
+static inline int receiver_kind(Value value) {
+    if (IS_NUMBER(value)) return RECEIVER_NUMBER;
+    if (IS_STRING(value)) return RECEIVER_STRING;
+    if (IS_ARRAY(value)) return RECEIVER_ARRAY;
+    return -1;
+}
+
 // This module essentially provides the basic attributes for all primitive ship types. (strings, arrays, numbers, booleans etc)
-Value get_builtin_attr(Value attr_host, StringObj* attr_given);
+
+// Returns the builtin method attr_given of attr_host without wrapping it in an object, or NULL if there is none.
+// The method is called with args[0] set to attr_host, followed by the call arguments.
+NativeFn get_builtin_method(Value attr_host, StringObj* attr_given);
+Value builtin_attr_error(Value attr_host);
+
+// Same as get_builtin_method, but resolves through the inline cache of the calling site.
+NativeFn get_cached_builtin_method(AttrCache* cache, Value attr_host, StringObj* attr_given);
 
 #endif //SHIP_BUILTINS_H
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "chunk.h"
 #include "memory.h"
 
@@ -8,6 +9,7 @@ void init_chunk(Chunk* chunk) {
 	chunk->count = 0;
 	chunk->codes = NULL;
     chunk->lines = NULL;
+    chunk->siteCaches = NULL;
 	ValueArray arr;
 	init_value_array(&arr);
 	chunk->constants = arr;
@@ -32,7 +34,17 @@ void write_bytes(Chunk* chunk, uint8_t byte, uint8_t byte2, int line) {
 }
 
 uint8_t add_constant(Chunk* chunk, Value constant) {
+    if (IS_OBJ(constant)) {
+        // the chunk owns it, a script that gets hold of it must not hand it to the collector
+        AS_OBJ(constant)->generation = GEN_PERMANENT;
+    }
+    int old_capacity = chunk->constants.capacity;
 	write_value_array(&chunk->constants, constant);
+    if (chunk->constants.capacity != old_capacity) {
+        // keep a cache entry for every constant, the ones that name a global or attribute site are used by the vm
+        chunk->siteCaches = GROW_ARRAY(SiteCache, chunk->siteCaches, old_capacity, chunk->constants.capacity);
+        memset(chunk->siteCaches + old_capacity, 0, (chunk->constants.capacity - old_capacity) * sizeof(SiteCache));
+    }
 	if (chunk->constants.count - 1 > UINT8_MAX) {
 		printf("Too many constants");
 		exit(1);
@@ -44,9 +56,132 @@ void change_constant(Chunk* chunk, uint8_t index, Value constant) {
 	chunk->constants.arr[index] = constant;
 }
 
+int instruction_length(Chunk* chunk, int offset) {
+    // the size in bytes of the instruction at offset, including its operands
+    switch (chunk->codes[offset]) {
+        case OP_CONSTANT:
+        case OP_CALL:
+        case OP_STORE_FAST:
+        case OP_LOAD_LOCAL:
+        case OP_LOAD_GLOBAL:
+        case OP_ASSIGN_GLOBAL:
+        case OP_ASSIGN_LOCAL:
+        case OP_BUILD_ARRAY:
+        case OP_LOAD_ATTR:
+        case OP_LOAD_UPVALUE:
+        case OP_ASSIGN_UPVALUE:
+        case OP_LOAD_SCRIPT:
+        case OP_ASSIGN_SCRIPT:
+            return 2;
+        case OP_JUMP_BACKWARD:
+        case OP_JUMP:
+        case OP_FOR_ITER:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_INVOKE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_INCREMENT_LOCAL:
+            return 3;
+        case OP_CLOSURE: // function constant, upvalue count, and an (isLocal, index) pair per upvalue
+            return 3 + 2 * chunk->codes[offset + 2];
+        default:
+            return 1;
+    }
+}
+
+bool is_jump(uint8_t code) {
+    return code == OP_JUMP || code == OP_JUMP_BACKWARD || code == OP_POP_JUMP_IF_FALSE || code == OP_FOR_ITER ||
+           code == OP_JUMP_IF_NOT_LESS || code == OP_JUMP_IF_NOT_GREATER;
+}
+
+int jump_target(Chunk* chunk, int offset) {
+    int next = offset + instruction_length(chunk, offset);
+    int jmp_size = (chunk->codes[offset + 1] << 8) | chunk->codes[offset + 2];
+    return chunk->codes[offset] == OP_JUMP_BACKWARD ? next - jmp_size : next + jmp_size;
+}
+
+int stack_effect(Chunk* chunk, int offset) {
+    // how many values the instruction at offset leaves on the operand stack, minus how many it takes.
+    // jumps report the effect of falling through, OP_FOR_ITER leaves nothing when it exits the loop.
+    switch (chunk->codes[offset]) {
+        case OP_CONSTANT:
+        case OP_FALSE:
+        case OP_TRUE:
+        case OP_NIL:
+        case OP_LOAD_LOCAL:
+        case OP_LOAD_GLOBAL:
+        case OP_LOAD_UPVALUE:
+        case OP_LOAD_SCRIPT:
+        case OP_CLOSURE:
+        case OP_FOR_ITER:
+            return 1;
+        case OP_MUL:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_DIV:
+        case OP_MODULO:
+        case OP_COMPARE:
+        case OP_LESS_THAN:
+        case OP_GREATER_THAN:
+        case OP_ADD_NUM:
+        case OP_SUB_NUM:
+        case OP_MUL_NUM:
+        case OP_LESS_THAN_NUM:
+        case OP_GREATER_THAN_NUM:
+        case OP_POP_TOP:
+        case OP_SHOW_TOP:
+        case OP_STORE_FAST:
+        case OP_ASSIGN_LOCAL:
+        case OP_ASSIGN_GLOBAL:
+        case OP_ASSIGN_UPVALUE:
+        case OP_ASSIGN_SCRIPT:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_END_FOR:
+        case OP_RETURN:
+            return -1;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+            return -2;
+        case OP_CALL: // the callee and its arguments are replaced by the result
+            return -chunk->codes[offset + 1];
+        case OP_INVOKE: // the host and the arguments are replaced by the result
+            return -chunk->codes[offset + 2];
+        case OP_BUILD_ARRAY:
+            return 1 - chunk->codes[offset + 1];
+        default: // OP_LOAD_ATTR, OP_GET_ITER, OP_NEGATE, OP_NOT, OP_INCREMENT_LOCAL, jumps and OP_HALT
+            return 0;
+    }
+}
+
 void free_chunk(Chunk* chunk) {
 	FREE_ARRAY(uint8_t, chunk->codes, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(SiteCache, chunk->siteCaches, chunk->constants.capacity);
 	free_value_array_with_values(&chunk->constants);
 	init_chunk(chunk);
-}
\ No newline at end of file
+}
+void init_register_chunk(RegisterChunk* chunk) {
+    chunk->codes = NULL;
+    chunk->lines = NULL;
+    chunk->count = 0;
+    chunk->capacity = 0;
+}
+
+void free_register_chunk(RegisterChunk* chunk) {
+    FREE_ARRAY(uint32_t, chunk->codes, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    init_register_chunk(chunk);
+}
+
+int write_register_code(RegisterChunk* chunk, uint32_t code, int line) {
+    // returns the index of the written instruction
+    if (chunk->capacity <= chunk->count) {
+        int old_capacity = chunk->capacity;
+        chunk->capacity = GROW_CAPACITY(old_capacity);
+        chunk->codes = GROW_ARRAY(uint32_t, chunk->codes, old_capacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+    }
+    chunk->codes[chunk->count] = code;
+    chunk->lines[chunk->count] = line;
+    return chunk->count++;
+}
@@ -37,9 +37,115 @@ typedef enum { // available op codes
 	OP_NEGATE,
 	OP_POP_JUMP_IF_FALSE,
 	OP_NOT,
+    OP_CLOSURE,
+    OP_LOAD_UPVALUE,
+    OP_ASSIGN_UPVALUE,
+    OP_LOAD_SCRIPT,
+    OP_ASSIGN_SCRIPT,
+    OP_INVOKE,
+    // number only versions of the arithmetic and comparison ops, the vm rewrites sites to these at runtime
+    OP_ADD_NUM,
+    OP_SUB_NUM,
+    OP_MUL_NUM,
+    OP_LESS_THAN_NUM,
+    OP_GREATER_THAN_NUM,
+    // superinstructions emitted by the compiler for common sequences
+    OP_JUMP_IF_NOT_LESS, // OP_LESS_THAN + OP_POP_JUMP_IF_FALSE
+    OP_JUMP_IF_NOT_GREATER, // OP_GREATER_THAN + OP_POP_JUMP_IF_FALSE
+    OP_INCREMENT_LOCAL, // OP_LOAD_LOCAL x, OP_CONSTANT n, OP_ADD, OP_ASSIGN_LOCAL x
 	OP_HALT
 } OpCode;
 
+// the register instruction set, run by run_registers when shipc is started with --registers.
+// operands name frame slots (registers) directly instead of going through the operand stack.
+// R(x) is frame slot x, K(x) constant x, RK(x) either of them (see RK_CONSTANT).
+typedef enum {
+    ROP_MOVE, // R(A) = R(B)
+    ROP_LOADK, // R(A) = K(Bx)
+    ROP_LOADNIL, // R(A) = nil
+    ROP_LOADBOOL, // R(A) = B
+    ROP_ADD, // R(A) = RK(B) + RK(C)
+    ROP_SUB,
+    ROP_MUL,
+    ROP_DIV,
+    ROP_MOD,
+    ROP_LT, // R(A) = RK(B) < RK(C)
+    ROP_GT,
+    ROP_EQ,
+    ROP_NOT, // R(A) = not R(B)
+    ROP_NEG, // R(A) = -R(B)
+    ROP_JMP, // pc += sBx
+    ROP_JMP_IF_FALSE, // if R(A) is falsy, pc += sBx
+    ROP_TEST_LT, // if RK(B) < RK(C), skip the next instruction (always a ROP_JMP)
+    ROP_TEST_GT,
+    ROP_GETGLOBAL, // R(A) = globals[K(Bx)]
+    ROP_SETGLOBAL, // globals[K(Bx)] = R(A)
+    ROP_GETUPVAL, // R(A) = upvalue B
+    ROP_SETUPVAL, // upvalue B = R(A)
+    ROP_GETSCRIPT, // R(A) = script variable B
+    ROP_SETSCRIPT, // script variable B = R(A)
+    ROP_CLOSURE, // R(A) = closure of the function K(Bx)
+    ROP_CALL, // R(A) = R(A)(R(A+1) .. R(A+B))
+    ROP_INVOKE, // R(A) = R(A).K(B)(R(A+1) .. R(A+C))
+    ROP_GETATTR, // R(A) = R(B).K(C)
+    ROP_BUILD_ARRAY, // R(A) = [R(A) .. R(A+B-1)]
+    ROP_GET_ITER, // R(A) = iterator of R(B)
+    ROP_FOR_ITER, // if the iterator R(A) is done pc += sBx, else R(A+1) = its next value
+    ROP_RETURN, // return R(A)
+    ROP_PRINT, // print R(A)
+    ROP_HALT
+} RegOpCode;
+
+// a register instruction is 32 bits: opcode (6) | A (8) | B (9) | C (9), where B and C may be merged into Bx (18).
+// B and C below RK_CONSTANT name a register, from RK_CONSTANT on they name constant x - RK_CONSTANT
+#define RK_CONSTANT 256
+#define REGISTER_MAX 255
+#define SBX_BIAS (1 << 17)
+#define ENCODE_ABC(op, a, b, c) ((uint32_t) (op) | ((uint32_t) (a) << 6) | ((uint32_t) (b) << 14) | ((uint32_t) (c) << 23))
+#define ENCODE_ABX(op, a, bx) ((uint32_t) (op) | ((uint32_t) (a) << 6) | ((uint32_t) (bx) << 14))
+#define REG_OP(i) ((i) & 0x3f)
+#define REG_A(i) (((i) >> 6) & 0xff)
+#define REG_B(i) (((i) >> 14) & 0x1ff)
+#define REG_C(i) ((i) >> 23)
+#define REG_BX(i) ((i) >> 14)
+#define REG_SBX(i) ((int) REG_BX(i) - SBX_BIAS)
+
+typedef struct { // register code of a function, it shares the constant pool of the function's stack chunk
+    uint32_t* codes;
+    int* lines;
+    int count;
+    int capacity;
+} RegisterChunk;
+
+
+struct ValueNode;
+
+// inline cache of a global load/assign site. each site has its own name constant,
+// so the cache of a site lives at the index of that constant.
+typedef struct {
+    unsigned int version; // version of the globals table the node was resolved in, 0 if empty
+    struct ValueNode* node;
+} GlobalCache;
+
+// the kinds of values that have builtin attributes
+typedef enum {
+    RECEIVER_NUMBER,
+    RECEIVER_STRING,
+    RECEIVER_ARRAY,
+    RECEIVER_KINDS
+} ReceiverKind;
+
+// inline cache of an attribute load/invoke site, holds the builtin resolved for every receiver kind seen there.
+// builtins never change at runtime, so an entry stays valid once filled.
+typedef struct {
+    NativeFn methods[RECEIVER_KINDS];
+} AttrCache;
+
+// a constant names either a global site or an attribute site, never both
+typedef union {
+    GlobalCache global;
+    AttrCache attr;
+} SiteCache;
 
 typedef struct { // store a chunk of bytecode
 	uint8_t* codes; // op codes / values
@@ -47,6 +153,7 @@ typedef struct { // store a chunk of bytecode
 	int capacity; // available total capacity
 
 	ValueArray constants; // constant pool
+    SiteCache* siteCaches; // parallel to the constant pool
     int * lines;
 } Chunk;
 
@@ -57,5 +164,12 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line);
 void write_bytes(Chunk* chunk, uint8_t byte, uint8_t byte2, int line);
 uint8_t add_constant(Chunk* chunk, Value constant);
 void change_constant(Chunk* chunk, uint8_t index, Value constant);
+int instruction_length(Chunk* chunk, int offset);
+bool is_jump(uint8_t code);
+int jump_target(Chunk* chunk, int offset); // offset of the instruction the jump at offset goes to
+void init_register_chunk(RegisterChunk* chunk);
+void free_register_chunk(RegisterChunk* chunk);
+int write_register_code(RegisterChunk* chunk, uint32_t code, int line);
+int stack_effect(Chunk* chunk, int offset);
 
 #endif // SHIP_CHUNK_H_
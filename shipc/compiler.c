@@ -10,6 +10,13 @@
 
 
 
+// the state of a function that is being compiled, saved while one of its inner functions is parsed
+typedef struct FunctionScope {
+    FunctionObj* func;
+    HashMap* varMap;
+    struct FunctionScope* enclosing;
+} FunctionScope;
+
 // main parser struct
 typedef struct {
 	Token current;
@@ -17,6 +24,11 @@ typedef struct {
 
 	FunctionObj* func;
     HashMap* varMap;
+    FunctionScope* enclosing; // NULL while compiling the main script
+
+    // offsets used to fuse instructions, -1 when unset
+    int lastCompare; // offset of the last lone OP_LESS_THAN / OP_GREATER_THAN
+    int lastAssignmentEnd; // offset right after the OP_NIL left by the last assignment
 
 	bool hadError;
 	bool panicMode;
@@ -33,7 +45,6 @@ static HashNode* get_variable(Parser* parser, char* name, int length) {
 static unsigned int create_variable(Parser* parser, char* name, int length) {
     Local  local;
     local.name = name;
-    local.value = VAR_NIL;
     local.length = length;
     parser->func->locals[parser->varMap->count] = local;
 
@@ -50,6 +61,50 @@ static unsigned int add_variable(Parser* parser, char* name, int length) {
     return create_variable(parser, name, length);
 }
 
+static HashNode* get_script_variable(Parser* parser, char* name, int length) {
+    // script variables are never captured, functions reach them directly in the script frame
+    FunctionScope* scope = parser->enclosing;
+    if (scope == NULL) {
+        return NULL; // the script itself is being compiled, its variables are plain locals
+    }
+    while (scope->enclosing != NULL) {
+        scope = scope->enclosing;
+    }
+    return get_node(scope->varMap, name, length);
+}
+
+static int add_upvalue(FunctionObj* func, uint8_t index, bool is_local) {
+    // reuse the slot if the function already captures this variable
+    for (unsigned int i = 0; i < func->upvalueCount; i++) {
+        Upvalue* upvalue = &func->upvalues[i];
+        if (upvalue->index == index && upvalue->isLocal == is_local) {
+            return (int) i;
+        }
+    }
+    if (func->upvalueCount == UINT8_MAX) {
+        return -1;
+    }
+    func->upvalues[func->upvalueCount].index = index;
+    func->upvalues[func->upvalueCount].isLocal = is_local;
+    return (int) func->upvalueCount++;
+}
+
+static int resolve_upvalue(FunctionObj* func, FunctionScope* enclosing, char* name, int length) {
+    // walk the enclosing functions outwards, every function in between captures the variable too
+    if (enclosing == NULL || enclosing->func->type == FN_SCRIPT) {
+        return -1;
+    }
+    HashNode* local = get_node(enclosing->varMap, name, length);
+    if (local != NULL) {
+        return add_upvalue(func, (uint8_t) local->value, true);
+    }
+    int upvalue = resolve_upvalue(enclosing->func, enclosing->enclosing, name, length);
+    if (upvalue == -1) {
+        return -1;
+    }
+    return add_upvalue(func, (uint8_t) upvalue, false);
+}
+
 
 // Precedence utils
 typedef enum {
@@ -79,6 +134,8 @@ static void parse_statement(Parser* parser, Scanner* scanner);
 static void parse_expression(Parser* parser, Scanner* scanner);
 static void advance(Scanner* scanner, Parser* parser) ;
 static void synchronize(Parser* parser, Scanner* scanner) ;
+static void emit_jump_if_false(Parser* parser, Scanner* scanner);
+static void compute_max_stack_size(FunctionObj* func);
 
 
 
@@ -147,6 +204,9 @@ static void init_parser(Parser* parser) {
 
     parser->varMap = (HashMap*) malloc(sizeof (HashMap));
     create_variable_map(parser->varMap);
+    parser->enclosing = NULL;
+    parser->lastCompare = -1;
+    parser->lastAssignmentEnd = -1;
 
 	parser->func = create_func_obj("main", 4, FN_SCRIPT);
 }
@@ -226,10 +286,12 @@ static void parse_boolean(Parser* parser, Scanner* scanner) {
         break;
     }
     case TOKEN_GREATER: {
+        parser->lastCompare = current_chunk(parser)->count;
         write_chunk(current_chunk(parser), OP_GREATER_THAN, scanner->line);
         break;
     }
     case TOKEN_LESS: {
+        parser->lastCompare = current_chunk(parser)->count;
         write_chunk(current_chunk(parser), OP_LESS_THAN, scanner->line);
         break;
     }
@@ -329,7 +391,7 @@ static void parse_if_statement(Parser* parser, Scanner* scanner) {
 
 
 	// add a temp value
-	write_chunk(current_chunk(parser), OP_POP_JUMP_IF_FALSE, scanner->line);
+	emit_jump_if_false(parser, scanner);
 
 	// save the value before the body
 	int change_bytes_offset = current_chunk(parser)->count;
@@ -387,8 +449,38 @@ static void parse_variable(Parser* parser, Scanner* scanner) {
     write_bytes(current_chunk(parser), OP_STORE_FAST, var_index, scanner->line);
 }
 
+static void emit_jump_if_false(Parser* parser, Scanner* scanner) {
+    // a condition that ends in a lone '<' or '>' is fused with the branch, otherwise the bool is tested.
+    // both forms take the same 3 bytes, so the callers patch the jump offset the same way
+    Chunk* chunk = current_chunk(parser);
+    if (parser->lastCompare == chunk->count - 1) {
+        uint8_t* compare = &chunk->codes[chunk->count - 1];
+        if (*compare == OP_LESS_THAN || *compare == OP_GREATER_THAN) {
+            *compare = *compare == OP_LESS_THAN ? OP_JUMP_IF_NOT_LESS : OP_JUMP_IF_NOT_GREATER;
+            parser->lastCompare = -1;
+            return;
+        }
+    }
+    write_chunk(chunk, OP_POP_JUMP_IF_FALSE, scanner->line);
+}
+
+static bool emit_increment_local(Parser* parser, int expression_start, uint8_t index) {
+    // x = x + <number> becomes a single OP_INCREMENT_LOCAL
+    Chunk* chunk = current_chunk(parser);
+    uint8_t* expression = &chunk->codes[expression_start];
+    if (chunk->count - expression_start != 5 || expression[0] != OP_LOAD_LOCAL || expression[1] != index ||
+        expression[2] != OP_CONSTANT || expression[4] != OP_ADD || !IS_NUMBER(chunk->constants.arr[expression[3]])) {
+        return false;
+    }
+    uint8_t amount = expression[3];
+    int line = chunk->lines[expression_start + 4]; // report errors on the line of the '+'
+    chunk->count = expression_start;
+    write_bytes(chunk, OP_INCREMENT_LOCAL, index, line);
+    write_chunk(chunk, amount, line);
+    return true;
+}
+
 static void parse_var_assignment(Parser* parser, Scanner* scanner) {
-    write_chunk(current_chunk(parser), OP_NIL, scanner->line);
     Token variable_ident = parser->previous;
     HashNode* stored_variable = get_variable(parser, variable_ident.start, variable_ident.length);
     if (stored_variable == NULL) {
@@ -397,10 +489,15 @@ static void parse_var_assignment(Parser* parser, Scanner* scanner) {
     }
     expect(scanner, parser, TOKEN_EQUAL, "Expected '=' after variable declaration at");
 
+    int expression_start = current_chunk(parser)->count;
     parse_precedence(parser, scanner, PREC_OR); // parse the expression value
 
-    write_bytes(current_chunk(parser), OP_ASSIGN_LOCAL, stored_variable->value, scanner->line);
-
+    if (!emit_increment_local(parser, expression_start, stored_variable->value)) {
+        write_bytes(current_chunk(parser), OP_ASSIGN_LOCAL, stored_variable->value, scanner->line);
+    }
+    // an assignment evaluates to nil, an assignment statement drops it again
+    write_chunk(current_chunk(parser), OP_NIL, scanner->line);
+    parser->lastAssignmentEnd = current_chunk(parser)->count;
 }
 
 
@@ -410,19 +507,30 @@ static void parse_identifier(Parser* parser, Scanner* scanner) {
         return parse_var_assignment(parser, scanner);
     }
 
-    // add the ident string to the pool so we can either call or load i
-    HashNode *var = get_variable(parser, parser->previous.start, parser->previous.length);
-    if (var == NULL) {
-        StringObj *obj = create_string_obj(parser->previous.start, parser->previous.length);
-        uint8_t string_index = add_constant(current_chunk(parser), VAR_OBJ(obj));
-        write_bytes(current_chunk(parser), OP_LOAD_GLOBAL, string_index, scanner->line);
+    Token name = parser->previous;
+    HashNode *var = get_variable(parser, name.start, name.length);
+    if (var != NULL) {
+        write_bytes(current_chunk(parser), OP_LOAD_LOCAL, var->value, scanner->line);
         return;
     }
-    write_bytes(current_chunk(parser), OP_LOAD_LOCAL, var->value, scanner->line);
+    int upvalue = resolve_upvalue(parser->func, parser->enclosing, name.start, name.length);
+    if (upvalue != -1) {
+        write_bytes(current_chunk(parser), OP_LOAD_UPVALUE, upvalue, scanner->line);
+        return;
+    }
+    HashNode *script_var = get_script_variable(parser, name.start, name.length);
+    if (script_var != NULL) {
+        write_bytes(current_chunk(parser), OP_LOAD_SCRIPT, script_var->value, scanner->line);
+        return;
+    }
+    // add the ident string to the pool so we can load it from the globals
+    // script variables declared later in the file are patched in end_compile
+    StringObj *obj = intern_string(name.start, name.length);
+    uint8_t string_index = add_constant(current_chunk(parser), VAR_OBJ(obj));
+    write_bytes(current_chunk(parser), OP_LOAD_GLOBAL, string_index, scanner->line);
 }
 
-static void parse_call(Parser* parser, Scanner* scanner) {
-
+static uint8_t parse_call_arguments(Parser* parser, Scanner* scanner) {
     // parse the call argument
     uint8_t argument_call = 0;
     while (parser->current.type != TOKEN_EOF && parser->current.type != TOKEN_RIGHT_PAREN) {
@@ -438,9 +546,12 @@ static void parse_call(Parser* parser, Scanner* scanner) {
 
     expect(scanner, parser, TOKEN_RIGHT_PAREN,
            "Unclosed argument list of a function"); // eat the  => no arguments for now
-           write_bytes(current_chunk(parser), OP_CALL, argument_call, scanner->line);
+    return argument_call;
+}
 
-	
+static void parse_call(Parser* parser, Scanner* scanner) {
+    uint8_t argument_call = parse_call_arguments(parser, scanner);
+    write_bytes(current_chunk(parser), OP_CALL, argument_call, scanner->line);
 }
 
 static void parse_return_statement(Parser* parser, Scanner* scanner) {
@@ -482,12 +593,19 @@ static void parse_func_statement(Parser* parser, Scanner* scanner) {
     // create required objects
 	Token func_tkn = parser->previous;
     FunctionObj* obj = create_func_obj(func_tkn.start, func_tkn.length, FN_FUNCTION);
-    FunctionObj* before_func = parser->func;
+
+    // register the function name before the body, so the body can refer to itself
+    unsigned int name_index = add_variable(parser, func_tkn.start, func_tkn.length);
+
+    // save the enclosing function, its variables are resolved as upvalues from the body
+    FunctionScope enclosing_scope;
+    enclosing_scope.func = parser->func;
+    enclosing_scope.varMap = parser->varMap;
+    enclosing_scope.enclosing = parser->enclosing;
+    parser->enclosing = &enclosing_scope;
     parser->func = obj;
 
     // set the variable scope
-    HashMap* saved_map = parser->varMap;
-
     parser->varMap = (HashMap*) malloc(sizeof (HashMap));
     create_variable_map(parser->varMap);
 
@@ -519,21 +637,30 @@ static void parse_func_statement(Parser* parser, Scanner* scanner) {
     write_bytes(current_chunk(parser), OP_NIL, OP_RETURN, scanner->line);
 
     parser->func->localCount = parser->varMap->count;
+    compute_max_stack_size(parser->func);
 
     // Free the hashmap AFTER assigning the right localCount.
     free_hash_map(parser->varMap);
 
 
-    parser->varMap = saved_map;
-	parser->func = before_func;
+    parser->varMap = enclosing_scope.varMap;
+	parser->func = enclosing_scope.func;
+    parser->enclosing = enclosing_scope.enclosing;
 	expect(scanner, parser, TOKEN_RIGHT_BRACE, "Unclosed block in function declaration"); // eat the }
 
-	// Add function constant
+	// Add function constant, functions that capture variables are wrapped in a closure at runtime
 	uint8_t index = add_constant(current_chunk(parser), VAR_OBJ(obj));
-	write_bytes(current_chunk(parser), OP_CONSTANT, index, scanner->line);
+    if (obj->upvalueCount == 0) {
+        write_bytes(current_chunk(parser), OP_CONSTANT, index, scanner->line);
+    } else {
+        write_bytes(current_chunk(parser), OP_CLOSURE, index, scanner->line);
+        write_chunk(current_chunk(parser), obj->upvalueCount, scanner->line);
+        for (unsigned int i = 0; i < obj->upvalueCount; i++) {
+            write_bytes(current_chunk(parser), obj->upvalues[i].isLocal, obj->upvalues[i].index, scanner->line);
+        }
+    }
 
-	// register the function name
-    unsigned int name_index = add_variable(parser, obj->name->value, obj->name->length);
+	// store the function under its name
 	write_bytes(current_chunk(parser), OP_STORE_FAST, name_index, scanner->line);
 
 
@@ -550,7 +677,22 @@ static void parse_global_statement(Parser* parser, Scanner* scanner) {
     parse_precedence(parser, scanner, PREC_OR);
     expect(scanner, parser, TOKEN_SEMICOLON, "Expected ;");
 
-    StringObj* obj =create_string_obj(variable_ident.start, variable_ident.length);
+    HashNode* var = get_variable(parser, variable_ident.start, variable_ident.length);
+    if (var != NULL) {
+        write_bytes(current_chunk(parser), OP_ASSIGN_LOCAL, var->value, scanner->line);
+        return;
+    }
+    int upvalue = resolve_upvalue(parser->func, parser->enclosing, variable_ident.start, variable_ident.length);
+    if (upvalue != -1) {
+        write_bytes(current_chunk(parser), OP_ASSIGN_UPVALUE, upvalue, scanner->line);
+        return;
+    }
+    HashNode* script_var = get_script_variable(parser, variable_ident.start, variable_ident.length);
+    if (script_var != NULL) {
+        write_bytes(current_chunk(parser), OP_ASSIGN_SCRIPT, script_var->value, scanner->line);
+        return;
+    }
+    StringObj* obj = intern_string(variable_ident.start, variable_ident.length);
     uint8_t index = add_constant(current_chunk(parser), VAR_OBJ(obj));
     write_bytes(current_chunk(parser), OP_ASSIGN_GLOBAL, index, scanner->line);
 
@@ -606,9 +748,17 @@ static void parse_attribute(Parser * parser, Scanner *scanner) {
         return;
     }
     advance(scanner, parser);
-    StringObj* attribute_name = create_string_obj(parser->previous.start, parser->previous.length);
+    StringObj* attribute_name = intern_string(parser->previous.start, parser->previous.length);
 
     uint8_t const_index = add_constant(current_chunk(parser), VAR_OBJ(attribute_name));
+    if (parser->current.type == TOKEN_LEFT_PAREN) {
+        // host.name(...) is called right away, so fuse the lookup and the call
+        advance(scanner, parser);
+        uint8_t argument_call = parse_call_arguments(parser, scanner);
+        write_bytes(current_chunk(parser), OP_INVOKE, const_index, scanner->line);
+        write_chunk(current_chunk(parser), argument_call, scanner->line);
+        return;
+    }
     write_bytes(current_chunk(parser), OP_LOAD_ATTR, const_index, scanner->line);
 
 }
@@ -622,7 +772,7 @@ static void parse_while_statement(Parser* parser, Scanner* scanner) {
 
 
     // add a temp value
-    write_chunk(current_chunk(parser), OP_POP_JUMP_IF_FALSE, scanner->line);
+    emit_jump_if_false(parser, scanner);
 
     // save the value before the body
     int offset = current_chunk(parser)->count;
@@ -660,7 +810,14 @@ static void parse_expression_statement(Parser* parser, Scanner* scanner) {
 	// for ex: call(a,b,c);
 	parse_expression(parser, scanner);
 	expect(scanner, parser, TOKEN_SEMICOLON, "Expected ;");
-	write_chunk(current_chunk(parser), OP_POP_TOP, scanner->line);
+    Chunk* chunk = current_chunk(parser);
+    if (parser->lastAssignmentEnd == chunk->count && chunk->codes[chunk->count - 1] == OP_NIL) {
+        // the statement is an assignment, instead of pushing its nil and popping it, skip both
+        chunk->count--;
+        parser->lastAssignmentEnd = -1;
+        return;
+    }
+	write_chunk(chunk, OP_POP_TOP, scanner->line);
 }
 
 static void parse_control_statement(Parser* parser, Scanner* scanner) {
@@ -682,6 +839,8 @@ static void parse_statement(Parser* parser, Scanner* scanner) {
         case TOKEN_VAR:
         case TOKEN_RETURN:
             return parse_declaration_statement(parser, scanner);
+        case TOKEN_GLOBAL:
+            return parse_global_statement(parser, scanner);
         default:
             return parse_expression_statement(parser, scanner);
     }
@@ -695,11 +854,104 @@ static void parse_expression(Parser* parser, Scanner* scanner) {
 
 
 
+static void visit_stack_depth(int* depths, int* pending, int* pending_count, int offset, int depth) {
+    if (depths[offset] == -1) {
+        depths[offset] = depth;
+        pending[(*pending_count)++] = offset;
+    }
+}
+
+int* compute_stack_depths(Chunk* chunk, int* max_stack_depth) {
+    // walk every path through the bytecode, tracking the operand stack depth before each instruction.
+    // statements leave the stack as they found it, so every path into an instruction agrees on its depth.
+    // returns the depth before every offset, -1 for unreachable ones and operand bytes. the caller frees it
+    int* depths = (int*) malloc(sizeof(int) * chunk->count); // -1 for instructions not reached yet
+    int* pending = (int*) malloc(sizeof(int) * chunk->count); // reached, but not walked
+    int pending_count = 0;
+    for (int i = 0; i < chunk->count; i++) {
+        depths[i] = -1;
+    }
+    int max_depth = 0;
+    visit_stack_depth(depths, pending, &pending_count, 0, 0);
+
+    while (pending_count > 0) {
+        int offset = pending[--pending_count];
+        int depth = depths[offset];
+        while (offset < chunk->count) {
+            uint8_t code = chunk->codes[offset];
+            int next = offset + instruction_length(chunk, offset);
+            int next_depth = depth + stack_effect(chunk, offset);
+            if (next_depth > max_depth) {
+                max_depth = next_depth;
+            }
+
+            if (code == OP_RETURN || code == OP_HALT) {
+                break;
+            }
+            if (is_jump(code)) {
+                // a loop that exits leaves the stack like it was before OP_FOR_ITER
+                visit_stack_depth(depths, pending, &pending_count, jump_target(chunk, offset),
+                                  code == OP_FOR_ITER ? depth : next_depth);
+                if (code == OP_JUMP || code == OP_JUMP_BACKWARD) {
+                    break;
+                }
+            }
+            if (next >= chunk->count || depths[next] != -1) {
+                break;
+            }
+            depths[next] = next_depth;
+            offset = next;
+            depth = next_depth;
+        }
+    }
+    free(pending);
+    *max_stack_depth = max_depth;
+    return depths;
+}
+
+static void compute_max_stack_size(FunctionObj* func) {
+    int max_depth;
+    free(compute_stack_depths(&func->body, &max_depth));
+    func->maxStackSize = (int) func->localCount + max_depth;
+}
+
+static void resolve_forward_references(FunctionObj* func, HashMap* script_vars) {
+    // a function may use a script variable that is only declared further down the file.
+    // its name was compiled as a global lookup, now that every script variable is known, point it at the slot.
+    Chunk* chunk = &func->body;
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        uint8_t code = chunk->codes[offset];
+        if (code != OP_LOAD_GLOBAL && code != OP_ASSIGN_GLOBAL) {
+            continue;
+        }
+        StringObj* name = AS_STRING(chunk->constants.arr[chunk->codes[offset + 1]]);
+        HashNode* var = get_node(script_vars, name->value, name->length);
+        if (var != NULL) {
+            chunk->codes[offset] = code == OP_LOAD_GLOBAL ? OP_LOAD_SCRIPT : OP_ASSIGN_SCRIPT;
+            chunk->codes[offset + 1] = var->value;
+        }
+    }
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (IS_FUNCTION(chunk->constants.arr[i])) {
+            resolve_forward_references(AS_FUNCTION(chunk->constants.arr[i]), script_vars);
+        }
+    }
+}
+
 static void end_compile(Parser* parser, Scanner* scanner) {
 	if (parser->current.type == TOKEN_EOF) {
 		write_chunk(current_chunk(parser), OP_HALT, scanner->line);
 
+        // the script's own code can't use a variable before its declaration, only its functions are patched
+        Chunk* script = current_chunk(parser);
+        for (int i = 0; i < script->constants.count; i++) {
+            if (IS_FUNCTION(script->constants.arr[i])) {
+                resolve_forward_references(AS_FUNCTION(script->constants.arr[i]), parser->varMap);
+            }
+        }
+
         parser->func->localCount = parser->varMap->count;
+        compute_max_stack_size(parser->func);
         free_hash_map(parser->varMap);
 
 		return;
@@ -776,3 +1028,308 @@ FunctionObj* compile(const char* source) {
 
 	return parser.hadError ? NULL : parser.func;
 }
+
+// <---- register code generation ----->
+// translates the stack bytecode of a function into register code (see RegOpCode), for --registers.
+// operand stack position i gets register base + i, where base is the function's local count.
+// values only move into their stack register when they have to: locals and constants are used in place,
+// and a result that is assigned right away is written straight to the variable, so `a = b + c` is one ROP_ADD.
+
+typedef struct {
+    RegisterChunk* out;
+    int base;
+    int* stack; // the RK operand that holds each operand stack position
+    int depth; // -1 after an instruction that doesn't fall through
+    int lastResult; // index of the last instruction if it wrote nothing but the top of the stack, else -1
+    int line;
+} RegisterGen;
+
+static int stack_register(RegisterGen* gen, int position) {
+    return gen->base + position;
+}
+
+static int emit_register(RegisterGen* gen, uint32_t code) {
+    gen->lastResult = -1;
+    return write_register_code(gen->out, code, gen->line);
+}
+
+static void push_operand(RegisterGen* gen, int rk) {
+    gen->stack[gen->depth++] = rk;
+}
+
+static int pop_operand(RegisterGen* gen) {
+    return gen->stack[--gen->depth];
+}
+
+static void push_result(RegisterGen* gen, uint32_t code) {
+    // code writes its result to the register of the position being pushed, and nothing else
+    int index = emit_register(gen, code);
+    push_operand(gen, stack_register(gen, gen->depth));
+    gen->lastResult = index;
+}
+
+static void materialize(RegisterGen* gen, int position) {
+    // move the value of a stack position into the position's own register
+    int home = stack_register(gen, position);
+    int rk = gen->stack[position];
+    if (rk == home) {
+        return;
+    }
+    if (rk >= RK_CONSTANT) {
+        emit_register(gen, ENCODE_ABX(ROP_LOADK, home, rk - RK_CONSTANT));
+    } else {
+        emit_register(gen, ENCODE_ABC(ROP_MOVE, home, rk, 0));
+    }
+    gen->stack[position] = home;
+}
+
+static void materialize_range(RegisterGen* gen, int from, int to) {
+    for (int i = from; i < to; i++) {
+        materialize(gen, i);
+    }
+}
+
+static void materialize_local(RegisterGen* gen, int local) {
+    // the local is about to change, positions that still read it take a copy of the old value first
+    for (int i = 0; i < gen->depth; i++) {
+        if (gen->stack[i] == local) {
+            materialize(gen, i);
+        }
+    }
+}
+
+static int pop_register(RegisterGen* gen) {
+    // pops the top of the stack as a register, a constant is loaded into the position's register first
+    if (gen->stack[gen->depth - 1] >= RK_CONSTANT) {
+        materialize(gen, gen->depth - 1);
+    }
+    return pop_operand(gen);
+}
+
+static void store_local(RegisterGen* gen, int local) {
+    gen->depth--;
+    materialize_local(gen, local);
+    int value = gen->stack[gen->depth];
+    if (gen->lastResult != -1 && value == stack_register(gen, gen->depth)) {
+        // retarget the instruction that computed the value to write the local instead
+        uint32_t* code = &gen->out->codes[gen->lastResult];
+        *code = (*code & ~(0xffu << 6)) | ((uint32_t) local << 6);
+        gen->lastResult = -1;
+        return;
+    }
+    if (value >= RK_CONSTANT) {
+        emit_register(gen, ENCODE_ABX(ROP_LOADK, local, value - RK_CONSTANT));
+    } else if (value != local) {
+        emit_register(gen, ENCODE_ABC(ROP_MOVE, local, value, 0));
+    }
+}
+
+static void emit_register_jump(RegisterGen* gen, uint32_t code, int target, int* patches, int* patch_targets, int* patch_count) {
+    // the offset is patched once the register address of every stack offset is known
+    patches[*patch_count] = emit_register(gen, code);
+    patch_targets[*patch_count] = target;
+    (*patch_count)++;
+}
+
+static bool generate_registers(FunctionObj* func) {
+    Chunk* chunk = &func->body;
+    int max_depth;
+    int* depths = compute_stack_depths(chunk, &max_depth);
+    if (func->maxStackSize > REGISTER_MAX) {
+        free(depths);
+        return false;
+    }
+
+    // jump targets start a block, every path into one leaves the stack in its registers
+    bool* targets = (bool*) calloc(chunk->count, sizeof(bool));
+    int* addresses = (int*) malloc(sizeof(int) * chunk->count); // register code index of every stack offset
+    int* patches = (int*) malloc(sizeof(int) * chunk->count);
+    int* patch_targets = (int*) malloc(sizeof(int) * chunk->count);
+    int patch_count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        if (depths[offset] != -1 && is_jump(chunk->codes[offset])) {
+            targets[jump_target(chunk, offset)] = true;
+        }
+    }
+
+    RegisterGen gen;
+    gen.out = &func->registers;
+    gen.base = (int) func->localCount;
+    gen.stack = (int*) malloc(sizeof(int) * (max_depth + 1));
+    gen.depth = 0;
+    gen.lastResult = -1;
+    bool ok = true;
+
+    for (int offset = 0; ok && offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        gen.line = chunk->lines[offset];
+        if (targets[offset]) {
+            if (gen.depth != -1) {
+                materialize_range(&gen, 0, gen.depth);
+            }
+            gen.depth = depths[offset];
+            for (int i = 0; i < gen.depth; i++) {
+                gen.stack[i] = stack_register(&gen, i);
+            }
+            gen.lastResult = -1;
+        }
+        addresses[offset] = gen.out->count;
+        if (depths[offset] == -1) {
+            continue; // unreachable
+        }
+
+        uint8_t* code = &chunk->codes[offset];
+        int dest = stack_register(&gen, gen.depth); // the register of the next pushed value
+        switch (code[0]) {
+            case OP_CONSTANT: push_operand(&gen, RK_CONSTANT + code[1]); break;
+            case OP_NIL: push_result(&gen, ENCODE_ABC(ROP_LOADNIL, dest, 0, 0)); break;
+            case OP_TRUE: push_result(&gen, ENCODE_ABC(ROP_LOADBOOL, dest, 1, 0)); break;
+            case OP_FALSE: push_result(&gen, ENCODE_ABC(ROP_LOADBOOL, dest, 0, 0)); break;
+            case OP_LOAD_LOCAL: push_operand(&gen, code[1]); break;
+            case OP_LOAD_SCRIPT: push_result(&gen, ENCODE_ABC(ROP_GETSCRIPT, dest, code[1], 0)); break;
+            case OP_LOAD_UPVALUE: push_result(&gen, ENCODE_ABC(ROP_GETUPVAL, dest, code[1], 0)); break;
+            case OP_LOAD_GLOBAL: push_result(&gen, ENCODE_ABX(ROP_GETGLOBAL, dest, code[1])); break;
+            case OP_CLOSURE: push_result(&gen, ENCODE_ABX(ROP_CLOSURE, dest, code[1])); break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MODULO:
+            case OP_COMPARE:
+            case OP_LESS_THAN:
+            case OP_GREATER_THAN: {
+                RegOpCode op = code[0] == OP_ADD ? ROP_ADD : code[0] == OP_SUB ? ROP_SUB : code[0] == OP_MUL ? ROP_MUL :
+                               code[0] == OP_DIV ? ROP_DIV : code[0] == OP_MODULO ? ROP_MOD :
+                               code[0] == OP_COMPARE ? ROP_EQ : code[0] == OP_LESS_THAN ? ROP_LT : ROP_GT;
+                int c = pop_operand(&gen);
+                int b = pop_operand(&gen);
+                push_result(&gen, ENCODE_ABC(op, stack_register(&gen, gen.depth), b, c));
+                break;
+            }
+            case OP_NOT:
+            case OP_NEGATE: {
+                int b = pop_register(&gen);
+                push_result(&gen, ENCODE_ABC(code[0] == OP_NOT ? ROP_NOT : ROP_NEG, stack_register(&gen, gen.depth), b, 0));
+                break;
+            }
+            case OP_STORE_FAST:
+            case OP_ASSIGN_LOCAL: store_local(&gen, code[1]); break;
+            case OP_ASSIGN_SCRIPT: emit_register(&gen, ENCODE_ABC(ROP_SETSCRIPT, pop_register(&gen), code[1], 0)); break;
+            case OP_ASSIGN_UPVALUE: emit_register(&gen, ENCODE_ABC(ROP_SETUPVAL, pop_register(&gen), code[1], 0)); break;
+            case OP_ASSIGN_GLOBAL: emit_register(&gen, ENCODE_ABX(ROP_SETGLOBAL, pop_register(&gen), code[1])); break;
+            case OP_INCREMENT_LOCAL: {
+                materialize_local(&gen, code[1]);
+                emit_register(&gen, ENCODE_ABC(ROP_ADD, code[1], code[1], RK_CONSTANT + code[2]));
+                break;
+            }
+            case OP_POP_TOP:
+            case OP_END_FOR: pop_operand(&gen); break;
+            case OP_SHOW_TOP: emit_register(&gen, ENCODE_ABC(ROP_PRINT, pop_register(&gen), 0, 0)); break;
+            case OP_CALL: {
+                // a function may change captured locals, so nothing is left to read from them after the call
+                int callee = gen.depth - code[1] - 1;
+                materialize_range(&gen, 0, gen.depth);
+                emit_register(&gen, ENCODE_ABC(ROP_CALL, stack_register(&gen, callee), code[1], 0));
+                gen.depth = callee;
+                push_operand(&gen, stack_register(&gen, callee));
+                break;
+            }
+            case OP_INVOKE: {
+                int host = gen.depth - code[2] - 1;
+                materialize_range(&gen, host, gen.depth);
+                emit_register(&gen, ENCODE_ABC(ROP_INVOKE, stack_register(&gen, host), code[1], code[2]));
+                gen.depth = host;
+                push_operand(&gen, stack_register(&gen, host));
+                break;
+            }
+            case OP_LOAD_ATTR: {
+                int host = pop_register(&gen);
+                push_result(&gen, ENCODE_ABC(ROP_GETATTR, stack_register(&gen, gen.depth), host, code[1]));
+                break;
+            }
+            case OP_BUILD_ARRAY: {
+                int first = gen.depth - code[1];
+                materialize_range(&gen, first, gen.depth);
+                emit_register(&gen, ENCODE_ABC(ROP_BUILD_ARRAY, stack_register(&gen, first), code[1], 0));
+                gen.depth = first;
+                push_operand(&gen, stack_register(&gen, first));
+                break;
+            }
+            case OP_GET_ITER: {
+                int iterable = pop_register(&gen);
+                push_result(&gen, ENCODE_ABC(ROP_GET_ITER, stack_register(&gen, gen.depth), iterable, 0));
+                break;
+            }
+            case OP_FOR_ITER: {
+                materialize_range(&gen, 0, gen.depth);
+                emit_register_jump(&gen, ENCODE_ABX(ROP_FOR_ITER, stack_register(&gen, gen.depth - 1), 0),
+                                   jump_target(chunk, offset), patches, patch_targets, &patch_count);
+                push_operand(&gen, dest);
+                break;
+            }
+            case OP_JUMP:
+            case OP_JUMP_BACKWARD: {
+                materialize_range(&gen, 0, gen.depth);
+                emit_register_jump(&gen, ENCODE_ABX(ROP_JMP, 0, 0), jump_target(chunk, offset),
+                                   patches, patch_targets, &patch_count);
+                gen.depth = -1;
+                break;
+            }
+            case OP_POP_JUMP_IF_FALSE: {
+                int condition = pop_register(&gen);
+                materialize_range(&gen, 0, gen.depth);
+                emit_register_jump(&gen, ENCODE_ABX(ROP_JMP_IF_FALSE, condition, 0), jump_target(chunk, offset),
+                                   patches, patch_targets, &patch_count);
+                break;
+            }
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_GREATER: {
+                int c = pop_operand(&gen);
+                int b = pop_operand(&gen);
+                materialize_range(&gen, 0, gen.depth);
+                emit_register(&gen, ENCODE_ABC(code[0] == OP_JUMP_IF_NOT_LESS ? ROP_TEST_LT : ROP_TEST_GT, 0, b, c));
+                emit_register_jump(&gen, ENCODE_ABX(ROP_JMP, 0, 0), jump_target(chunk, offset),
+                                   patches, patch_targets, &patch_count);
+                break;
+            }
+            case OP_RETURN: {
+                emit_register(&gen, ENCODE_ABC(ROP_RETURN, pop_register(&gen), 0, 0));
+                gen.depth = -1;
+                break;
+            }
+            case OP_HALT: {
+                emit_register(&gen, ENCODE_ABC(ROP_HALT, 0, 0, 0));
+                gen.depth = -1;
+                break;
+            }
+            default:
+                ok = false; // the runtime only specializations never come out of the compiler
+        }
+    }
+
+    for (int i = 0; ok && i < patch_count; i++) {
+        uint32_t* jump = &func->registers.codes[patches[i]];
+        int jmp_size = addresses[patch_targets[i]] - (patches[i] + 1);
+        *jump = (*jump & 0x3fff) | ((uint32_t) (jmp_size + SBX_BIAS) << 14);
+    }
+
+    free(gen.stack);
+    free(patch_targets);
+    free(patches);
+    free(addresses);
+    free(targets);
+    free(depths);
+    if (!ok) {
+        free_register_chunk(&func->registers);
+    }
+    return ok;
+}
+
+bool compile_registers(FunctionObj* func) {
+    bool ok = generate_registers(func);
+    for (int i = 0; i < func->body.constants.count; i++) {
+        if (IS_FUNCTION(func->body.constants.arr[i])) {
+            ok = compile_registers(AS_FUNCTION(func->body.constants.arr[i])) && ok;
+        }
+    }
+    return ok;
+}
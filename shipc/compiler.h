@@ -9,4 +9,11 @@
 
 FunctionObj* compile(const char* source);
 
+// the operand stack depth before every offset of the chunk, -1 for unreachable ones and operand bytes.
+// max_stack_depth is set to the deepest it gets. the caller frees the array
+int* compute_stack_depths(Chunk* chunk, int* max_stack_depth);
+
+// translates the compiled script and its functions to register code. false if some function can't be translated
+bool compile_registers(FunctionObj* func);
+
 #endif 
\ No newline at end of file
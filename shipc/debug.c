@@ -1,8 +1,58 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "debug.h"
 #include "objects.h"
 
+static const char* opcode_names[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_MUL] = "OP_MUL",
+    [OP_POP_TOP] = "OP_POP_TOP",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_CALL] = "OP_CALL",
+    [OP_NIL] = "OP_NIL",
+    [OP_ADD] = "OP_ADD",
+    [OP_MODULO] = "OP_MODULO",
+    [OP_SUB] = "OP_SUB",
+    [OP_STORE_FAST] = "OP_STORE_FAST",
+    [OP_LOAD_LOCAL] = "OP_LOAD_LOCAL",
+    [OP_LOAD_GLOBAL] = "OP_LOAD_GLOBAL",
+    [OP_ASSIGN_GLOBAL] = "OP_ASSIGN_GLOBAL",
+    [OP_ASSIGN_LOCAL] = "OP_ASSIGN_LOCAL",
+    [OP_JUMP_BACKWARD] = "OP_JUMP_BACKWARD",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_GET_ITER] = "OP_GET_ITER",
+    [OP_FOR_ITER] = "OP_FOR_ITER",
+    [OP_END_FOR] = "OP_END_FOR",
+    [OP_BUILD_ARRAY] = "OP_BUILD_ARRAY",
+    [OP_LOAD_ATTR] = "OP_LOAD_ATTR",
+    [OP_DIV] = "OP_DIV",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_SHOW_TOP] = "OP_SHOW_TOP",
+    [OP_COMPARE] = "OP_COMPARE",
+    [OP_GREATER_THAN] = "OP_GREATER_THAN",
+    [OP_LESS_THAN] = "OP_LESS_THAN",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_NOT] = "OP_NOT",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_LOAD_UPVALUE] = "OP_LOAD_UPVALUE",
+    [OP_ASSIGN_UPVALUE] = "OP_ASSIGN_UPVALUE",
+    [OP_LOAD_SCRIPT] = "OP_LOAD_SCRIPT",
+    [OP_ASSIGN_SCRIPT] = "OP_ASSIGN_SCRIPT",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_SUB_NUM] = "OP_SUB_NUM",
+    [OP_MUL_NUM] = "OP_MUL_NUM",
+    [OP_LESS_THAN_NUM] = "OP_LESS_THAN_NUM",
+    [OP_GREATER_THAN_NUM] = "OP_GREATER_THAN_NUM",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_INCREMENT_LOCAL] = "OP_INCREMENT_LOCAL",
+    [OP_HALT] = "OP_HALT",
+};
 
 
 
@@ -19,6 +69,7 @@ static int byte_instruction(Chunk* chunk, const char* string, int offset) {
 static void print_obj(Chunk* chunk, Value val, int offset, char* message) {
 	uint8_t i = chunk->codes[offset + 1];
 	switch (AS_OBJ(val)->type) {
+        case OBJ_ROPE: // AS_STRING flattens it
         case OBJ_STRING: {
             StringObj *obj = AS_STRING(val);
             printf("| %04d %s %u (%.*s) |\n", offset, message, i , obj->length, obj->value);
@@ -29,6 +80,14 @@ static void print_obj(Chunk* chunk, Value val, int offset, char* message) {
             disassemble_func(obj);
             break;
         }
+        case OBJ_CLOSURE: {
+            disassemble_func(AS_CLOSURE(val)->function);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            printf("| %04d %s %u (<upvalue>) |\n", offset, message, i);
+            break;
+        }
         case OBJ_ERROR:
             break;
     }
@@ -49,10 +108,25 @@ static int global_variable_instruction(FunctionObj* func, char* op_code, int off
     return 2;
 }
 
+static int invoke_instruction(FunctionObj* func, int offset) {
+    uint8_t index = func->body.codes[offset + 1];
+    StringObj* name = AS_STRING(func->body.constants.arr[index]);
+    printf("| %04d OP_INVOKE %u (%.*s) args: %u |\n", offset, index, name->length, name->value, func->body.codes[offset + 2]);
+    return 3;
+}
+
+static int increment_instruction(FunctionObj* func, int offset) {
+    uint8_t index = func->body.codes[offset + 1];
+    Local local_var = func->locals[index];
+    double amount = AS_NUMBER(func->body.constants.arr[func->body.codes[offset + 2]]);
+    printf("| %04d OP_INCREMENT_LOCAL %u (%.*s) by %.2f |\n", offset, index, local_var.length, local_var.name, amount);
+    return 3;
+}
+
 static int constant_instruction(Chunk* chunk, int offset) {
 	uint8_t index = chunk->codes[offset + 1];
 	Value val = chunk->constants.arr[index];
-	switch (val.type) {
+	switch (VALUE_TYPE(val)) {
 	case VAL_BOOL: printf("| %04d OP_CONSTANT %u (%s) |\n", offset, index, AS_BOOL(val) ? "true" : "false"); break;
 	case VAL_NIL: printf("| %04d OP_CONSTANT %u (nil) |\n", offset, index); break;
 	case VAL_NUMBER: printf("| %04d OP_CONSTANT %u (%.2f) |\n", offset, index, AS_NUMBER(val)); break;
@@ -61,6 +135,20 @@ static int constant_instruction(Chunk* chunk, int offset) {
 	return 2;
 }
 
+static int closure_instruction(FunctionObj* func, int offset) {
+    Chunk* chunk = &func->body;
+    FunctionObj* inner = AS_FUNCTION(chunk->constants.arr[chunk->codes[offset + 1]]);
+    uint8_t upvalue_count = chunk->codes[offset + 2];
+    disassemble_func(inner);
+    printf("| %04d OP_CLOSURE %u (%.*s) |\n", offset, chunk->codes[offset + 1], inner->name->length, inner->name->value);
+    for (int i = 0; i < upvalue_count; i++) {
+        uint8_t is_local = chunk->codes[offset + 3 + i * 2];
+        uint8_t index = chunk->codes[offset + 4 + i * 2];
+        printf("|        %s %u |\n", is_local ? "local" : "upvalue", index);
+    }
+    return 3 + upvalue_count * 2;
+}
+
 static int jump_instruction(Chunk* chunk, char* op_code, int offset) {
 	uint8_t d1 = chunk->codes[offset + 1];
 	uint8_t d2 = chunk->codes[offset + 2];
@@ -79,6 +167,15 @@ static int disassemble_instruction(FunctionObj * func, int offset) {
 		case OP_DIV: return simple_instruction("OP_DIV", offset);
 		case OP_MUL: return simple_instruction("OP_MUL", offset);
         case OP_LOAD_ATTR: return global_variable_instruction(func, "OP_LOAD_ATTR", offset);
+        case OP_INVOKE: return invoke_instruction(func, offset);
+        case OP_ADD_NUM: return simple_instruction("OP_ADD_NUM", offset);
+        case OP_SUB_NUM: return simple_instruction("OP_SUB_NUM", offset);
+        case OP_MUL_NUM: return simple_instruction("OP_MUL_NUM", offset);
+        case OP_LESS_THAN_NUM: return simple_instruction("OP_LESS_THAN_NUM", offset);
+        case OP_GREATER_THAN_NUM: return simple_instruction("OP_GREATER_THAN_NUM", offset);
+        case OP_JUMP_IF_NOT_LESS: return jump_instruction(&func->body, "JUMP_IF_NOT_LESS", offset);
+        case OP_JUMP_IF_NOT_GREATER: return jump_instruction(&func->body, "JUMP_IF_NOT_GREATER", offset);
+        case OP_INCREMENT_LOCAL: return increment_instruction(func, offset);
         case OP_LESS_THAN: return simple_instruction("OP_LESS_THAN", offset);
         case OP_GREATER_THAN: return simple_instruction("OP_GREATER_THAN", offset);
 		case OP_FALSE: return simple_instruction("OP_FALSE", offset);
@@ -103,6 +200,11 @@ static int disassemble_instruction(FunctionObj * func, int offset) {
 		case OP_COMPARE: return simple_instruction("OP_COMPARE", offset);
         case OP_RETURN: return simple_instruction("OP_RETURN", offset);
 		case OP_CONSTANT: return constant_instruction(&func->body, offset);
+        case OP_CLOSURE: return closure_instruction(func, offset);
+        case OP_LOAD_UPVALUE: return byte_instruction(&func->body, "OP_LOAD_UPVALUE", offset);
+        case OP_ASSIGN_UPVALUE: return byte_instruction(&func->body, "OP_ASSIGN_UPVALUE", offset);
+        case OP_LOAD_SCRIPT: return byte_instruction(&func->body, "OP_LOAD_SCRIPT", offset);
+        case OP_ASSIGN_SCRIPT: return byte_instruction(&func->body, "OP_ASSIGN_SCRIPT", offset);
         default: {
             printf("Uncaught opcode %u", code);
             return 1;
@@ -118,4 +220,121 @@ void disassemble_func(FunctionObj* obj) {
 		i += disassemble_instruction(obj, i);
 	}
     printf("=== end function %.*s ===\n", obj->name->length, obj->name->value);
-}
\ No newline at end of file
+}
+static const char* register_opcode_names[] = {
+    [ROP_MOVE] = "MOVE", [ROP_LOADK] = "LOADK", [ROP_LOADNIL] = "LOADNIL", [ROP_LOADBOOL] = "LOADBOOL",
+    [ROP_ADD] = "ADD", [ROP_SUB] = "SUB", [ROP_MUL] = "MUL", [ROP_DIV] = "DIV", [ROP_MOD] = "MOD",
+    [ROP_LT] = "LT", [ROP_GT] = "GT", [ROP_EQ] = "EQ", [ROP_NOT] = "NOT", [ROP_NEG] = "NEG",
+    [ROP_JMP] = "JMP", [ROP_JMP_IF_FALSE] = "JMP_IF_FALSE", [ROP_TEST_LT] = "TEST_LT", [ROP_TEST_GT] = "TEST_GT",
+    [ROP_GETGLOBAL] = "GETGLOBAL", [ROP_SETGLOBAL] = "SETGLOBAL", [ROP_GETUPVAL] = "GETUPVAL",
+    [ROP_SETUPVAL] = "SETUPVAL", [ROP_GETSCRIPT] = "GETSCRIPT", [ROP_SETSCRIPT] = "SETSCRIPT",
+    [ROP_CLOSURE] = "CLOSURE", [ROP_CALL] = "CALL", [ROP_INVOKE] = "INVOKE", [ROP_GETATTR] = "GETATTR",
+    [ROP_BUILD_ARRAY] = "BUILD_ARRAY", [ROP_GET_ITER] = "GET_ITER", [ROP_FOR_ITER] = "FOR_ITER",
+    [ROP_RETURN] = "RETURN", [ROP_PRINT] = "PRINT", [ROP_HALT] = "HALT",
+};
+
+static void print_register_operand(unsigned int operand) {
+    if (operand >= RK_CONSTANT) {
+        printf(" k%u", operand - RK_CONSTANT);
+    } else {
+        printf(" r%u", operand);
+    }
+}
+
+void disassemble_registers(FunctionObj* obj) {
+    printf("=== register code %.*s l(%i) ===\n", obj->name->length, obj->name->value, obj->registers.count);
+    for (int i = 0; i < obj->registers.count; i++) {
+        uint32_t code = obj->registers.codes[i];
+        printf("%04d %4d %-12s r%u", i, obj->registers.lines[i], register_opcode_names[REG_OP(code)], REG_A(code));
+        switch (REG_OP(code)) {
+            case ROP_LOADK: case ROP_GETGLOBAL: case ROP_SETGLOBAL: case ROP_CLOSURE:
+                printf(" k%u", REG_BX(code));
+                break;
+            case ROP_JMP: case ROP_JMP_IF_FALSE: case ROP_FOR_ITER:
+                printf(" -> %04d", i + 1 + REG_SBX(code));
+                break;
+            default:
+                print_register_operand(REG_B(code));
+                print_register_operand(REG_C(code));
+        }
+        printf("\n");
+    }
+    for (int i = 0; i < obj->body.constants.count; i++) {
+        if (IS_FUNCTION(obj->body.constants.arr[i])) {
+            disassemble_registers(AS_FUNCTION(obj->body.constants.arr[i]));
+        }
+    }
+}
+
+// n-gram mining, used to pick which instruction sequences are worth a superinstruction
+typedef struct {
+    uint8_t codes[NGRAM_MAX];
+    int count;
+} NGram;
+
+typedef struct {
+    NGram* grams;
+    int count;
+    int capacity;
+} NGramTable;
+
+static void add_ngram(NGramTable* table, const uint8_t* codes, int n) {
+    for (int i = 0; i < table->count; i++) {
+        if (memcmp(table->grams[i].codes, codes, n) == 0) {
+            table->grams[i].count++;
+            return;
+        }
+    }
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity < 8 ? 8 : table->capacity * 2;
+        table->grams = realloc(table->grams, table->capacity * sizeof(NGram));
+    }
+    memcpy(table->grams[table->count].codes, codes, n);
+    table->grams[table->count].count = 1;
+    table->count++;
+}
+
+static void count_ngrams(FunctionObj* func, int n, NGramTable* table) {
+    Chunk* chunk = &func->body;
+    uint8_t window[NGRAM_MAX];
+    int filled = 0;
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        if (filled == n) {
+            memmove(window, window + 1, n - 1);
+            filled--;
+        }
+        window[filled++] = chunk->codes[offset];
+        if (filled == n) {
+            add_ngram(table, window, n);
+        }
+    }
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (IS_FUNCTION(chunk->constants.arr[i])) {
+            count_ngrams(AS_FUNCTION(chunk->constants.arr[i]), n, table);
+        }
+    }
+}
+
+static int compare_ngrams(const void* a, const void* b) {
+    return ((const NGram*) b)->count - ((const NGram*) a)->count;
+}
+
+void print_ngrams(FunctionObj* obj, int n) {
+    if (n < 1 || n > NGRAM_MAX) {
+        printf("n-gram length must be between 1 and %i\n", NGRAM_MAX);
+        return;
+    }
+    NGramTable table = {NULL, 0, 0};
+    count_ngrams(obj, n, &table);
+    qsort(table.grams, table.count, sizeof(NGram), compare_ngrams);
+
+    printf("=== most frequent %i-grams ===\n", n);
+    for (int i = 0; i < table.count && i < NGRAM_SHOWN; i++) {
+        printf("%6i ", table.grams[i].count);
+        for (int j = 0; j < n; j++) {
+            printf(" %s", opcode_names[table.grams[i].codes[j]]);
+        }
+        printf("\n");
+    }
+    free(table.grams);
+}
@@ -5,8 +5,17 @@
 #include "chunk.h"
 #include "compiler.h"
 
+#define NGRAM_MAX 4
+#define NGRAM_SHOWN 20
+
 void disassemble_func(FunctionObj* obj );
 
+// prints the register code made by compile_registers, for the script and every function nested in it
+void disassemble_registers(FunctionObj* obj);
+
+// prints the most frequent sequences of n instructions in the compiled script, counted statically over its bytecode
+void print_ngrams(FunctionObj* obj, int n);
+
 
 #endif // !SHIP_DEBUG_H_
 
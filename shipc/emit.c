@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "emit.h"
+#include "memory.h"
+
+#ifdef SHIP_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+
+void init_code_buffer(CodeBuffer* buf) {
+    buf->bytes = NULL;
+    buf->count = 0;
+    buf->capacity = 0;
+    buf->patches = NULL;
+    buf->patchCount = 0;
+    buf->patchCapacity = 0;
+}
+
+void free_code_buffer(CodeBuffer* buf) {
+    free(buf->bytes);
+    free(buf->patches);
+    init_code_buffer(buf);
+}
+
+uint8_t* map_code(CodeBuffer* buf, size_t* size) {
+    // map the code writable, then flip it to executable
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    *size = (buf->count + page_size - 1) / page_size * page_size;
+    uint8_t* code = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(code, buf->bytes, buf->count);
+    if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, *size);
+        return NULL;
+    }
+    return code;
+}
+
+void unmap_code(uint8_t* code, size_t size) {
+    munmap(code, size);
+}
+
+// <---- x86-64 encoding ----->
+void emit_byte(CodeBuffer* buf, uint8_t byte) {
+    if (buf->count == buf->capacity) {
+        buf->capacity = GROW_CAPACITY(buf->capacity);
+        buf->bytes = realloc(buf->bytes, buf->capacity);
+    }
+    buf->bytes[buf->count++] = byte;
+}
+
+void emit_bytes(CodeBuffer* buf, const uint8_t* bytes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        emit_byte(buf, bytes[i]);
+    }
+}
+
+void emit_u32(CodeBuffer* buf, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emit_byte(buf, (uint8_t) (value >> (8 * i)));
+    }
+}
+
+void emit_u64(CodeBuffer* buf, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emit_byte(buf, (uint8_t) (value >> (8 * i)));
+    }
+}
+
+static void emit_rex(CodeBuffer* buf, bool wide, int reg, int base) {
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg & 8 ? 0x04 : 0) | (base & 8 ? 0x01 : 0);
+    if (rex != 0x40) {
+        emit_byte(buf, rex);
+    }
+}
+
+static void emit_opcode(CodeBuffer* buf, uint16_t opcode) {
+    if (opcode > 0xff) {
+        emit_byte(buf, opcode >> 8);
+    }
+    emit_byte(buf, opcode & 0xff);
+}
+
+void emit_mem(CodeBuffer* buf, uint8_t prefix, bool wide, uint16_t opcode, int reg, int base, int32_t disp) {
+    if (prefix != 0) {
+        emit_byte(buf, prefix);
+    }
+    emit_rex(buf, wide, reg, base);
+    emit_opcode(buf, opcode);
+    emit_byte(buf, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) {
+        emit_byte(buf, 0x24); // rsp and r12 as a base need a sib byte
+    }
+    emit_u32(buf, (uint32_t) disp);
+}
+
+void emit_load(CodeBuffer* buf, int reg, int base, int32_t disp) {
+    emit_mem(buf, 0, true, X86_MOV_LOAD, reg, base, disp);
+}
+
+void emit_store(CodeBuffer* buf, int base, int32_t disp, int reg) {
+    emit_mem(buf, 0, true, X86_MOV_STORE, reg, base, disp);
+}
+
+void emit_mov_imm64(CodeBuffer* buf, int reg, uint64_t value) {
+    emit_rex(buf, true, 0, reg);
+    emit_byte(buf, 0xb8 | (reg & 7));
+    emit_u64(buf, value);
+}
+
+void emit_alu(CodeBuffer* buf, uint8_t opcode, int dst, int src) {
+    emit_rex(buf, true, src, dst);
+    emit_byte(buf, opcode);
+    emit_byte(buf, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+void emit_movsxd(CodeBuffer* buf, int dst, int src) {
+    emit_rex(buf, true, dst, src);
+    emit_byte(buf, 0x63);
+    emit_byte(buf, 0xc0 | (dst & 7) << 3 | (src & 7));
+}
+
+void emit_shl(CodeBuffer* buf, int reg, uint8_t count) {
+    emit_rex(buf, true, 0, reg);
+    emit_byte(buf, 0xc1);
+    emit_byte(buf, 0xe0 | (reg & 7));
+    emit_byte(buf, count);
+}
+
+void emit_call(CodeBuffer* buf, void* function) {
+    emit_mov_imm64(buf, RAX, (uint64_t) (uintptr_t) function);
+    emit_byte(buf, 0xff); // call rax
+    emit_byte(buf, 0xd0);
+}
+
+void emit_cmp_eax(CodeBuffer* buf, uint8_t value) {
+    emit_byte(buf, 0x83);
+    emit_byte(buf, 0xf8);
+    emit_byte(buf, value);
+}
+
+static uint8_t sse_prefix(uint16_t opcode) {
+    // the packed double and compare ops take 0x66, the scalar double ones 0xf2
+    return opcode == X86_UCOMISD || opcode == X86_MOVAPD || opcode == X86_XORPD ? 0x66 : 0xf2;
+}
+
+void emit_sse(CodeBuffer* buf, uint16_t opcode, int xmm, int base, int32_t disp) {
+    emit_mem(buf, sse_prefix(opcode), false, opcode, xmm, base, disp);
+}
+
+void emit_sse_reg(CodeBuffer* buf, uint16_t opcode, int dst, int src) {
+    emit_byte(buf, sse_prefix(opcode));
+    emit_rex(buf, false, dst, src);
+    emit_opcode(buf, opcode);
+    emit_byte(buf, 0xc0 | (dst & 7) << 3 | (src & 7));
+}
+
+void emit_movq_xmm(CodeBuffer* buf, int xmm, int reg) {
+    emit_byte(buf, 0x66);
+    emit_rex(buf, true, xmm, reg);
+    emit_opcode(buf, 0x0f6e);
+    emit_byte(buf, 0xc0 | (xmm & 7) << 3 | (reg & 7));
+}
+
+int emit_jump(CodeBuffer* buf) {
+    emit_byte(buf, 0xe9);
+    emit_u32(buf, 0);
+    return buf->count - 4;
+}
+
+int emit_jcc(CodeBuffer* buf, Condition cc) {
+    emit_byte(buf, 0x0f);
+    emit_byte(buf, 0x80 | cc);
+    emit_u32(buf, 0);
+    return buf->count - 4;
+}
+
+void patch_rel32(CodeBuffer* buf, int at, int target) {
+    int32_t rel = target - (at + 4);
+    memcpy(buf->bytes + at, &rel, sizeof(rel));
+}
+
+void patch_here(CodeBuffer* buf, int at) {
+    patch_rel32(buf, at, buf->count);
+}
+
+void add_patch(CodeBuffer* buf, int at, int target) {
+    if (buf->patchCount == buf->patchCapacity) {
+        buf->patchCapacity = GROW_CAPACITY(buf->patchCapacity);
+        buf->patches = realloc(buf->patches, buf->patchCapacity * sizeof(CodePatch));
+    }
+    buf->patches[buf->patchCount++] = (CodePatch) {at, target};
+}
+
+void emit_prologue(CodeBuffer* buf, int32_t spill_bytes) {
+    // five pushes and the return address keep rsp 16 byte aligned, r15 is only pushed for that
+    const uint8_t prologue[] = {
+        0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push rbx, r12, r13, r14, r15
+        0x49, 0x89, 0xfd, // mov r13, rdi
+        0x49, 0x89, 0xf6, // mov r14, rsi
+    };
+    emit_bytes(buf, prologue, sizeof(prologue));
+    if (spill_bytes > 0) {
+        emit_mem(buf, 0, true, X86_LEA, RSP, RSP, -spill_bytes);
+    }
+    emit_load(buf, RBX, R13, offsetof(VM, sp));
+    emit_load(buf, R12, R14, offsetof(StackFrame, slots));
+}
+
+void emit_epilogue(CodeBuffer* buf, int32_t spill_bytes) {
+    if (spill_bytes > 0) {
+        emit_mem(buf, 0, true, X86_LEA, RSP, RSP, spill_bytes);
+    }
+    const uint8_t epilogue[] = {
+        0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, // pop r15, r14, r13, r12, rbx
+        0xc3, // ret
+    };
+    emit_bytes(buf, epilogue, sizeof(epilogue));
+}
+// <------------------------------------>
+
+
+// <---- value stencils ----->
+void emit_copy_value(CodeBuffer* buf, int dst, int32_t dst_disp, int src, int32_t src_disp) {
+    // through rax and rcx
+    for (int32_t i = 0; i < VALUE_SIZE; i += 8) {
+        emit_load(buf, i == 0 ? RAX : RCX, src, src_disp + i);
+    }
+    for (int32_t i = 0; i < VALUE_SIZE; i += 8) {
+        emit_store(buf, dst, dst_disp + i, i == 0 ? RAX : RCX);
+    }
+}
+
+void emit_store_value(CodeBuffer* buf, int dst, int32_t disp, Value value) {
+    uint64_t words[sizeof(Value) / 8] = {0};
+    memcpy(words, &value, sizeof(Value));
+    for (int i = 0; i < VALUE_SIZE / 8; i++) {
+        emit_mov_imm64(buf, RAX, words[i]);
+        emit_store(buf, dst, disp + 8 * i, RAX);
+    }
+}
+
+int emit_number_guard(CodeBuffer* buf, int base, int32_t disp) {
+#ifdef SHIP_NAN_BOXING
+    emit_load(buf, RAX, base, disp);
+    emit_mov_imm64(buf, RCX, QNAN);
+    emit_alu(buf, X86_AND, RAX, RCX);
+    emit_alu(buf, X86_CMP, RAX, RCX);
+    return emit_jcc(buf, CC_E);
+#else
+    emit_mem(buf, 0, false, 0x83, 7, base, disp); // cmp dword [base + disp], imm8
+    emit_byte(buf, VAL_NUMBER);
+    return emit_jcc(buf, CC_NE);
+#endif
+}
+
+void emit_store_number(CodeBuffer* buf, int base, int32_t disp, int xmm) {
+    emit_sse(buf, X86_MOVSD_STORE, xmm, base, disp + NUMBER_OFFSET);
+#ifndef SHIP_NAN_BOXING
+    emit_mem(buf, 0, false, X86_MOV_STORE_IMM, 0, base, disp);
+    emit_u32(buf, VAL_NUMBER);
+#endif
+}
+// <------------------------------------>
+
+#endif
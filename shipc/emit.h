@@ -0,0 +1,132 @@
+#pragma once
+#ifndef SHIP_EMIT_H_
+#define SHIP_EMIT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jit.h"
+
+// x86-64 machine code emission, shared by the baseline jit (jit.c) and the trace compiler (trace.c).
+// only built where SHIP_JIT is defined.
+#ifdef SHIP_JIT
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+// condition codes, added to the jcc and setcc op codes
+typedef enum {
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_P = 0xa,
+    CC_NP = 0xb,
+    CC_GE = 0xd,
+} Condition;
+
+// op codes of the instructions with a memory operand, two byte ones start with 0x0f
+#define X86_MOV_STORE 0x89
+#define X86_MOV_LOAD 0x8b
+#define X86_LEA 0x8d
+#define X86_MOV_STORE_IMM 0xc7
+#define X86_CMP_LOAD 0x3b // cmp reg, [base + disp]
+#define X86_MOVSD_LOAD 0x0f10
+#define X86_MOVSD_STORE 0x0f11
+#define X86_UCOMISD 0x0f2e
+#define X86_ADDSD 0x0f58
+#define X86_MULSD 0x0f59
+#define X86_SUBSD 0x0f5c
+#define X86_DIVSD 0x0f5e
+// sse register to register op codes, besides the ones above
+#define X86_MOVAPD 0x0f28
+#define X86_XORPD 0x0f57
+// register to register alu op codes
+#define X86_ADD 0x01
+#define X86_OR 0x09
+#define X86_AND 0x21
+#define X86_CMP 0x39
+
+// while machine code runs:
+//   rbx = vm->sp, written back before calling into C
+//   r12 = frame->slots
+//   r13 = vm
+//   r14 = frame
+// rsp is 16 byte aligned after the prologue, so the code can call into C as is.
+
+#define VALUE_SIZE ((int32_t) sizeof(Value))
+#ifdef SHIP_NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((int32_t) offsetof(Value, as))
+#endif
+
+// a rel32 displacement to fill in once the offset of its target is known
+typedef struct {
+    int at;
+    int target; // what the target is is up to the user of the buffer
+} CodePatch;
+
+typedef struct {
+    uint8_t* bytes;
+    int count;
+    int capacity;
+
+    CodePatch* patches;
+    int patchCount;
+    int patchCapacity;
+} CodeBuffer;
+
+void init_code_buffer(CodeBuffer* buf);
+void free_code_buffer(CodeBuffer* buf);
+// copies the code to new executable memory, NULL if it couldn't be mapped. size is set to the mapped size
+uint8_t* map_code(CodeBuffer* buf, size_t* size);
+void unmap_code(uint8_t* code, size_t size);
+
+void emit_byte(CodeBuffer* buf, uint8_t byte);
+void emit_bytes(CodeBuffer* buf, const uint8_t* bytes, size_t count);
+void emit_u32(CodeBuffer* buf, uint32_t value);
+void emit_u64(CodeBuffer* buf, uint64_t value);
+
+// an instruction with a [base + disp32] operand, reg goes into the modrm reg field.
+// prefix is the mandatory prefix of sse instructions, 0 for none
+void emit_mem(CodeBuffer* buf, uint8_t prefix, bool wide, uint16_t opcode, int reg, int base, int32_t disp);
+void emit_load(CodeBuffer* buf, int reg, int base, int32_t disp);
+void emit_store(CodeBuffer* buf, int base, int32_t disp, int reg);
+void emit_mov_imm64(CodeBuffer* buf, int reg, uint64_t value);
+void emit_alu(CodeBuffer* buf, uint8_t opcode, int dst, int src); // dst = dst op src, mov included
+void emit_movsxd(CodeBuffer* buf, int dst, int src); // dst = src sign extended from 32 bits
+void emit_shl(CodeBuffer* buf, int reg, uint8_t count);
+void emit_call(CodeBuffer* buf, void* function); // through rax
+void emit_cmp_eax(CodeBuffer* buf, uint8_t value);
+// xmm op [base + disp], and movsd between xmm and memory
+void emit_sse(CodeBuffer* buf, uint16_t opcode, int xmm, int base, int32_t disp);
+// dst = dst op src on xmm registers
+void emit_sse_reg(CodeBuffer* buf, uint16_t opcode, int dst, int src);
+void emit_movq_xmm(CodeBuffer* buf, int xmm, int reg); // xmm = the bits of reg
+
+// jumps return where their rel32 is, for patch_here or add_patch
+int emit_jump(CodeBuffer* buf);
+int emit_jcc(CodeBuffer* buf, Condition cc);
+void patch_rel32(CodeBuffer* buf, int at, int target);
+void patch_here(CodeBuffer* buf, int at);
+void add_patch(CodeBuffer* buf, int at, int target);
+
+// entry and exit of generated code called as InterpretResult (*)(VM*, StackFrame*, ...).
+// the prologue reserves spill_bytes (a multiple of 16) of stack at [rsp]
+void emit_prologue(CodeBuffer* buf, int32_t spill_bytes);
+void emit_epilogue(CodeBuffer* buf, int32_t spill_bytes); // returns eax
+
+// stencils on boxed Values
+void emit_copy_value(CodeBuffer* buf, int dst, int32_t dst_disp, int src, int32_t src_disp);
+void emit_store_value(CodeBuffer* buf, int dst, int32_t disp, Value value);
+// jumps away when the Value at [base + disp] is not a number, returns the jump to patch
+int emit_number_guard(CodeBuffer* buf, int base, int32_t disp);
+// boxes the double in xmm as a number Value at [base + disp]
+void emit_store_number(CodeBuffer* buf, int base, int32_t disp, int xmm);
+
+#endif
+
+#endif // !SHIP_EMIT_H_
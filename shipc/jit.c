@@ -0,0 +1,307 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "emit.h"
+
+#ifdef SHIP_JIT
+
+// A template ("copy and patch") baseline jit. every instruction is translated by copying its stencil, a fixed
+// sequence of machine code, and patching the holes in it: slot offsets, constants, the bytecode address handed to
+// jit_step and jump displacements. nothing is kept in registers across instructions, values stay in the frame's
+// stack window exactly like in run(), so the machine code can hand over to run() at any instruction boundary
+// and take over again at any other (see emit.h for the registers it keeps).
+//
+// calls, returns and OP_HALT switch frames, the machine code leaves those to run(). every other instruction
+// either has an inline stencil, with a call to jit_step as its slow path, or is only a call to jit_step.
+
+typedef struct JitCode {
+    uint8_t* code; // executable memory, the entry stub is at offset 0
+    size_t size;
+    uint32_t* offsets; // native offset of the instruction at each bytecode offset
+} JitCode;
+
+typedef InterpretResult (*JitEntry)(VM* vm, StackFrame* frame, uint8_t* target);
+
+// jump targets that are not bytecode offsets
+#define TARGET_ERROR (-1) // returns RESULT_ERROR, the error was pushed by jit_step
+#define TARGET_EPILOGUE (-2) // returns with eax as set
+
+// <---- value stencils ----->
+// moves rbx by a number of values, without touching the flags
+static void emit_move_sp(CodeBuffer* buf, int values) {
+    emit_mem(buf, 0, true, X86_LEA, RBX, RBX, values * VALUE_SIZE);
+}
+
+// stores whether cc holds as a bool Value to [base + disp]
+static void emit_store_condition(CodeBuffer* buf, Condition cc, int base, int32_t disp) {
+    emit_byte(buf, 0x0f); // setcc al
+    emit_byte(buf, 0x90 | cc);
+    emit_byte(buf, 0xc0);
+#ifdef SHIP_NAN_BOXING
+    emit_byte(buf, 0x0f); // movzx eax, al
+    emit_byte(buf, 0xb6);
+    emit_byte(buf, 0xc0);
+    emit_mov_imm64(buf, RCX, FALSE_VAL);
+    emit_alu(buf, X86_OR, RAX, RCX); // FALSE_VAL | 1 is TRUE_VAL
+    emit_store(buf, base, disp, RAX);
+#else
+    emit_mem(buf, 0, false, 0x88, RAX, base, disp + NUMBER_OFFSET); // mov byte [base + disp], al
+    emit_mem(buf, 0, false, X86_MOV_STORE_IMM, 0, base, disp);
+    emit_u32(buf, VAL_BOOL);
+#endif
+}
+// <------------------------------------>
+
+
+// <---- instruction stencils ----->
+// hands the instruction at ip to jit_step, and goes to the error exit when it fails
+static void emit_step(CodeBuffer* buf, uint8_t* ip) {
+    emit_store(buf, R13, offsetof(VM, sp), RBX);
+    emit_alu(buf, X86_MOV_STORE, RDI, R13);
+    emit_alu(buf, X86_MOV_STORE, RSI, R14);
+    emit_mov_imm64(buf, RDX, (uint64_t) (uintptr_t) ip);
+    emit_call(buf, (void*) jit_step);
+    emit_load(buf, RBX, R13, offsetof(VM, sp));
+    emit_cmp_eax(buf, JIT_FAILED);
+    add_patch(buf, emit_jcc(buf, CC_E), TARGET_ERROR);
+}
+
+// leaves the instruction at ip to run()
+static void emit_exit(CodeBuffer* buf, uint8_t* ip) {
+    emit_mov_imm64(buf, RAX, (uint64_t) (uintptr_t) ip);
+    emit_store(buf, R14, offsetof(StackFrame, ip), RAX);
+    emit_store(buf, R13, offsetof(VM, sp), RBX);
+    emit_byte(buf, 0x31); // xor eax, eax
+    emit_byte(buf, 0xc0);
+    add_patch(buf, emit_jump(buf), TARGET_EPILOGUE);
+}
+
+static void emit_instruction(CodeBuffer* buf, Chunk* chunk, int offset, bool exit_at_loops) {
+    uint8_t* ip = chunk->codes + offset;
+    int slow[2]; // jumps from a fast path to the jit_step call
+    int slow_count = 0;
+    int done = -1; // jump from the end of a fast path over the jit_step call
+
+    switch (ip[0]) {
+        case OP_CONSTANT:
+            emit_store_value(buf, RBX, 0, chunk->constants.arr[ip[1]]);
+            emit_move_sp(buf, 1);
+            return;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            emit_store_value(buf, RBX, 0, ip[0] == OP_NIL ? VAR_NIL : VAR_BOOL(ip[0] == OP_TRUE));
+            emit_move_sp(buf, 1);
+            return;
+        case OP_POP_TOP:
+        case OP_END_FOR:
+            emit_move_sp(buf, -1);
+            return;
+        case OP_LOAD_LOCAL:
+            emit_copy_value(buf, RBX, 0, R12, ip[1] * VALUE_SIZE);
+            emit_move_sp(buf, 1);
+            return;
+        case OP_STORE_FAST:
+        case OP_ASSIGN_LOCAL:
+            emit_move_sp(buf, -1);
+            emit_copy_value(buf, R12, ip[1] * VALUE_SIZE, RBX, 0);
+            return;
+        case OP_LOAD_SCRIPT:
+            emit_copy_value(buf, RBX, 0, R13, offsetof(VM, stack) + ip[1] * VALUE_SIZE);
+            emit_move_sp(buf, 1);
+            return;
+        case OP_ASSIGN_SCRIPT:
+            emit_move_sp(buf, -1);
+            emit_copy_value(buf, R13, offsetof(VM, stack) + ip[1] * VALUE_SIZE, RBX, 0);
+            return;
+        case OP_JUMP_BACKWARD:
+            if (exit_at_loops) {
+                emit_exit(buf, ip); // run() hands hot loops to the tracing tier
+                return;
+            }
+            add_patch(buf, emit_jump(buf), jump_target(chunk, offset));
+            return;
+        case OP_JUMP:
+            add_patch(buf, emit_jump(buf), jump_target(chunk, offset));
+            return;
+        case OP_CALL:
+        case OP_RETURN:
+        case OP_HALT:
+            emit_exit(buf, ip);
+            return;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUB:
+        case OP_SUB_NUM:
+        case OP_MUL:
+        case OP_MUL_NUM: {
+            uint16_t opcode = ip[0] == OP_ADD || ip[0] == OP_ADD_NUM ? X86_ADDSD :
+                              ip[0] == OP_SUB || ip[0] == OP_SUB_NUM ? X86_SUBSD : X86_MULSD;
+            slow[slow_count++] = emit_number_guard(buf, RBX, -2 * VALUE_SIZE);
+            slow[slow_count++] = emit_number_guard(buf, RBX, -VALUE_SIZE);
+            emit_sse(buf, X86_MOVSD_LOAD, 0, RBX, -2 * VALUE_SIZE + NUMBER_OFFSET);
+            emit_sse(buf, opcode, 0, RBX, -VALUE_SIZE + NUMBER_OFFSET);
+            // the left operand was a number, so its slot only needs the new double
+            emit_sse(buf, X86_MOVSD_STORE, 0, RBX, -2 * VALUE_SIZE + NUMBER_OFFSET);
+            emit_move_sp(buf, -1);
+            done = emit_jump(buf);
+            break;
+        }
+        case OP_LESS_THAN:
+        case OP_LESS_THAN_NUM:
+        case OP_GREATER_THAN:
+        case OP_GREATER_THAN_NUM:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER: {
+            // a < b is tested as b > a, so both are a ucomisd followed by "above", which is false for NaN
+            bool less = ip[0] == OP_LESS_THAN || ip[0] == OP_LESS_THAN_NUM || ip[0] == OP_JUMP_IF_NOT_LESS;
+            slow[slow_count++] = emit_number_guard(buf, RBX, -2 * VALUE_SIZE);
+            slow[slow_count++] = emit_number_guard(buf, RBX, -VALUE_SIZE);
+            emit_sse(buf, X86_MOVSD_LOAD, 0, RBX, (less ? -1 : -2) * VALUE_SIZE + NUMBER_OFFSET);
+            emit_sse(buf, X86_UCOMISD, 0, RBX, (less ? -2 : -1) * VALUE_SIZE + NUMBER_OFFSET);
+            if (is_jump(ip[0])) {
+                emit_move_sp(buf, -2);
+                add_patch(buf, emit_jcc(buf, CC_BE), jump_target(chunk, offset));
+            } else {
+                emit_store_condition(buf, CC_A, RBX, -2 * VALUE_SIZE);
+                emit_move_sp(buf, -1);
+            }
+            done = emit_jump(buf);
+            break;
+        }
+        case OP_POP_JUMP_IF_FALSE: {
+#ifdef SHIP_NAN_BOXING
+            emit_load(buf, RAX, RBX, -VALUE_SIZE);
+            emit_mov_imm64(buf, RCX, FALSE_VAL);
+            emit_alu(buf, X86_CMP, RAX, RCX);
+            int not_false = emit_jcc(buf, CC_NE);
+            emit_move_sp(buf, -1);
+            add_patch(buf, emit_jump(buf), jump_target(chunk, offset));
+            patch_here(buf, not_false);
+            emit_mov_imm64(buf, RCX, TRUE_VAL);
+            emit_alu(buf, X86_CMP, RAX, RCX);
+            slow[slow_count++] = emit_jcc(buf, CC_NE);
+            emit_move_sp(buf, -1);
+#else
+            emit_mem(buf, 0, false, 0x83, 7, RBX, -VALUE_SIZE); // cmp dword [rbx - value], VAL_BOOL
+            emit_byte(buf, VAL_BOOL);
+            slow[slow_count++] = emit_jcc(buf, CC_NE);
+            emit_move_sp(buf, -1);
+            emit_mem(buf, 0, false, 0x80, 7, RBX, NUMBER_OFFSET); // cmp byte [rbx + boolean], 0
+            emit_byte(buf, 0);
+            add_patch(buf, emit_jcc(buf, CC_E), jump_target(chunk, offset));
+#endif
+            done = emit_jump(buf);
+            break;
+        }
+        case OP_INCREMENT_LOCAL: {
+            int32_t local = ip[1] * VALUE_SIZE;
+            double amount = AS_NUMBER(chunk->constants.arr[ip[2]]);
+            uint64_t amount_bits;
+            memcpy(&amount_bits, &amount, sizeof(amount));
+            slow[slow_count++] = emit_number_guard(buf, R12, local);
+            emit_sse(buf, X86_MOVSD_LOAD, 0, R12, local + NUMBER_OFFSET);
+            emit_mov_imm64(buf, RAX, amount_bits);
+            emit_movq_xmm(buf, 1, RAX);
+            emit_sse_reg(buf, X86_ADDSD, 0, 1);
+            emit_sse(buf, X86_MOVSD_STORE, 0, R12, local + NUMBER_OFFSET);
+            done = emit_jump(buf);
+            break;
+        }
+        default:
+            break; // no inline version, jit_step runs it
+    }
+
+    for (int i = 0; i < slow_count; i++) {
+        patch_here(buf, slow[i]);
+    }
+    emit_step(buf, ip);
+    if (is_jump(ip[0])) {
+        emit_cmp_eax(buf, JIT_BRANCH);
+        add_patch(buf, emit_jcc(buf, CC_E), jump_target(chunk, offset));
+    }
+    if (done != -1) {
+        patch_here(buf, done);
+    }
+}
+// <------------------------------------>
+
+bool jit_compile(FunctionObj* function, bool exit_at_loops) {
+    Chunk* chunk = &function->body;
+    CodeBuffer buf;
+    init_code_buffer(&buf);
+    uint32_t* offsets = (uint32_t*) malloc(sizeof(uint32_t) * (chunk->count + 1));
+
+    // entry stub: jit_enter calls it with (vm, frame, native address of frame->ip)
+    emit_prologue(&buf, 0);
+    emit_byte(&buf, 0xff); // jmp rdx
+    emit_byte(&buf, 0xe2);
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        offsets[offset] = buf.count;
+        emit_instruction(&buf, chunk, offset, exit_at_loops);
+    }
+
+    int error_exit = buf.count;
+    offsets[chunk->count] = error_exit; // never reached, every chunk ends with OP_RETURN or OP_HALT
+    emit_byte(&buf, 0xb8); // mov eax, RESULT_ERROR
+    emit_u32(&buf, RESULT_ERROR);
+    int epilogue = buf.count;
+    emit_epilogue(&buf, 0);
+
+    for (int i = 0; i < buf.patchCount; i++) {
+        CodePatch patch = buf.patches[i];
+        int target = patch.target == TARGET_ERROR ? error_exit :
+                     patch.target == TARGET_EPILOGUE ? epilogue : (int) offsets[patch.target];
+        patch_rel32(&buf, patch.at, target);
+    }
+
+    size_t size;
+    uint8_t* code = map_code(&buf, &size);
+    free_code_buffer(&buf);
+    if (code == NULL) {
+        free(offsets);
+        return false;
+    }
+
+    JitCode* native = (JitCode*) malloc(sizeof(JitCode));
+    native->code = code;
+    native->size = size;
+    native->offsets = offsets;
+    function->jit = native;
+    return true;
+}
+
+void jit_free(FunctionObj* function) {
+    if (function->jit == NULL) {
+        return;
+    }
+    unmap_code(function->jit->code, function->jit->size);
+    free(function->jit->offsets);
+    free(function->jit);
+    function->jit = NULL;
+}
+
+InterpretResult jit_enter(VM* vm, StackFrame* frame) {
+    JitCode* native = frame->function->jit;
+    uint8_t* target = native->code + native->offsets[frame->ip - frame->function->body.codes];
+    JitEntry entry = (JitEntry) (void*) native->code;
+    return entry(vm, frame, target);
+}
+
+#else
+
+bool jit_compile(FunctionObj* function, bool exit_at_loops) {
+    return false;
+}
+
+void jit_free(FunctionObj* function) {
+}
+
+InterpretResult jit_enter(VM* vm, StackFrame* frame) {
+    return RESULT_SUCCESS; // unreachable, nothing gets compiled
+}
+
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+#ifndef SHIP_JIT_H_
+#define SHIP_JIT_H_
+
+#include "vm.h"
+
+// the baseline jit translates a function's stack bytecode to x86-64 machine code, see jit.c.
+// it uses the System V calling convention, so it is only built on x86-64 linux. elsewhere jit_compile always fails.
+#if defined(__x86_64__) && defined(__linux__)
+#define SHIP_JIT
+#endif
+
+#define JIT_THRESHOLD 1000 // calls plus loop iterations of a function before it is compiled
+
+// what the machine code does after jit_step ran an instruction for it
+typedef enum {
+    JIT_NEXT, // continue with the next instruction
+    JIT_BRANCH, // take the jump of the instruction
+    JIT_FAILED, // a runtime error was pushed
+} JitStep;
+
+// exit_at_loops leaves back edges to run(), so the tracing tier sees them
+bool jit_compile(FunctionObj* function, bool exit_at_loops);
+void jit_free(FunctionObj* function);
+// runs the function of frame natively from frame->ip, until it reaches an op the machine code leaves to run().
+// frame->ip and vm->sp are up to date when it returns.
+InterpretResult jit_enter(VM* vm, StackFrame* frame);
+
+// runs the instruction at ip the way run() does, for the instructions the machine code has no inline version of.
+// implemented in vm.c
+JitStep jit_step(VM* vm, StackFrame* frame, uint8_t* ip);
+
+#endif // !SHIP_JIT_H_
@@ -2,6 +2,8 @@
 #include "debug.h"
 #include "compiler.h"
 #include "vm.h"
+#include "jit.h"
+#include "aot.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -36,7 +38,7 @@ static char* read_source_code() {
     return buffer;
 }
 
-void run_code() {
+void run_code(int ngrams, bool emit, bool registers, bool jit, bool trace) {
     char* source_code = read_source_code();
     FunctionObj* compiled_func = compile(source_code);
     if (compiled_func == NULL) {
@@ -48,15 +50,87 @@ void run_code() {
 #endif
     free(source_code);
 
-    VM vm;
+    if (ngrams > 0) {
+        // only report the instruction sequences, don't run the script
+        print_ngrams(compiled_func, ngrams);
+        free_object((Obj*) compiled_func);
+        free_shared_strings();
+        return;
+    }
+
+    if (emit) {
+        // only print the C translation, don't run the script
+        emit_c(compiled_func, stdout);
+        free_object((Obj*) compiled_func);
+        free_shared_strings();
+        return;
+    }
+
+    if (registers && !compile_registers(compiled_func)) {
+        // the translation bails out on code it has no register form for, the stack vm runs everything
+        printf("[NOTE] script has no register form, running it on the stack vm.\n");
+        registers = false;
+    }
+
+    static VM vm; // the value stack is too big for the c stack
     init_vm(&vm);
-    interpret(&vm, compiled_func);
+#ifdef SHIP_JIT
+    vm.jitEnabled = jit;
+    vm.traceEnabled = trace;
+#else
+    if (jit || trace) {
+        printf("[NOTE] the jit is only available on x86-64 linux, running on the interpreter.\n");
+    }
+#endif
+    if (registers) {
+#ifdef SHIP_DEBUG
+        disassemble_registers(compiled_func);
+#endif
+        interpret_registers(&vm, compiled_func);
+    } else {
+        interpret(&vm, compiled_func);
+    }
 
     free_vm(&vm);
 
 }
 
 int main(int argc, char** argv) {
-    run_code();
+    int ngrams = 0;
+    bool emit = false;
+    bool registers = false;
+    bool jit = false;
+    bool trace = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ngrams") == 0) {
+            // --ngrams [n]: print the most frequent sequences of n instructions (default 2)
+            ngrams = 2;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                char* end;
+                long n = strtol(argv[++i], &end, 10);
+                if (*argv[i] == '\0' || *end != '\0' || n < 1 || n > NGRAM_MAX) {
+                    printf("usage: --ngrams [n], where n is a number between 1 and %i\n", NGRAM_MAX);
+                    return 1;
+                }
+                ngrams = (int) n;
+            }
+        } else if (strcmp(argv[i], "--emit-c") == 0) {
+            // --emit-c: print the script translated to C, to build a native program with the runtime
+            emit = true;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            // --registers: run the script on the register based vm instead of the stack vm
+            registers = true;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            // --jit: compile hot functions to native code
+            jit = true;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            // --trace: compile hot numeric loops to native traces
+            trace = true;
+        } else {
+            printf("unknown option '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    run_code(ngrams, emit, registers, jit, trace);
 	return 0;
 }
@@ -1,143 +1,646 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#ifdef SHIP_PARALLEL_MARK
+#include <pthread.h>
+#endif
 
 #include "memory.h"
 
-
+static size_t allocated = 0; // bytes handed out by reallocate since the last collection
 
 void* reallocate(void* pointer, size_t oldCapacity, size_t newCapacity) {
 	if (newCapacity == 0) {
 		free(pointer);
 		return NULL;
 	}
+    if (newCapacity > oldCapacity) {
+        allocated += newCapacity - oldCapacity;
+    }
 
 	void* result = realloc(pointer, newCapacity);
 	return result;
 }
 
-static void mark_array(Obj* o) {
-    // If array is marked, then all of his values should be marked too
-    ArrayObj* obj = (ArrayObj*) o;
-    for(int i = 0; i<obj->values->count; i++) {
-        mark_value(obj->values->arr[i]);
+// <---- small blocks ----->
+// objects and their small payloads come from size classes in steps of SMALL_BLOCK_STEP bytes. each class cuts
+// SLAB_SIZE pages into blocks and keeps the blocks the collector freed on a free list of its own, so a script that
+// allocates a lot reuses the memory of its garbage instead of going through malloc and free for every object.
+// the pages are kept until the process exits.
+
+#define SMALL_BLOCK_STEP 16
+#define SMALL_BLOCK_MAX 256 // bigger blocks come from malloc
+#define SMALL_BLOCK_CLASSES (SMALL_BLOCK_MAX / SMALL_BLOCK_STEP)
+#define SLAB_SIZE (64 * 1024)
+
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+} FreeBlock;
+
+typedef struct {
+    FreeBlock* free; // blocks freed since, reused first
+    char* cursor; // the part of the newest page no block was cut from yet
+    char* end;
+} SizeClass;
+
+static SizeClass sizeClasses[SMALL_BLOCK_CLASSES];
+static void* pages = NULL; // every page, each starts with a pointer to the one before it
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+// a freed block is poisoned until it is handed out again, so address sanitizer still catches a use after free
+#define POISON_BLOCK(block, size) ASAN_POISON_MEMORY_REGION(block, size)
+#define UNPOISON_BLOCK(block, size) ASAN_UNPOISON_MEMORY_REGION(block, size)
+#else
+#define POISON_BLOCK(block, size) ((void) 0)
+#define UNPOISON_BLOCK(block, size) ((void) 0)
+#endif
+
+void* allocate_block(size_t size) {
+    if (size > SMALL_BLOCK_MAX) {
+        void* block = reallocate(NULL, 0, size);
+        if (block == NULL) {
+            printf("[ERROR] couldn't allocate %zu bytes. exiting...\n", size);
+            exit(1);
+        }
+        return block;
+    }
+    int index = size == 0 ? 0 : (int) ((size - 1) / SMALL_BLOCK_STEP);
+    size_t block_size = (index + 1) * SMALL_BLOCK_STEP;
+    SizeClass* class = &sizeClasses[index];
+    allocated += block_size;
+
+    FreeBlock* block = class->free;
+    if (block != NULL) {
+        UNPOISON_BLOCK(block, block_size);
+        class->free = block->next;
+        return block;
+    }
+    if (class->cursor == NULL || class->cursor + block_size > class->end) {
+        char* page = (char*) malloc(SLAB_SIZE);
+        if (page == NULL) {
+            printf("[ERROR] couldn't allocate a page of objects. exiting...\n");
+            exit(1);
+        }
+        *(void**) page = pages;
+        pages = page;
+        // the link takes one step, which keeps every block aligned
+        class->cursor = page + SMALL_BLOCK_STEP;
+        class->end = page + SLAB_SIZE;
+    }
+    void* result = class->cursor;
+    class->cursor += block_size;
+    return result;
+}
+
+void free_block(void* block, size_t size) {
+    // size is what the block was allocated with
+    if (block == NULL) return;
+    if (size > SMALL_BLOCK_MAX) {
+        free(block);
+        return;
+    }
+    int index = size == 0 ? 0 : (int) ((size - 1) / SMALL_BLOCK_STEP);
+    FreeBlock* freed = (FreeBlock*) block;
+    freed->next = sizeClasses[index].free;
+    sizeClasses[index].free = freed;
+    POISON_BLOCK(block, (index + 1) * SMALL_BLOCK_STEP);
+}
+
+// <---- generational collection ----->
+// objects are born young in vm->nursery. once nurserySize bytes were allocated, a minor collection marks what
+// the stack, the open upvalues, the globals and the remembered old objects reach in the nursery, frees the rest of
+// it and promotes every survivor to vm->objects. most objects are temporaries that die before that, so a minor
+// collection only pays for the few that live.
+//
+// once the heap grew past nextMajor bytes, a major collection marks the old generation from the roots and sweeps
+// it. with a pause budget it is incremental: it runs in slices after the minor collections, and the script runs
+// in between. each collection marks only its own generation, the major one sees young objects once they are
+// promoted, and promotion shades them while it marks. stores into a marked old object shade what is stored, and
+// the roots, which have no barrier, are marked again before marking ends. the sweep that follows is lazy: every
+// allocation sweeps a few old objects, so the pause is spent marking only.
+
+// marking is tri-color: an object is white until it is marked, gray while it waits on vm->gray for what it
+// points at to be marked, and black after that. the explicit stack keeps deep structures off the C stack, and an
+// object that is already marked is never pushed again.
+
+#define SLICE_CHECK 64 // objects a slice handles between two looks at the clock
+#define SLICE_PACE 2 // objects a slice handles at least for every object the minor collection before it promoted
+#define LAZY_SWEEP 8 // old objects swept for every object allocated while a major collection sweeps
+
+static long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void push_gray(GrayStack* gray, Obj* obj) {
+    switch (obj->type) {
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+        case OBJ_FUNCTION:
+        case OBJ_ERROR:
+            return; // points at nothing the collector owns, black right away
+        default: break;
     }
+    if (gray->count + 1 > gray->capacity) {
+        gray->capacity = GROW_CAPACITY(gray->capacity);
+        // not through reallocate, the collector's own memory is not garbage
+        gray->arr = (Obj**) realloc(gray->arr, gray->capacity * sizeof(Obj*));
+        if (gray->arr == NULL) {
+            printf("[ERROR] couldn't grow the gray stack. exiting...\n");
+            exit(1);
+        }
+    }
+    gray->arr[gray->count++] = obj;
 }
 
-void mark_object(Obj* obj) {
-    if (obj == NULL) return;
+static void mark_object(GrayStack* gray, Obj* obj, Generation collected) {
+    // constants are not the collector's, and each collection leaves the other generation alone
+    if (obj == NULL || obj->generation != collected) return;
+#ifdef SHIP_PARALLEL_MARK
+    if (gray->shared) {
+        // whichever thread flips the bit traces the object
+        if (__atomic_load_n(&obj->isMarked, __ATOMIC_RELAXED) ||
+            __atomic_exchange_n(&obj->isMarked, true, __ATOMIC_RELAXED)) return;
+        push_gray(gray, obj);
+        return;
+    }
+#endif
+    if (obj->isMarked) return;
     obj->isMarked = true;
+    push_gray(gray, obj);
+}
 
+static void mark_value(GrayStack* gray, Value value, Generation collected) {
+    if (!IS_OBJ(value)) return;
+    mark_object(gray, AS_OBJ(value), collected);
+}
+
+static void mark_children(GrayStack* gray, Obj* obj, Generation collected) {
     switch (obj->type) {
-        case OBJ_ARRAY:
-            mark_array(obj); // If array is marked, then we have access to all of his elements.
+        case OBJ_ARRAY: {
+            // If array is marked, then we have access to all of his elements.
+            ArrayObj* arr = (ArrayObj*) obj;
+            for (int i = 0; i < arr->values->count; i++) {
+                mark_value(gray, arr->values->arr[i], collected);
+            }
             break;
+        }
         case OBJ_ITERABLE:
             // if iterable is marked, then we have access to the obj he iterates on.
-            mark_object(((IterableObj *) obj)->iterable);
+            mark_object(gray, ((IterableObj *) obj)->iterable, collected);
+            break;
+        case OBJ_CLOSURE: {
+            ClosureObj* closure = (ClosureObj*) obj;
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                mark_object(gray, (Obj*) closure->upvalues[i], collected); // NULL while the closure is being created
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            mark_value(gray, ((UpvalueObj*) obj)->closed, collected);
+            break;
+        case OBJ_NATIVE_METHOD:
+            mark_value(gray, ((NativeFuncObj*) obj)->bound, collected);
+            break;
+        case OBJ_ROPE:
+            // the pieces of a flattened rope are NULL
+            mark_object(gray, ((RopeObj*) obj)->left, collected);
+            mark_object(gray, ((RopeObj*) obj)->right, collected);
             break;
 
         default: break;
     }
+}
 
+#ifdef SHIP_PARALLEL_MARK
+// <---- parallel marking ----->
+// a major collection that marks in one go can spread the work over vm->markThreads threads. each thread traces
+// from a gray stack of its own and claims the objects it marks with an atomic exchange, so each one is traced once.
+// a thread with plenty of gray objects hands a chunk of them to the pool while other threads are out of work,
+// and marking is over once every thread is out of work and the pool is empty. the script is stopped meanwhile,
+// so the objects don't change under the threads.
+
+#define MARK_CHUNK 256 // gray objects handed between threads at once
+#define MARK_PARALLEL_HEAP (1024 * 1024) // heap bytes below which starting threads costs more than it saves
+
+typedef struct MarkChunk {
+    int count;
+    Obj* objs[MARK_CHUNK];
+    struct MarkChunk* next;
+} MarkChunk;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signaled when a chunk arrives or marking is over
+    MarkChunk* chunks;
+    int threads; // threads marking, the one that started the collection included
+    int idle; // threads waiting for a chunk, read without the lock to decide whether to share
+    bool done;
+} MarkPool;
+
+static MarkChunk* new_chunk() {
+    MarkChunk* chunk = (MarkChunk*) malloc(sizeof(MarkChunk));
+    if (chunk == NULL) {
+        printf("[ERROR] couldn't allocate a mark chunk. exiting...\n");
+        exit(1);
+    }
+    chunk->count = 0;
+    return chunk;
+}
 
+static void share_chunk(MarkPool* pool, GrayStack* gray) {
+    // moves the top MARK_CHUNK gray objects to the pool
+    MarkChunk* chunk = new_chunk();
+    gray->count -= MARK_CHUNK;
+    memcpy(chunk->objs, gray->arr + gray->count, MARK_CHUNK * sizeof(Obj*));
+    chunk->count = MARK_CHUNK;
+    pthread_mutex_lock(&pool->lock);
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
 }
 
-void mark_value(Value value) {
-    if (!IS_OBJ(value)) return;
-    mark_object(AS_OBJ(value));
+static bool take_chunk(MarkPool* pool, GrayStack* gray) {
+    // waits for a chunk and pushes it onto gray, false once marking is over
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+    while (pool->chunks == NULL && !pool->done) {
+        if (pool->idle == pool->threads) {
+            // nobody is left to share anything
+            pool->done = true;
+            pthread_cond_broadcast(&pool->wake);
+            break;
+        }
+        pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    MarkChunk* chunk = pool->chunks;
+    if (chunk == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+    pool->chunks = chunk->next;
+    __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->lock);
 
+    for (int i = 0; i < chunk->count; i++) {
+        push_gray(gray, chunk->objs[i]);
+    }
+    free(chunk);
+    return true;
 }
 
+static void* mark_worker(void* arg) {
+    MarkPool* pool = (MarkPool*) arg;
+    GrayStack gray = {0, 0, NULL, true};
+    do {
+        while (gray.count > 0) {
+            mark_children(&gray, gray.arr[--gray.count], GEN_OLD);
+            if (gray.count >= 2 * MARK_CHUNK && __atomic_load_n(&pool->idle, __ATOMIC_RELAXED) > 0) {
+                share_chunk(pool, &gray);
+            }
+        }
+    } while (take_chunk(pool, &gray));
+    free(gray.arr);
+    return NULL;
+}
 
+static void parallel_trace(VM* vm) {
+    // marks everything the gray objects of vm->gray reach in the old generation, on vm->markThreads threads
+    MarkPool pool;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pool.chunks = NULL;
+    pool.threads = 1;
+    pool.idle = 0;
+    pool.done = false;
+    while (vm->gray.count > 0) {
+        MarkChunk* chunk = new_chunk();
+        while (chunk->count < MARK_CHUNK && vm->gray.count > 0) {
+            chunk->objs[chunk->count++] = vm->gray.arr[--vm->gray.count];
+        }
+        chunk->next = pool.chunks;
+        pool.chunks = chunk;
+    }
 
-static void mark_variables(VM* vm) {
-    for (int i = vm->frameCount - 1; i >= 0; i--) {
-        StackFrame* curr = &vm->callStack[i];
-        // iterate over the function locals and search for the value
-        for(int j = 0; j< curr->function->localCount; j++) {
-            Local current_local = curr->function->locals[j];
-            mark_value(current_local.value);
+    pthread_t* workers = (pthread_t*) malloc((vm->markThreads - 1) * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; workers != NULL && i < vm->markThreads - 1; i++) {
+        // the threads that did start do the work of those that didn't
+        pthread_mutex_lock(&pool.lock);
+        bool ok = pthread_create(&workers[started], NULL, mark_worker, &pool) == 0;
+        if (ok) {
+            started++;
+            pool.threads++;
         }
+        pthread_mutex_unlock(&pool.lock);
+        if (!ok) break;
     }
+    mark_worker(&pool);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_cond_destroy(&pool.wake);
+    pthread_mutex_destroy(&pool.lock);
 }
+#endif
 
-static void mark_stack(VM* vm) {
-    for(Value* i = vm->stack; i < vm->sp; i++) {
-        mark_value(*i);
+static bool trace_references(VM* vm, Generation collected, int base, long long deadline, int min_work) {
+    // blackens the gray objects above base, true once there are none left
+#ifdef SHIP_PARALLEL_MARK
+    if (collected == GEN_OLD && deadline == LLONG_MAX && vm->markThreads > 1 && vm->heapBytes >= MARK_PARALLEL_HEAP) {
+        parallel_trace(vm); // a major collection has nothing below base
+        return true;
+    }
+#endif
+    int handled = 0;
+    while (vm->gray.count > base) {
+        mark_children(&vm->gray, vm->gray.arr[--vm->gray.count], collected);
+        if (++handled % SLICE_CHECK == 0 && handled >= min_work && now_ns() >= deadline) {
+            return vm->gray.count == base;
+        }
     }
+    return true;
 }
 
-static void pop_free_head(Obj ** head) {
-    Obj* next_node = NULL;
-
-    if (*head == NULL) {
-        printf("pop_free_head got empty list");
-        return;
+static void mark_roots(VM* vm, Generation collected) {
+    // frame locals live on the value stack too, so this also covers every variable in scope
+    for (Value* i = vm->stack; i < vm->sp; i++) {
+        mark_value(&vm->gray, *i, collected);
+    }
+    // an open upvalue may outlive every closure that captured it, but close_upvalues still walks it
+    for (UpvalueObj* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->nextOpen) {
+        mark_object(&vm->gray, (Obj*) upvalue, collected);
+    }
+    for (int i = 0; i < vm->globals.capacity; i++) {
+        for (ValueNode* node = vm->globals.arr[i]; node != NULL; node = (ValueNode*) node->next) {
+            mark_value(&vm->gray, node->val, collected);
+        }
     }
-    next_node = (Obj *) (*head)->next;
+}
 
-    free_object(*head);
+void remember_object(VM* vm, Obj* obj) {
+    if (obj->type == OBJ_ARRAY) {
+        // a large array that keeps getting pushed to is scanned from where the pushes began, not as a whole
+        ArrayObj* arr = (ArrayObj*) obj;
+        if (!obj->isRemembered || arr->values->count < arr->rememberedFrom) {
+            arr->rememberedFrom = arr->values->count;
+        }
+    }
+    if (obj->isRemembered) return;
+    if (vm->rememberedCount + 1 > vm->rememberedCapacity) {
+        int old_capacity = vm->rememberedCapacity;
+        vm->rememberedCapacity = GROW_CAPACITY(old_capacity);
+        vm->remembered = GROW_ARRAY(Obj*, vm->remembered, old_capacity, vm->rememberedCapacity);
+    }
+    obj->isRemembered = true;
+    vm->remembered[vm->rememberedCount++] = obj;
+}
 
-    *head = next_node;
+void shade_object(VM* vm, Obj* obj) {
+    // a black object is traced again, a white one for the first time
+    obj->isMarked = true;
+    push_gray(&vm->gray, obj);
+}
 
+static int minor_collection(VM* vm, Obj* held) {
+    // returns how many objects were promoted
+    // the gray objects of a major collection that is marking stay below base
+    int base = vm->gray.count;
+    mark_roots(vm, GEN_YOUNG);
+    mark_object(&vm->gray, held, GEN_YOUNG);
+    // the remembered objects are old, so they are not marked themselves, only what they point at
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        Obj* obj = vm->remembered[i];
+        if (obj->type == OBJ_ARRAY) {
+            ArrayObj* arr = (ArrayObj*) obj;
+            for (int j = arr->rememberedFrom; j < arr->values->count; j++) {
+                mark_value(&vm->gray, arr->values->arr[j], GEN_YOUNG);
+            }
+        } else {
+            mark_children(&vm->gray, obj, GEN_YOUNG);
+        }
+        obj->isRemembered = false;
+    }
+    vm->rememberedCount = 0;
+    trace_references(vm, GEN_YOUNG, base, LLONG_MAX, 0);
+
+    // every survivor is promoted, which leaves no old object pointing into the nursery
+    int before_objs = 0;
+    int kept = 0;
+    size_t freed = 0;
+    Obj* obj = vm->nursery;
+    while (obj != NULL) {
+        Obj* next = (Obj*) obj->next;
+        before_objs++;
+        if (!obj->isMarked) {
+            freed += object_size(obj);
+            free_object(obj);
+        } else {
+            kept++;
+            obj->generation = GEN_OLD;
+            obj->isMarked = false;
+            if (vm->gcState == GC_MARKING) {
+                shade_object(vm, obj);
+            }
+            obj->next = vm->objects;
+            vm->objects = (struct Obj*) obj;
+        }
+        obj = next;
+    }
+    vm->nursery = NULL;
+    vm->heapBytes = freed < vm->heapBytes ? vm->heapBytes - freed : 0;
+    vm->minorCollections++;
+#ifdef SHIP_DEBUG
+    printf("GC: Finished cleaning %i / %i young objects, %zu bytes\n", before_objs - kept, before_objs, freed);
+#endif
+    return kept;
 }
 
-static void pop_free_next(Obj ** prev) {
-    Obj* aim_node = (Obj *) (*prev)->next;
-    (*prev)->next = (struct Obj *) aim_node->next;
-    free_object(aim_node);
+static size_t sweep_object(VM* vm) {
+    // frees the next object of vm->sweeping if it is unmarked, or moves it back to vm->objects. returns the bytes freed
+    Obj* obj = vm->sweeping;
+    vm->sweeping = (Obj*) obj->next;
+    if (!obj->isMarked) {
+        size_t size = object_size(obj);
+        free_object(obj);
+        return size;
+    }
+    obj->isMarked = false;
+    obj->next = vm->objects;
+    vm->objects = (struct Obj*) obj;
+    return 0;
+}
 
+static void finish_major(VM* vm) {
+    vm->gcState = GC_IDLE;
+    vm->majorCollections++;
+    // let the heap grow in proportion to what is alive, so a large heap is not collected over and over
+    vm->nextMajor = (size_t) (vm->heapBytes * vm->heapGrowth);
+    if (vm->nextMajor < vm->heapMinSize) {
+        vm->nextMajor = vm->heapMinSize;
+    }
 }
 
-static void sweep(VM* vm) {
-    Obj* prev = NULL;
-    Obj* pos = (Obj *) vm->objects;
-    int before_objs = vm->heapObjects;
-    while (pos != NULL) {
-        if (pos->isMarked) {
-            pos->isMarked = false;
-            prev = pos;
-            pos = (Obj *) pos->next;
-            continue;
-        }
-        if (prev == NULL) {
-            pop_free_head((Obj **) &vm->objects);
-            prev = (Obj *) vm->objects;
-            pos = (Obj *) prev->next;
-        } else {
-            pop_free_next(&prev);
-            pos = (Obj*) prev->next;
+static bool sweep(VM* vm, long long deadline, int min_work) {
+    // sweeps vm->sweeping until the deadline, true once it is empty
+    int handled = 0;
+    size_t freed = 0;
+    while (vm->sweeping != NULL) {
+        freed += sweep_object(vm);
+        if (++handled % SLICE_CHECK == 0 && handled >= min_work && now_ns() >= deadline) {
+            break;
         }
-        vm->heapObjects--;
     }
+    vm->heapBytes = freed < vm->heapBytes ? vm->heapBytes - freed : 0;
 #ifdef SHIP_DEBUG
-    printf("GC: Finished cleaning %i / %i objects\n", before_objs - vm->heapObjects, before_objs);
+    printf("GC: Swept %i old objects, %zu bytes freed\n", handled, freed);
 #endif
+    return vm->sweeping == NULL;
+}
+
+static void major_slice(VM* vm, Obj* held, long long deadline, int min_work) {
+    // works until the deadline, but on at least min_work objects, so the collection keeps up with the script
+    if (vm->gcState == GC_IDLE) {
+        // right after a minor collection, so the nursery is empty and every root points into the old generation
+        vm->gcState = GC_MARKING;
+        mark_roots(vm, GEN_OLD);
+    }
+    if (vm->gcState == GC_MARKING) {
+        if (!trace_references(vm, GEN_OLD, 0, deadline, min_work)) return;
+        // the roots changed since marking began, mark what they reach now in one go
+        mark_roots(vm, GEN_OLD);
+        mark_object(&vm->gray, held, GEN_OLD); // promoted by the minor collection just before
+        trace_references(vm, GEN_OLD, 0, LLONG_MAX, 0);
+        vm->gcState = GC_SWEEPING;
+        // objects promoted from now on go straight to vm->objects, unmarked, and the sweep never sees them
+        vm->sweeping = (Obj*) vm->objects;
+        vm->objects = NULL;
+        if (vm->pauseBudget == 0) return; // the allocations that follow sweep it, see add_garbage
+    }
+    if (!sweep(vm, deadline, min_work)) return;
+    finish_major(vm);
+}
+
+static void collect_garbage(VM* vm, Obj* held) {
+    // held is reachable from the caller only
+    long long start = now_ns();
+    vm->heapBytes += allocated;
+    allocated = 0;
+    int promoted = minor_collection(vm, held);
+
+    // a major collection that isn't incremental only sweeps lazily
+    bool lazy = vm->gcState == GC_SWEEPING && vm->pauseBudget == 0;
+    if (!lazy && (vm->gcState != GC_IDLE || vm->heapBytes >= vm->nextMajor)) {
+        long long deadline = start + vm->pauseBudget;
+        if (vm->pauseBudget == 0 || vm->heapBytes >= 2 * vm->nextMajor) {
+            // not incremental, or the script allocates faster than the slices keep up with: finish it now
+            deadline = LLONG_MAX;
+        }
+        major_slice(vm, held, deadline, promoted * SLICE_PACE);
+    }
+
+    long long pause = now_ns() - start;
+    vm->pauses++;
+    vm->pauseTotal += pause;
+    if (pause > vm->pauseMax) {
+        vm->pauseMax = pause;
+    }
 }
 
 void add_garbage(VM* vm, Value value) {
     if (!IS_OBJ(value)) return;
-    collect_garbage(vm);
     Obj *const_obj = AS_OBJ(value);
-    // append the new obj to the head of the list
-    Obj **head = (Obj **) &vm->objects;
-
-    const_obj->next = (struct Obj *) *head;
-    *head = const_obj;
+    if (const_obj->generation != GEN_UNTRACKED) return; // e.g. an element a native method returned
+    // append the new obj to the head of the nursery, where the collection sees it even if it is not on the stack yet
+    const_obj->generation = GEN_YOUNG;
+    const_obj->next = (struct Obj *) vm->nursery;
+    vm->nursery = const_obj;
+
+    if (vm->gcState == GC_SWEEPING) {
+        // the sweep frees more objects than are born meanwhile, so it ends long before the heap fills up again
+        size_t freed = 0;
+        for (int i = 0; i < LAZY_SWEEP && vm->sweeping != NULL; i++) {
+            freed += sweep_object(vm);
+        }
+        vm->heapBytes = freed < vm->heapBytes ? vm->heapBytes - freed : 0;
+        if (vm->sweeping == NULL) {
+            finish_major(vm);
+        }
+    }
 
-    vm->heapObjects++;
+    // only objects are collected, so only their arrival is a reason to collect
+    if (allocated >= vm->nurserySize) {
+        collect_garbage(vm, const_obj);
+    }
 }
 
+static double env_number(const char* name, double fallback, double min, const char* expected) {
+    // a number, optionally followed by k or m for units of 1024 or 1024 * 1024
+    const char* text = getenv(name);
+    if (text == NULL || *text == '\0') return fallback;
+    char* end;
+    double number = strtod(text, &end);
+    if (*end == 'k' || *end == 'K') {
+        number *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        number *= 1024 * 1024;
+        end++;
+    }
+    if (end == text || *end != '\0' || number < min) {
+        printf("[ERROR] %s expects %s, got '%s'\n", name, expected, text);
+        exit(1);
+    }
+    return number;
+}
 
-void collect_garbage(VM* vm) {
-    // don't gc if the capacity isn't overflowing
-    if (vm->heapObjects + 1 < vm->heapCapacity) return;
-    // mark and sweep
-    mark_variables(vm);
-    mark_stack(vm);
-    sweep(vm);
-    // bop the capacity to reduce collection
-    vm->heapCapacity *= 2;
-
+void init_gc(VM* vm) {
+    vm->nursery = NULL;
+    vm->objects = NULL;
+    vm->sweeping = NULL;
+    vm->gcState = GC_IDLE;
+    vm->heapBytes = 0;
+    vm->remembered = NULL;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    vm->gray = (GrayStack) {0, 0, NULL, false};
+    vm->minorCollections = 0;
+    vm->majorCollections = 0;
+    vm->pauses = 0;
+    vm->pauseTotal = 0;
+    vm->pauseMax = 0;
+
+    vm->nurserySize = (size_t) env_number("SHIP_GC_NURSERY", GC_NURSERY_SIZE, 1, "a size like 4096, 512k or 8m");
+    vm->heapMinSize = (size_t) env_number("SHIP_GC_HEAP", GC_HEAP_MIN_SIZE, 1, "a size like 4096, 512k or 8m");
+    vm->heapGrowth = env_number("SHIP_GC_GROWTH", GC_HEAP_GROWTH, 1.01, "a factor of 1.01 or more, like 1.5");
+    vm->pauseBudget = (long long) (env_number("SHIP_GC_PAUSE", 0, 1, "microseconds, like 500") * 1000);
+    vm->markThreads = (int) env_number("SHIP_GC_THREADS", 1, 1, "a thread count, like 4");
+    vm->nextMajor = vm->heapMinSize;
+    // what the compiler allocated is not the script's garbage
+    allocated = 0;
 }
 
+void free_objects(VM* vm) {
+    if (getenv("SHIP_GC_STATS") != NULL) {
+        fprintf(stderr, "gc: %i minor, %i major collections, %i pauses, longest %.3f ms, mean %.3f ms, total %.3f ms\n",
+                vm->minorCollections, vm->majorCollections, vm->pauses, vm->pauseMax / 1e6,
+                vm->pauses > 0 ? vm->pauseTotal / 1e6 / vm->pauses : 0, vm->pauseTotal / 1e6);
+    }
+    Obj* lists[] = {vm->nursery, (Obj*) vm->objects, vm->sweeping};
+    for (int i = 0; i < 3; i++) {
+        Obj* pos = lists[i];
+        while (pos != NULL) {
+            Obj* next = (Obj *) pos->next;
+            free_object(pos);
+            pos = next;
+        }
+    }
+    free(vm->remembered);
+    free(vm->gray.arr);
+}
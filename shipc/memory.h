@@ -16,12 +16,48 @@
 
 
 void* reallocate(void* pointer, size_t oldCapacity, size_t newCapacity);
+// objects and other memory of a fixed size, from size classes of recycled blocks. free_block takes the size the
+// block was allocated with
+void* allocate_block(size_t size);
+void free_block(void* block, size_t size);
 
 // Garbage collector related
-void mark_value(Value value);
-void mark_object(Obj* obj);
-
-void collect_garbage(VM* vm);
+// defaults of the collector's knobs, each can be overridden from the environment by init_gc
+#define GC_NURSERY_SIZE (256 * 1024) // SHIP_GC_NURSERY: bytes allocated between two minor collections
+#define GC_HEAP_MIN_SIZE (4 * 1024 * 1024) // SHIP_GC_HEAP: heap bytes before the first major collection
+#define GC_HEAP_GROWTH 2.0 // SHIP_GC_GROWTH: how much the heap may grow past what a major collection left alive
+// SHIP_GC_PAUSE: microseconds a major collection may hold the script up at once, unset to run it in one go
+// SHIP_GC_THREADS: threads a major collection that runs in one go marks on, builds with SHIP_PARALLEL_MARK only
+
+void init_gc(VM* vm);
+// hands a new object to the collector, it starts out young. objects it already owns are left as they are
 void add_garbage(VM* vm, Value value);
+void free_objects(VM* vm);
+
+// a minor collection scans the stack but skips old objects, so an old object that was made to point at a young
+// one has to be remembered until then. while a major collection marks, an old object it already marked must not
+// be left pointing at one it didn't. writes to the stack need no barrier.
+void remember_object(VM* vm, Obj* obj);
+void shade_object(VM* vm, Obj* obj);
+
+// call when value is stored into obj. arrays only grow at their end, so call it for an array before the store:
+// only the elements from its current count on are remembered
+static inline void write_barrier(VM* vm, Obj* obj, Value value) {
+    if (obj->generation != GEN_OLD || !IS_OBJ(value)) return;
+    Obj* stored = AS_OBJ(value);
+    if (stored->generation == GEN_YOUNG) {
+        remember_object(vm, obj);
+    } else if (vm->gcState == GC_MARKING && obj->isMarked && stored->generation == GEN_OLD && !stored->isMarked) {
+        shade_object(vm, stored);
+    }
+}
+
+// call before a native method runs on args[0], it may store the other args into it (Array.push)
+static inline void write_barrier_host(VM* vm, int arg_count, Value* args) {
+    if (!IS_OBJ(args[0]) || AS_OBJ(args[0])->generation != GEN_OLD) return;
+    for (int i = 1; i <= arg_count; i++) {
+        write_barrier(vm, AS_OBJ(args[0]), args[i]);
+    }
+}
 
 #endif // SHIP_MEMORY_H_
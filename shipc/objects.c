@@ -3,13 +3,19 @@
 #include <string.h>
 
 #include "objects.h"
+#include "memory.h"
 #include "value.h"
 #include "vm.h"
+#include "jit.h"
+#include "trace.h"
 
 static Obj* allocate_object(size_t size, ObjType type) {
-    Obj* c_obj = (Obj*) malloc(size);
+    // a block of its size class, counted by the collector
+    Obj* c_obj = (Obj*) allocate_block(size);
     c_obj->type = type;
     c_obj->isMarked = false;
+    c_obj->generation = GEN_UNTRACKED;
+    c_obj->isRemembered = false;
     c_obj->next = NULL;
     return c_obj;
 }
@@ -20,13 +26,12 @@ static Obj* allocate_object(size_t size, ObjType type) {
 // <---- freeing related functions ----->
 static void free_string(Obj* str_obj) {
 	StringObj* obj = (StringObj*)str_obj;
-	free(obj->value);
-	free(obj);
+	free_block(obj, sizeof(StringObj) + obj->length + 1);
 }
 
 static void free_native(Obj* str_obj) {
     NativeFuncObj* native = (NativeFuncObj*) str_obj;
-    free(native);
+    free_block(native, sizeof(NativeFuncObj));
 }
 
 static void free_function(Obj* func_obj) {
@@ -34,51 +39,104 @@ static void free_function(Obj* func_obj) {
 
 	free_string((Obj *) obj->name);
 	free_chunk(&obj->body);
-    free(obj);
+    free_register_chunk(&obj->registers);
+    jit_free(obj);
+    free_traces(obj);
+    free_block(obj, sizeof(FunctionObj));
 
 }
 
+static void free_closure(Obj* closure_obj) {
+    // the function is a constant of the enclosing chunk, and the upvalues are garbage of their own
+    ClosureObj* obj = (ClosureObj*) closure_obj;
+    free_block(obj->upvalues, obj->upvalueCount * sizeof(UpvalueObj*));
+    free_block(obj, sizeof(ClosureObj));
+}
+
+static void free_upvalue(Obj* upvalue_obj) {
+    free_block(upvalue_obj, sizeof(UpvalueObj));
+}
+
 static void free_array(Obj* arr_obj) {
     ArrayObj* obj = (ArrayObj*) arr_obj;
     free_value_array(obj->values);
-    free(obj->values);
-    free(obj);
+    free_block(obj->values, sizeof(ValueArray));
+    free_block(obj, sizeof(ArrayObj));
 }
 
 static void free_error(Obj* err_obj) {
     ErrorObj* obj = (ErrorObj*) err_obj;
     free_string((Obj *) obj->value);
-    free(obj);
+    free_block(obj, sizeof(ErrorObj));
 
 
 }
 
+static void free_rope(Obj* rope_obj) {
+    // the strings it joins are garbage of their own
+    RopeObj* rope = (RopeObj*) rope_obj;
+    if (rope->flat != NULL) {
+        free_string((Obj*) rope->flat);
+    }
+    free_block(rope, sizeof(RopeObj));
+}
+
 static void free_iterable(Obj* iter_obj) {
     IterableObj* obj = (IterableObj*) iter_obj;
 
     // Don't free the iterable object, the object is not a copy of the original. therefore, it can still be marked.
     // free_object(obj->iterable);
 
-    free(obj);
+    free_block(obj, sizeof(IterableObj));
 }
 
 void free_object(Obj* obj) {
 	switch (obj->type) {
-	case OBJ_STRING: return free_string(obj);
+	case OBJ_STRING:
+        if (((StringObj*) obj)->interned) return; // every chunk that uses the name shares it
+        return free_string(obj);
 	case OBJ_FUNCTION: return free_function(obj);
     case OBJ_ERROR: return free_error(obj);
     case OBJ_ITERABLE: return free_iterable(obj);
     case OBJ_ARRAY: return free_array(obj);
     case OBJ_NATIVE_METHOD:
     case OBJ_NATIVE: return free_native(obj);
+    case OBJ_CLOSURE: return free_closure(obj);
+    case OBJ_UPVALUE: return free_upvalue(obj);
+    case OBJ_ROPE: return free_rope(obj);
 	default: printf("[ERROR] cannot free object, it is not yet supported. got object %d", obj->type); // unreachable
 	}
 }
+
+size_t object_size(Obj* obj) {
+    switch (obj->type) {
+        case OBJ_STRING: return sizeof(StringObj) + ((StringObj*) obj)->length + 1;
+        case OBJ_ERROR: return sizeof(ErrorObj) + object_size((Obj*) ((ErrorObj*) obj)->value);
+        case OBJ_ITERABLE: return sizeof(IterableObj);
+        case OBJ_ARRAY: return sizeof(ArrayObj) + sizeof(ValueArray) + ((ArrayObj*) obj)->values->capacity * sizeof(Value);
+        case OBJ_NATIVE_METHOD:
+        case OBJ_NATIVE: return sizeof(NativeFuncObj);
+        case OBJ_CLOSURE: return sizeof(ClosureObj) + ((ClosureObj*) obj)->upvalueCount * sizeof(UpvalueObj*);
+        case OBJ_UPVALUE: return sizeof(UpvalueObj);
+        case OBJ_FUNCTION: return sizeof(FunctionObj);
+        case OBJ_ROPE: {
+            RopeObj* rope = (RopeObj*) obj;
+            return sizeof(RopeObj) + (rope->flat != NULL ? object_size((Obj*) rope->flat) : 0);
+        }
+        default: return sizeof(Obj);
+    }
+}
 // <------------------------------------>
 
 
 // <---- compare related functions ----->
 static bool compare_strings(StringObj* a, StringObj* b) {
+	if (a == b) {
+		return true;
+	}
+	if (a->interned && b->interned) {
+		return false; // two interned strings have different values, or they would be the same string
+	}
 	if (a->length != b->length) {
 		return false;
 	}
@@ -88,6 +146,10 @@ static bool compare_strings(StringObj* a, StringObj* b) {
 
 
 bool compare_objects(Obj* obj1, Obj* obj2) {
+	if ((obj1->type == OBJ_ROPE && (obj2->type == OBJ_STRING || obj2->type == OBJ_ROPE)) ||
+	    (obj2->type == OBJ_ROPE && obj1->type == OBJ_STRING)) {
+		return compare_strings(as_string(obj1), as_string(obj2)); // a rope equals the string it flattens to
+	}
 	if (obj1->type != obj2->type) {
 		return false;
 	}
@@ -98,9 +160,9 @@ bool compare_objects(Obj* obj1, Obj* obj2) {
 }
 bool iterable_out_of_bounds(IterableObj * iterable) {
     switch (iterable->iterable->type) {
+        case OBJ_ROPE:
         case OBJ_STRING: {
-            StringObj* temp_obj = (StringObj*) iterable->iterable;
-            return temp_obj->length <= iterable->index;
+            return string_length(iterable->iterable) <= iterable->index;
 
         } case OBJ_ARRAY: {
                 ArrayObj* temp_obj = (ArrayObj* )iterable->iterable;
@@ -111,61 +173,126 @@ bool iterable_out_of_bounds(IterableObj * iterable) {
     }
 }
 
-static Value copy_value(Value val) {
-    if (!IS_OBJ(val)) return val;
-    Obj* obj_val = AS_OBJ(val);
-    switch (obj_val->type) {
-        case OBJ_STRING: {
-            StringObj* string_obj = CONVERT_OBJ(StringObj, obj_val);
-            return VAR_OBJ(create_string_obj(string_obj->value, string_obj->length));
-        }
-        default: return val;
-    }
-}
-
 Value iterable_get_at(IterableObj* iterable, int index) {
     switch(iterable->iterable->type) {
+        case OBJ_ROPE:
         case OBJ_STRING: {
-            StringObj* string_obj = CONVERT_OBJ(StringObj, iterable->iterable);
-            StringObj* val_obj = create_string_obj(string_obj->value + index, 1);
-            return VAR_OBJ(val_obj);
+            StringObj* string_obj = as_string(iterable->iterable);
+            return VAR_OBJ(single_byte_string((uint8_t) string_obj->value[index]));
         }
         case OBJ_ARRAY: {
             ArrayObj* arr_obj = (ArrayObj*) iterable->iterable;
-            return copy_value(arr_obj->values->arr[index]);
+            return arr_obj->values->arr[index]; // strings are immutable, the element itself is shared
         }
         default: return VAR_NIL;
     }
 }
 // <------------------------------------>
 
-static char* copy_string(const char* value, int length) {
-    char *str_value = (char *) malloc(length + 1);
-    if (str_value == NULL) {
-        printf("[ERROR] cannot allocate string. exiting...\n");
-        exit(1);
-    }
-    memcpy(str_value, value, length);
-    str_value[length] = '\0';
-    return str_value;
+StringObj* allocate_string(int length) {
+    // the characters follow the header in the same block
+    StringObj* str_obj = (StringObj*) allocate_object(sizeof(StringObj) + length + 1, OBJ_STRING);
+    str_obj->length = length;
+    str_obj->hash = 0;
+    str_obj->interned = false;
+    str_obj->value[length] = '\0';
+    return str_obj;
 }
 
 StringObj* create_string_obj(const char* value, int length) {
-	// create the required arguments
-	char* string_value = copy_string(value, length);
-	StringObj* str_obj = ALLOCATE_OBJECT(StringObj, OBJ_STRING);
-	if (str_obj == NULL) {
-		printf("[ERROR] couldn't allocate string object");
-		exit(1);
+	StringObj* str_obj = allocate_string(length);
+	memcpy(str_obj->value, value, length);
+	return str_obj;
+}
+
+unsigned hash_string(const char* value, int length) {
+    // FNV-1a
+	unsigned hash = 2166136261u;
+	for (int i = 0; i < length; i++) {
+		hash = (hash ^ (uint8_t) value[i]) * 16777619;
 	}
+	return hash;
+}
 
-	// set the values
-	str_obj->value = string_value;
-	str_obj->length = length;
+// <---- shared strings ----->
+// an open addressed table of the interned strings, probed linearly from their hash
+static StringObj** interned = NULL;
+static int internedCount = 0;
+static int internedCapacity = 0;
+
+static StringObj** find_interned(StringObj** table, int capacity, const char* value, int length, unsigned hash) {
+    // the slot of the string, or the empty slot it belongs in
+    int index = (int) (hash & (capacity - 1));
+    while (table[index] != NULL) {
+        StringObj* str = table[index];
+        if (str->hash == hash && str->length == length && memcmp(str->value, value, length) == 0) {
+            break;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+    return &table[index];
+}
 
-	return str_obj;
+StringObj* intern_string(const char* value, int length) {
+    if (internedCount + 1 > internedCapacity * 3 / 4) {
+        int capacity = GROW_CAPACITY(internedCapacity);
+        StringObj** table = (StringObj**) calloc(capacity, sizeof(StringObj*));
+        if (table == NULL) {
+            printf("[ERROR] couldn't grow the intern table. exiting...\n");
+            exit(1);
+        }
+        for (int i = 0; i < internedCapacity; i++) {
+            StringObj* str = interned[i];
+            if (str != NULL) {
+                *find_interned(table, capacity, str->value, str->length, str->hash) = str;
+            }
+        }
+        free(interned);
+        interned = table;
+        internedCapacity = capacity;
+    }
+    unsigned hash = hash_string(value, length);
+    StringObj** slot = find_interned(interned, internedCapacity, value, length, hash);
+    if (*slot == NULL) {
+        StringObj* str = create_string_obj(value, length);
+        str->hash = hash;
+        str->interned = true;
+        *slot = str;
+        internedCount++;
+    }
+    return *slot;
 }
 
+static StringObj* singleBytes[256]; // made the first time each is needed
+
+StringObj* single_byte_string(uint8_t byte) {
+    if (singleBytes[byte] == NULL) {
+        char value = (char) byte;
+        singleBytes[byte] = create_string_obj(&value, 1);
+        singleBytes[byte]->obj.generation = GEN_PERMANENT;
+    }
+    return singleBytes[byte];
+}
+
+void free_shared_strings() {
+    for (int i = 0; i < internedCapacity; i++) {
+        if (interned[i] != NULL) {
+            free_string((Obj*) interned[i]);
+        }
+    }
+    free(interned);
+    interned = NULL;
+    internedCount = 0;
+    internedCapacity = 0;
+    for (int i = 0; i < 256; i++) {
+        if (singleBytes[i] != NULL) {
+            free_string((Obj*) singleBytes[i]);
+            singleBytes[i] = NULL;
+        }
+    }
+}
+// <------------------------------------>
+
 
 ErrorObj* create_err_obj(const char* value, int length, ErrorType type) {
     StringObj* name = create_string_obj(value, length);
@@ -182,8 +309,9 @@ ErrorObj* create_err_obj(const char* value, int length, ErrorType type) {
 
 ArrayObj* create_array_obj() {
     ArrayObj* arr = ALLOCATE_OBJECT(ArrayObj, OBJ_ARRAY);
-    arr->values = malloc(sizeof(ValueArray));
+    arr->values = (ValueArray*) allocate_block(sizeof(ValueArray));
     init_value_array(arr->values);
+    arr->rememberedFrom = 0;
     return arr;
 }
 
@@ -200,6 +328,14 @@ FunctionObj* create_func_obj(const char* value, int length, FunctionType type) {
 	// set the values
 	func_obj->name = name;
     func_obj->type = type;
+    func_obj->localCount = 0;
+    func_obj->maxStackSize = 0;
+    func_obj->jit = NULL;
+    func_obj->hotness = 0;
+    func_obj->traces = NULL;
+    func_obj->aot = NULL;
+    init_register_chunk(&func_obj->registers);
+    func_obj->upvalueCount = 0;
 
 	Chunk body;
 	init_chunk(&body);
@@ -211,15 +347,38 @@ FunctionObj* create_func_obj(const char* value, int length, FunctionType type) {
 NativeFuncObj* create_native_func_obj(NativeFn function) {
     NativeFuncObj* func_obj = ALLOCATE_OBJECT(NativeFuncObj, OBJ_NATIVE);
     func_obj->function = function;
+    func_obj->bound = VAR_NIL;
     return func_obj;
 }
 
-NativeFuncObj* create_native_method_obj(NativeFn function) {
+NativeFuncObj* create_native_method_obj(NativeFn function, Value bound) {
     NativeFuncObj* func_obj = ALLOCATE_OBJECT(NativeFuncObj, OBJ_NATIVE_METHOD);
     func_obj->function = function;
+    func_obj->bound = bound;
     return func_obj;
 }
 
+ClosureObj* create_closure_obj(FunctionObj* function) {
+    UpvalueObj** upvalues = NULL;
+    if (function->upvalueCount > 0) {
+        upvalues = (UpvalueObj**) allocate_block(function->upvalueCount * sizeof(UpvalueObj*));
+        memset(upvalues, 0, function->upvalueCount * sizeof(UpvalueObj*));
+    }
+    ClosureObj* closure = ALLOCATE_OBJECT(ClosureObj, OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalues = upvalues;
+    closure->upvalueCount = (int) function->upvalueCount;
+    return closure;
+}
+
+UpvalueObj* create_upvalue_obj(Value* location) {
+    UpvalueObj* upvalue = ALLOCATE_OBJECT(UpvalueObj, OBJ_UPVALUE);
+    upvalue->location = location;
+    upvalue->closed = VAR_NIL;
+    upvalue->nextOpen = NULL;
+    return upvalue;
+}
+
 IterableObj* get_iterable(Obj* iterable) {
     IterableObj* iter_obj = ALLOCATE_OBJECT(IterableObj, OBJ_ITERABLE);
     iter_obj->index = 0;
@@ -228,27 +387,66 @@ IterableObj* get_iterable(Obj* iterable) {
 }
 
 
-StringObj* concat_strings(const char* value1, int length1, const char* value2, int length2) {
-	// create the required strings
-	char* string_value = (char*)malloc(length1 + length2 + 1);
-	if (string_value == NULL) {
-		printf("[ERROR] couldn't allocate string object");
-		exit(1);
-	}
-
-	// copy the data to the correct places
-	memcpy(string_value, value1, length1);
-	memcpy(string_value + length1, value2, length2);
-	string_value[length1 + length2] = '\0';
-
-	StringObj* str_obj = ALLOCATE_OBJECT(StringObj, OBJ_STRING);
-	if (str_obj == NULL) {
-		printf("[ERROR] couldn't allocate string object");
-		exit(1);
-	}
+Obj* concat_strings(Obj* a, Obj* b) {
+    int length = string_length(a) + string_length(b);
+    if (length < ROPE_MIN_LENGTH) {
+        StringObj* left = as_string(a);
+        StringObj* right = as_string(b);
+        StringObj* str_obj = allocate_string(length);
+        // copy the data to the correct places
+        memcpy(str_obj->value, left->value, left->length);
+        memcpy(str_obj->value + left->length, right->value, right->length);
+        return (Obj*) str_obj;
+    }
+    RopeObj* rope = ALLOCATE_OBJECT(RopeObj, OBJ_ROPE);
+    rope->length = length;
+    rope->left = a;
+    rope->right = b;
+    rope->flat = NULL;
+    return (Obj*) rope;
+}
 
-	str_obj->value = string_value;
-	str_obj->length = length1 + length2;
-	return str_obj;
+StringObj* flatten_rope(RopeObj* rope) {
+    if (rope->flat != NULL) {
+        return rope->flat;
+    }
+    StringObj* flat = allocate_string(rope->length);
+    // copy the pieces left to right. a rope built in a loop is as deep as the loop ran, so walk it with a stack of
+    // the pieces still to copy rather than recursing
+    int count = 0;
+    int capacity = 8;
+    Obj** pending = (Obj**) malloc(capacity * sizeof(Obj*));
+    if (pending == NULL) {
+        printf("[ERROR] couldn't flatten a string. exiting...\n");
+        exit(1);
+    }
+    pending[count++] = rope->right;
+    pending[count++] = rope->left;
+    int at = 0;
+    while (count > 0) {
+        Obj* piece = pending[--count];
+        if (piece->type == OBJ_ROPE && ((RopeObj*) piece)->flat == NULL) {
+            if (count + 2 > capacity) {
+                capacity = GROW_CAPACITY(capacity);
+                pending = (Obj**) realloc(pending, capacity * sizeof(Obj*));
+            }
+            if (pending == NULL) {
+                printf("[ERROR] couldn't flatten a string. exiting...\n");
+                exit(1);
+            }
+            pending[count++] = ((RopeObj*) piece)->right;
+            pending[count++] = ((RopeObj*) piece)->left;
+            continue;
+        }
+        StringObj* str = as_string(piece);
+        memcpy(flat->value + at, str->value, str->length);
+        at += str->length;
+    }
+    free(pending);
 
+    // the pieces are not needed anymore, let the collector have them
+    rope->flat = flat;
+    rope->left = NULL;
+    rope->right = NULL;
+    return flat;
 }
\ No newline at end of file
@@ -8,37 +8,82 @@
 /// Object Types
 typedef struct {
 	Obj obj;
-	char* value;
 	int length;
+	unsigned hash; // hash_string of the value, set for interned strings only
+	bool interned; // the one string of its value that intern_string hands out, owned by the intern table
+	char value[]; // length characters and a '\0', allocated together with the object
 } StringObj;
 
+// the result of + on two strings that make a long one. it keeps the strings it joins instead of copying them, so
+// building a string piece by piece costs a node per piece. its characters are copied together into flat once
+// something reads them
+typedef struct {
+    Obj obj;
+    int length;
+    Obj* left; // StringObj or RopeObj, NULL once flattened
+    Obj* right;
+    StringObj* flat; // NULL until flattened, owned by the rope
+} RopeObj;
+
+#define ROPE_MIN_LENGTH 64 // shorter concatenations are copied right away
+
 
 typedef enum {
     FN_SCRIPT,
     FN_FUNCTION,
 } FunctionType;
 
+// a local is only a name, its value lives in the slot window of the running StackFrame
 typedef struct {
     char* name;
     int length;
-    Value value;
 } Local;
 
+// describes where a closure finds one of its captured variables when it is created
+typedef struct {
+    uint8_t index; // slot of the enclosing frame if isLocal, otherwise an upvalue of the enclosing closure
+    bool isLocal;
+} Upvalue;
+
 typedef struct {
 	Obj obj;
 	Chunk body;
 	StringObj* name;
     FunctionType type;
 
-    Local locals[UINT8_MAX]; // currently hardcoded
+    Local locals[UINT8_MAX]; // currently hardcoded, locals[i] names frame slot i
     unsigned int localCount;
+    int maxStackSize; // slots a frame of the function needs: its locals and the deepest its operand stack gets
+    RegisterChunk registers; // the body translated to register code, empty unless running with --registers
+    struct JitCode* jit; // native code made by jit_compile, NULL until the function gets hot
+    int hotness; // calls and loop iterations counted towards JIT_THRESHOLD
+    struct Trace* traces; // the loops of the body seen by the tracing jit
+    void* aot; // the AotFunction of a program made by shipc --emit-c, NULL otherwise
+
+    Upvalue upvalues[UINT8_MAX];
+    unsigned int upvalueCount;
 } FunctionObj;
 
-typedef Value (*NativeFn) (int arg_count, Value* args);
+// a captured variable. while the variable's frame is alive, location points at its stack slot.
+// once the frame returns, the value is moved into closed and location points there instead.
+typedef struct UpvalueObj {
+    Obj obj;
+    Value* location;
+    Value closed;
+    struct UpvalueObj* nextOpen;
+} UpvalueObj;
+
+typedef struct {
+    Obj obj;
+    FunctionObj* function;
+    UpvalueObj** upvalues;
+    int upvalueCount;
+} ClosureObj;
 
 typedef struct {
     Obj  obj;
     NativeFn function;
+    Value bound; // the value a native method was loaded from, nil for plain native functions
 } NativeFuncObj;
 
 // error related enums
@@ -64,6 +109,7 @@ typedef struct {
 typedef struct {
     Obj obj;
     ValueArray* values;
+    int rememberedFrom; // while the array is remembered, the first element that may point into the nursery
 } ArrayObj;
 ///
 
@@ -74,11 +120,34 @@ typedef struct {
 
 
 StringObj* create_string_obj(const char* value, int length);
-StringObj* concat_strings(const char* value1, int length1, const char* value2, int length2);
+// a string of length characters, the caller fills them in
+StringObj* allocate_string(int length);
+unsigned hash_string(const char* value, int length);
+// the names the compiler emits are interned: equal names share one string, so they compare by pointer and their
+// hash is computed once. interned strings are constants that are never collected
+StringObj* intern_string(const char* value, int length);
+// the string of one character, shared by every string iteration that yields it
+StringObj* single_byte_string(uint8_t byte);
+// frees the interned and single byte strings, once no chunk uses them anymore
+void free_shared_strings();
+// a and b are strings or ropes, the result is either
+Obj* concat_strings(Obj* a, Obj* b);
+StringObj* flatten_rope(RopeObj* rope);
+
+static inline StringObj* as_string(Obj* obj) {
+    return obj->type == OBJ_STRING ? (StringObj*) obj : flatten_rope((RopeObj*) obj);
+}
+
+static inline int string_length(Obj* obj) {
+    // without flattening a rope
+    return obj->type == OBJ_STRING ? ((StringObj*) obj)->length : ((RopeObj*) obj)->length;
+}
 
 FunctionObj* create_func_obj(const char* value, int length, FunctionType type);
 NativeFuncObj* create_native_func_obj(NativeFn function);
-NativeFuncObj* create_native_method_obj(NativeFn function);
+NativeFuncObj* create_native_method_obj(NativeFn function, Value bound);
+ClosureObj* create_closure_obj(FunctionObj* function);
+UpvalueObj* create_upvalue_obj(Value* location);
 
 
 IterableObj* get_iterable(Obj* iterable);
@@ -90,6 +159,8 @@ ArrayObj* create_array_obj();
 ErrorObj* create_err_obj(const char* value, int length, ErrorType type);
 
 void free_object(Obj* obj);
+// bytes the object and what it owns take, as the collector counts them
+size_t object_size(Obj* obj);
 bool compare_objects(Obj* obj1, Obj* obj2);
 
 #endif // !SHIP_OBJECTS_H_
@@ -15,17 +15,6 @@ void create_variable_map(HashMap* mp) {
     mp->arr = calloc(mp->capacity, sizeof(HashNode*));
 }
 
-static unsigned hash_function(const char* name, int length) {
-	unsigned hash = 2166136261;
-	int i = 0;
-	while (i < length) {
-		hash = hash ^ name[i];
-		hash = hash * 16777619;
-		i++;
-	}
-	return hash; // & (capacity - 1); calculate the modulo of the capacity
-}
-
 static HashNode* create_node(char* name, size_t len, unsigned int val) {
 	HashNode* node = (HashNode*)malloc(sizeof(HashNode));
 	if (node == NULL) {
@@ -40,7 +29,7 @@ static HashNode* create_node(char* name, size_t len, unsigned int val) {
 }
 
 static void put_node_t(char* name, int name_len, int capacity, HashNode** arr, HashNode* nd) {
-	unsigned index = hash_function(name, name_len) & (capacity - 1);
+	unsigned index = hash_string(name, name_len) & (capacity - 1);
 	if (arr[index] == NULL) {
 		arr[index] = nd;
 		return;
@@ -65,14 +54,18 @@ static void resize_map(HashMap* map) {
 		}
 		HashNode* pos = map->arr[i];
 		while (pos != NULL) {
+			// detach the node before moving it, its old chain doesn't belong to the new bucket
+			HashNode* next = (HashNode *) pos->next;
+			pos->next = NULL;
 			put_node_t(pos->name, pos->len, new_capacity, temp_, pos);
-			pos = (HashNode *) pos->next;
+			pos = next;
 		}
 	}
 
 	// free and assign the new array
 	free(map->arr);
 	map->arr = temp_;
+	map->capacity = new_capacity;
 
 }
 
@@ -85,10 +78,10 @@ void put_node(HashMap* map,char* name,int name_len, unsigned int val) {
 	put_node_t(name, name_len, map->capacity, map->arr, nd);
 }
 
-HashNode* get_node(HashMap* map, char* name, int name_len) {
-	unsigned index = hash_function(name, name_len) & (map->capacity - 1); // calculate the index
+HashNode* get_node(HashMap* map, char* name, size_t name_len) {
+	unsigned index = hash_string(name, name_len) & (map->capacity - 1); // calculate the index
 	HashNode* pos = map->arr[index];
-	while (pos != NULL && strncmp(name, pos->name, pos->len) != 0) {
+	while (pos != NULL && (pos->len != name_len || strncmp(name, pos->name, pos->len) != 0)) {
 		pos = pos->next;
 	}
 	return pos;
@@ -111,10 +104,11 @@ void free_hash_map(HashMap* map) {
 void create_value_map(ValueTable * mp) {
     mp->capacity = 8;
     mp->count = 0;
+    mp->version = 1; // caches start at version 0, so they miss on their first lookup
     mp->arr = calloc(mp->capacity, sizeof(ValueNode *));
 }
 
-ValueNode * create_value_node(char* name, int len, Value val) {
+ValueNode * create_value_node(char* name, int len, unsigned hash, Value val) {
     ValueNode * node = (ValueNode *) malloc(sizeof(ValueNode));
     if (node == NULL) {
         printf("Failed to allocate node");
@@ -122,12 +116,13 @@ ValueNode * create_value_node(char* name, int len, Value val) {
     }
     node->name = name;
     node->length = len;
+    node->hash = hash;
     node->val = val;
     node->next = NULL;
     return node;
 }
-static void put_value_node_t(char* name, int name_len, int capacity, ValueNode ** arr, ValueNode * nd) {
-    unsigned index = hash_function(name, name_len) & (capacity - 1);
+static void put_value_node_t(int capacity, ValueNode ** arr, ValueNode * nd) {
+    unsigned index = nd->hash & (capacity - 1);
     if (arr[index] == NULL) {
         arr[index] = (ValueNode *) nd;
         return;
@@ -152,31 +147,38 @@ static void resize_value_table(ValueTable *map) {
         }
         ValueNode * pos = map->arr[i];
         while (pos != NULL) {
-            put_value_node_t(pos->name, pos->length, new_capacity, temp_, pos);
-            pos = (ValueNode *) pos->next;
+            // detach the node before moving it, its old chain doesn't belong to the new bucket
+            ValueNode * next = (ValueNode *) pos->next;
+            pos->next = NULL;
+            put_value_node_t(new_capacity, temp_, pos);
+            pos = next;
         }
     }
 
     // free and assign the new array
     free(map->arr);
     map->arr = temp_;
+    map->capacity = new_capacity;
 
 }
 
 
 void put_value_node(ValueTable * map,char* name,int name_len, Value val) {
-    ValueNode * nd = create_value_node(name, name_len, val);
+    ValueNode * nd = create_value_node(name, name_len, hash_string(name, name_len), val);
     if ((double)map->count / map->capacity >= 0.75) {
         resize_value_table((ValueTable *) map);
     }
     map->count++;
-    put_value_node_t(name, name_len, map->capacity, map->arr, nd);
+    map->version++;
+    put_value_node_t(map->capacity, map->arr, nd);
 }
 
-ValueNode * get_global(ValueTable * map, char* name, int name_len) {
-    unsigned index = hash_function(name, name_len) & (map->capacity - 1); // calculate the index
-    ValueNode * pos = map->arr[index];
-    while (pos != NULL && strncmp(name, pos->name, pos->length) != 0) {
+ValueNode * get_global(ValueTable * map, StringObj* name) {
+    // an interned name brings its hash along, and only a node of the same hash is compared byte by byte
+    unsigned hash = name->interned ? name->hash : hash_string(name->value, name->length);
+    ValueNode * pos = map->arr[hash & (map->capacity - 1)];
+    while (pos != NULL && (pos->hash != hash || pos->length != name->length ||
+                           memcmp(name->value, pos->name, pos->length) != 0)) {
         pos = (ValueNode *) pos->next;
     }
     return pos;
@@ -18,9 +18,10 @@ typedef struct {
 	HashNode** arr;
 } HashMap;
 
-typedef struct {
+typedef struct ValueNode {
     char* name;
     int length;
+    unsigned hash;
     Value val;
     struct ValueNode* next;
 } ValueNode;
@@ -28,19 +29,20 @@ typedef struct {
 typedef struct {
     int count;
     int capacity;
+    unsigned int version; // bumped whenever a name is added, invalidates the global inline caches
     ValueNode ** arr;
 } ValueTable;
 
 void put_node(HashMap* map, char* name, int name_len, unsigned int val);
 void create_variable_map(HashMap* mp);
 void free_hash_map(HashMap* map);
-HashNode* get_node(HashMap* map, char* name, int name_len);
+HashNode* get_node(HashMap* map, char* name, size_t name_len);
 
 // Table value related
 
 void put_value_node(ValueTable * map,char* name,int name_len, Value val);
 void create_value_map(ValueTable * mp);
-ValueNode * get_global(ValueTable * map, char* name, int name_len);
+ValueNode * get_global(ValueTable * map, StringObj* name);
 void free_globals(ValueTable * map);
 
 #endif // !SHIP_TABLE_H_
@@ -0,0 +1,629 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "emit.h"
+#include "memory.h"
+
+#ifdef SHIP_JIT
+
+// A tracing jit for hot numeric loops. once a loop header was reached TRACE_THRESHOLD times, the next iteration is
+// recorded: run through jit_step instruction by instruction, writing down each instruction and whether it took its
+// jump. the recorded path is then compiled to a straight line of machine code that loops back to its own start.
+//
+// a trace only handles numbers. the variables it touches are loaded into xmm registers once, when it is entered,
+// and its operand stack lives in xmm registers too, so nothing is boxed while it loops. every assumption the
+// recording made is checked by a guard: the variables being numbers on entry, a branch going the recorded way,
+// a divisor not being 0, a for loop still walking an array of numbers. a failed guard exits the trace: the variables
+// it wrote and the values on its stack are boxed back into the frame, and run() continues at the instruction the
+// trace could not handle. loops that leave the path a trace can take while being recorded are blacklisted.
+//
+// registers while a trace runs, besides the ones of emit.h:
+//   xmm0, xmm1 = scratch
+//   xmm2 ... = the loop's variables, then the trace's stack from depth 0 up
+
+typedef InterpretResult (*TraceEntry)(VM* vm, StackFrame* frame);
+
+typedef struct {
+    int offset; // bytecode offset of the instruction
+    bool branched; // whether it took its jump
+} TraceStep;
+
+typedef enum {
+    RECORD_CLOSED, // the iteration came back to the loop header
+    RECORD_ABORTED, // it reached an instruction a trace can't run, run() continues from there
+    RECORD_FAILED, // an instruction raised a runtime error
+} RecordResult;
+
+// <---- recording ----->
+static bool top_are_numbers(VM* vm, int count) {
+    for (int i = 1; i <= count; i++) {
+        if (!IS_NUMBER(vm->sp[-i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// whether the trace compiler can handle the instruction at ip, with the values it is about to run on
+static bool traceable(VM* vm, StackFrame* frame, uint8_t* ip, int header) {
+    Chunk* chunk = &frame->function->body;
+    switch (ip[0]) {
+        case OP_CONSTANT:
+            return IS_NUMBER(chunk->constants.arr[ip[1]]);
+        case OP_LOAD_LOCAL:
+        case OP_INCREMENT_LOCAL:
+            return IS_NUMBER(frame->slots[ip[1]]);
+        case OP_LOAD_SCRIPT:
+            return IS_NUMBER(vm->stack[ip[1]]);
+        case OP_STORE_FAST:
+        case OP_ASSIGN_LOCAL:
+        case OP_ASSIGN_SCRIPT:
+        case OP_NEGATE:
+            return top_are_numbers(vm, 1);
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUB:
+        case OP_SUB_NUM:
+        case OP_MUL:
+        case OP_MUL_NUM:
+        case OP_DIV:
+        case OP_MODULO:
+        case OP_LESS_THAN:
+        case OP_LESS_THAN_NUM:
+        case OP_GREATER_THAN:
+        case OP_GREATER_THAN_NUM:
+        case OP_COMPARE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+            return top_are_numbers(vm, 2);
+        case OP_NOT:
+        case OP_POP_JUMP_IF_FALSE:
+            return IS_BOOL(vm->sp[-1]);
+        case OP_POP_TOP:
+        case OP_JUMP:
+            return true;
+        case OP_JUMP_BACKWARD:
+            return jump_target(chunk, (int) (ip - chunk->codes)) == header; // not the back edge of an inner loop
+        case OP_FOR_ITER: {
+            if (!IS_ITERABLE(vm->sp[-1])) {
+                return false;
+            }
+            IterableObj* iter_obj = AS_ITERABLE(vm->sp[-1]);
+            if (iter_obj->iterable->type != OBJ_ARRAY) {
+                return false;
+            }
+            ValueArray* values = ((ArrayObj*) iter_obj->iterable)->values;
+            return iter_obj->index >= values->count || IS_NUMBER(values->arr[iter_obj->index]);
+        }
+        default:
+            return false;
+    }
+}
+
+// runs one iteration of the loop whose header frame->ip is at, through jit_step, and writes down its path
+static RecordResult record_trace(VM* vm, StackFrame* frame, int back_edge, TraceStep* steps, int* count) {
+    Chunk* chunk = &frame->function->body;
+    int header = (int) (frame->ip - chunk->codes);
+    int offset = header;
+    *count = 0;
+    do {
+        uint8_t* ip = chunk->codes + offset;
+        if (*count == TRACE_MAX_LENGTH || offset < header || offset > back_edge || !traceable(vm, frame, ip, header)) {
+            frame->ip = ip;
+            return RECORD_ABORTED;
+        }
+        JitStep step = jit_step(vm, frame, ip);
+        if (step == JIT_FAILED) {
+            return RECORD_FAILED;
+        }
+        steps[(*count)++] = (TraceStep) {offset, step == JIT_BRANCH};
+        offset = step == JIT_BRANCH ? jump_target(chunk, offset) : offset + instruction_length(chunk, offset);
+    } while (offset != header);
+    frame->ip = chunk->codes + header;
+    return RECORD_CLOSED;
+}
+// <------------------------------------>
+
+
+// <---- trace compiler ----->
+#define FIRST_REGISTER 2 // xmm0 and xmm1 are scratch
+#define REGISTER_COUNT 16
+#define SPILL_BYTES (REGISTER_COUNT * 8) // room to save every xmm register around a call into C
+
+// jump targets that are not exits
+#define TARGET_LOOP (-1) // the start of the trace, after the variables were loaded
+#define TARGET_EPILOGUE (-2)
+
+typedef enum {
+    ENTRY_NUMBER, // a double in the entry's register
+    ENTRY_CONDITION, // a comparison of the numbers in the entry's register and the next one, not made yet
+} EntryKind;
+
+typedef struct {
+    EntryKind kind;
+    uint8_t op; // of a condition: OP_LESS_THAN, OP_GREATER_THAN or OP_COMPARE
+    bool negated; // of a condition: flipped by OP_NOT
+} StackEntry;
+
+// a variable the trace keeps in a register while it runs
+typedef struct {
+    bool script; // a slot of the script frame, otherwise of the loop's frame
+    uint8_t index;
+    bool written; // stored back to its slot when the trace exits
+} TraceVariable;
+
+// a way back to run()
+typedef struct {
+    int resume; // bytecode offset run() continues at
+    int depth; // stack entries boxed back onto the vm stack
+    bool loaded; // whether the variables were loaded yet, the guards on entry have nothing to store back
+} TraceExit;
+
+typedef struct {
+    CodeBuffer buf;
+    Chunk* chunk;
+    bool scriptIsLocal; // the loop runs in the script frame, where script slots and locals are the same slots
+    bool failed;
+
+    TraceVariable variables[REGISTER_COUNT];
+    int variableCount;
+    int stackBase; // register of the entry at depth 0
+    StackEntry stack[REGISTER_COUNT];
+    int depth;
+
+    TraceExit* exits;
+    int exitCount;
+    int exitCapacity;
+} TraceCompiler;
+
+static int variable_register(TraceCompiler* compiler, bool script, uint8_t index) {
+    script = script && !compiler->scriptIsLocal;
+    for (int i = 0; i < compiler->variableCount; i++) {
+        if (compiler->variables[i].script == script && compiler->variables[i].index == index) {
+            return FIRST_REGISTER + i;
+        }
+    }
+    if (FIRST_REGISTER + compiler->variableCount == REGISTER_COUNT) {
+        compiler->failed = true;
+        return FIRST_REGISTER;
+    }
+    compiler->variables[compiler->variableCount] = (TraceVariable) {script, index, false};
+    return FIRST_REGISTER + compiler->variableCount++;
+}
+
+// where the slot of a variable is, as [base + disp]
+static void variable_slot(TraceVariable* variable, int* base, int32_t* disp) {
+    *base = variable->script ? R13 : R12;
+    *disp = (variable->script ? (int32_t) offsetof(VM, stack) : 0) + variable->index * VALUE_SIZE;
+}
+
+static int push_entry(TraceCompiler* compiler, EntryKind kind) {
+    // a condition still needs the register above it
+    bool above_condition = compiler->depth > 0 && compiler->stack[compiler->depth - 1].kind == ENTRY_CONDITION;
+    if (above_condition || compiler->stackBase + compiler->depth == REGISTER_COUNT) {
+        compiler->failed = true;
+        return compiler->stackBase;
+    }
+    compiler->stack[compiler->depth] = (StackEntry) {kind, 0, false};
+    return compiler->stackBase + compiler->depth++;
+}
+
+static StackEntry* pop_entry(TraceCompiler* compiler, EntryKind kind, int* reg) {
+    static StackEntry none;
+    if (compiler->depth == 0 || compiler->stack[compiler->depth - 1].kind != kind) {
+        compiler->failed = true;
+        *reg = compiler->stackBase;
+        return &none;
+    }
+    compiler->depth--;
+    *reg = compiler->stackBase + compiler->depth;
+    return &compiler->stack[compiler->depth];
+}
+
+static int pop_number(TraceCompiler* compiler) {
+    int reg;
+    pop_entry(compiler, ENTRY_NUMBER, &reg);
+    return reg;
+}
+
+// an exit to resume with the current stack, returns its target for add_patch
+static int add_exit(TraceCompiler* compiler, int resume, bool loaded) {
+    for (int i = 0; i < compiler->depth; i++) {
+        if (compiler->stack[i].kind != ENTRY_NUMBER) {
+            compiler->failed = true; // a condition has no Value to box back
+        }
+    }
+    if (compiler->exitCount == compiler->exitCapacity) {
+        compiler->exitCapacity = GROW_CAPACITY(compiler->exitCapacity);
+        compiler->exits = realloc(compiler->exits, compiler->exitCapacity * sizeof(TraceExit));
+    }
+    compiler->exits[compiler->exitCount] = (TraceExit) {resume, compiler->depth, loaded};
+    return compiler->exitCount++;
+}
+
+static void emit_exit_jcc(TraceCompiler* compiler, Condition cc, int exit) {
+    add_patch(&compiler->buf, emit_jcc(&compiler->buf, cc), exit);
+}
+
+static void emit_load_double(CodeBuffer* buf, int xmm, double number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    emit_mov_imm64(buf, RAX, bits);
+    emit_movq_xmm(buf, xmm, RAX);
+}
+
+// exits unless the comparison the condition in reg stands for comes out as expected
+static void emit_condition_guard(TraceCompiler* compiler, StackEntry condition, int reg, bool expected, int exit) {
+    CodeBuffer* buf = &compiler->buf;
+    bool holds = expected != condition.negated; // what the comparison itself has to come out as
+    switch (condition.op) {
+        case OP_LESS_THAN:
+            emit_sse_reg(buf, X86_UCOMISD, reg + 1, reg); // a < b is b above a, false when unordered
+            emit_exit_jcc(compiler, holds ? CC_BE : CC_A, exit);
+            break;
+        case OP_GREATER_THAN:
+            emit_sse_reg(buf, X86_UCOMISD, reg, reg + 1);
+            emit_exit_jcc(compiler, holds ? CC_BE : CC_A, exit);
+            break;
+        default: // OP_COMPARE, equal is ZF set without PF
+            emit_sse_reg(buf, X86_UCOMISD, reg, reg + 1);
+            if (holds) {
+                emit_exit_jcc(compiler, CC_NE, exit);
+                emit_exit_jcc(compiler, CC_P, exit);
+            } else {
+                int unordered = emit_jcc(buf, CC_P);
+                emit_exit_jcc(compiler, CC_E, exit);
+                patch_here(buf, unordered);
+            }
+            break;
+    }
+}
+
+// a call of fmod, which may clobber any xmm register. a and b are the popped operands, the result goes into a
+static void emit_modulo(TraceCompiler* compiler, int a, int b) {
+    CodeBuffer* buf = &compiler->buf;
+    int live = compiler->stackBase + compiler->depth; // the variables and the entries below the operands
+    for (int reg = FIRST_REGISTER; reg < live; reg++) {
+        emit_sse(buf, X86_MOVSD_STORE, reg, RSP, reg * 8);
+    }
+    emit_sse_reg(buf, X86_MOVAPD, 0, a);
+    emit_sse_reg(buf, X86_MOVAPD, 1, b);
+    emit_call(buf, (void*) fmod);
+    emit_sse_reg(buf, X86_MOVAPD, a, 0);
+    for (int reg = FIRST_REGISTER; reg < live; reg++) {
+        emit_sse(buf, X86_MOVSD_LOAD, reg, RSP, reg * 8);
+    }
+}
+
+// the next element of the array the iterator below the trace's stack walks, exits when it is done or not a number
+static void emit_for_iter(TraceCompiler* compiler, int offset, int reg) {
+    CodeBuffer* buf = &compiler->buf;
+    int other = add_exit(compiler, offset, true);
+    int done = add_exit(compiler, jump_target(compiler->chunk, offset), true);
+    // rdi = the IterableObj
+#ifdef SHIP_NAN_BOXING
+    emit_load(buf, RDI, RBX, -VALUE_SIZE);
+    emit_mov_imm64(buf, RCX, ~(SIGN_BIT | QNAN));
+    emit_alu(buf, X86_AND, RDI, RCX);
+#else
+    emit_load(buf, RDI, RBX, -VALUE_SIZE + NUMBER_OFFSET);
+#endif
+    emit_load(buf, RSI, RDI, offsetof(IterableObj, iterable));
+    emit_mem(buf, 0, false, 0x83, 7, RSI, offsetof(Obj, type)); // cmp dword [rsi + type], OBJ_ARRAY
+    emit_byte(buf, OBJ_ARRAY);
+    emit_exit_jcc(compiler, CC_NE, other);
+    emit_load(buf, RSI, RSI, offsetof(ArrayObj, values));
+    emit_mem(buf, 0, false, X86_MOV_LOAD, RDX, RDI, offsetof(IterableObj, index));
+    emit_mem(buf, 0, false, X86_CMP_LOAD, RDX, RSI, offsetof(ValueArray, count));
+    emit_exit_jcc(compiler, CC_GE, done);
+    // rsi = the element
+    emit_load(buf, RSI, RSI, offsetof(ValueArray, arr));
+    emit_movsxd(buf, RDX, RDX);
+    emit_shl(buf, RDX, VALUE_SIZE == 16 ? 4 : 3);
+    emit_alu(buf, X86_ADD, RSI, RDX);
+    add_patch(buf, emit_number_guard(buf, RSI, 0), other);
+    emit_sse(buf, X86_MOVSD_LOAD, reg, RSI, NUMBER_OFFSET);
+    emit_mem(buf, 0, false, 0x83, 0, RDI, offsetof(IterableObj, index)); // add dword [rdi + index], 1
+    emit_byte(buf, 1);
+}
+
+static void compile_step(TraceCompiler* compiler, TraceStep step) {
+    CodeBuffer* buf = &compiler->buf;
+    Chunk* chunk = compiler->chunk;
+    uint8_t* ip = chunk->codes + step.offset;
+    switch (ip[0]) {
+        case OP_CONSTANT: {
+            int reg = push_entry(compiler, ENTRY_NUMBER);
+            emit_load_double(buf, reg, AS_NUMBER(chunk->constants.arr[ip[1]]));
+            break;
+        }
+        case OP_LOAD_LOCAL:
+        case OP_LOAD_SCRIPT: {
+            int variable = variable_register(compiler, ip[0] == OP_LOAD_SCRIPT, ip[1]);
+            emit_sse_reg(buf, X86_MOVAPD, push_entry(compiler, ENTRY_NUMBER), variable);
+            break;
+        }
+        case OP_STORE_FAST:
+        case OP_ASSIGN_LOCAL:
+        case OP_ASSIGN_SCRIPT: {
+            int variable = variable_register(compiler, ip[0] == OP_ASSIGN_SCRIPT, ip[1]);
+            emit_sse_reg(buf, X86_MOVAPD, variable, pop_number(compiler));
+            break;
+        }
+        case OP_INCREMENT_LOCAL: {
+            int variable = variable_register(compiler, false, ip[1]);
+            emit_load_double(buf, 0, AS_NUMBER(chunk->constants.arr[ip[2]]));
+            emit_sse_reg(buf, X86_ADDSD, variable, 0);
+            break;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUB:
+        case OP_SUB_NUM:
+        case OP_MUL:
+        case OP_MUL_NUM:
+        case OP_DIV:
+        case OP_MODULO: {
+            if (ip[0] == OP_DIV) {
+                // a 0 divisor is a runtime error, left to run() with the operands on the stack
+                int divisor = compiler->stackBase + compiler->depth - 1;
+                int exit = add_exit(compiler, step.offset, true);
+                emit_sse_reg(buf, X86_XORPD, 0, 0);
+                emit_sse_reg(buf, X86_UCOMISD, divisor, 0);
+                emit_exit_jcc(compiler, CC_E, exit);
+            }
+            int b = pop_number(compiler);
+            int a = pop_number(compiler);
+            switch (ip[0]) {
+                case OP_ADD:
+                case OP_ADD_NUM: emit_sse_reg(buf, X86_ADDSD, a, b); break;
+                case OP_SUB:
+                case OP_SUB_NUM: emit_sse_reg(buf, X86_SUBSD, a, b); break;
+                case OP_MUL:
+                case OP_MUL_NUM: emit_sse_reg(buf, X86_MULSD, a, b); break;
+                case OP_DIV: emit_sse_reg(buf, X86_DIVSD, a, b); break;
+                default: emit_modulo(compiler, a, b); break;
+            }
+            push_entry(compiler, ENTRY_NUMBER);
+            break;
+        }
+        case OP_NEGATE: {
+            int reg = pop_number(compiler);
+            emit_mov_imm64(buf, RAX, 0x8000000000000000); // the sign bit
+            emit_movq_xmm(buf, 0, RAX);
+            emit_sse_reg(buf, X86_XORPD, reg, 0);
+            push_entry(compiler, ENTRY_NUMBER);
+            break;
+        }
+        case OP_LESS_THAN:
+        case OP_LESS_THAN_NUM:
+        case OP_GREATER_THAN:
+        case OP_GREATER_THAN_NUM:
+        case OP_COMPARE: {
+            pop_number(compiler);
+            pop_number(compiler);
+            push_entry(compiler, ENTRY_CONDITION);
+            StackEntry* condition = &compiler->stack[compiler->depth - 1];
+            condition->op = ip[0] == OP_LESS_THAN_NUM ? OP_LESS_THAN :
+                            ip[0] == OP_GREATER_THAN_NUM ? OP_GREATER_THAN : ip[0];
+            break;
+        }
+        case OP_NOT: {
+            if (compiler->depth == 0 || compiler->stack[compiler->depth - 1].kind != ENTRY_CONDITION) {
+                compiler->failed = true;
+                break;
+            }
+            compiler->stack[compiler->depth - 1].negated = !compiler->stack[compiler->depth - 1].negated;
+            break;
+        }
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER: {
+            // the exit resumes on the path the recording did not take
+            int resume = step.branched ? step.offset + instruction_length(chunk, step.offset) : jump_target(chunk, step.offset);
+            StackEntry condition = {ENTRY_CONDITION, ip[0] == OP_JUMP_IF_NOT_LESS ? OP_LESS_THAN : OP_GREATER_THAN, false};
+            int reg;
+            if (ip[0] == OP_POP_JUMP_IF_FALSE) {
+                condition = *pop_entry(compiler, ENTRY_CONDITION, &reg);
+            } else {
+                pop_number(compiler);
+                reg = pop_number(compiler);
+            }
+            emit_condition_guard(compiler, condition, reg, !step.branched, add_exit(compiler, resume, true));
+            break;
+        }
+        case OP_POP_TOP: {
+            if (compiler->depth == 0) {
+                compiler->failed = true;
+                break;
+            }
+            compiler->depth--;
+            break;
+        }
+        case OP_JUMP:
+            break;
+        case OP_JUMP_BACKWARD:
+            add_patch(buf, emit_jump(buf), TARGET_LOOP);
+            break;
+        case OP_FOR_ITER: {
+            if (compiler->depth != 0) { // the iterator has to be the top of the vm stack
+                compiler->failed = true;
+                break;
+            }
+            emit_for_iter(compiler, step.offset, push_entry(compiler, ENTRY_NUMBER));
+            break;
+        }
+        default:
+            compiler->failed = true;
+            break;
+    }
+}
+
+static void emit_trace_exit(TraceCompiler* compiler, TraceExit exit) {
+    CodeBuffer* buf = &compiler->buf;
+    for (int i = 0; exit.loaded && i < compiler->variableCount; i++) {
+        TraceVariable* variable = &compiler->variables[i];
+        if (variable->written) {
+            int base;
+            int32_t disp;
+            variable_slot(variable, &base, &disp);
+            emit_store_number(buf, base, disp, FIRST_REGISTER + i);
+        }
+    }
+    for (int i = 0; i < exit.depth; i++) {
+        emit_store_number(buf, RBX, i * VALUE_SIZE, compiler->stackBase + i);
+    }
+    emit_mem(buf, 0, true, X86_LEA, RAX, RBX, exit.depth * VALUE_SIZE);
+    emit_store(buf, R13, offsetof(VM, sp), RAX);
+    emit_mov_imm64(buf, RAX, (uint64_t) (uintptr_t) (compiler->chunk->codes + exit.resume));
+    emit_store(buf, R14, offsetof(StackFrame, ip), RAX);
+    emit_byte(buf, 0x31); // xor eax, eax
+    emit_byte(buf, 0xc0);
+    add_patch(buf, emit_jump(buf), TARGET_EPILOGUE);
+}
+
+static bool compile_trace(VM* vm, StackFrame* frame, Trace* trace, TraceStep* steps, int count) {
+    TraceCompiler compiler;
+    init_code_buffer(&compiler.buf);
+    compiler.chunk = &frame->function->body;
+    compiler.scriptIsLocal = frame->slots == vm->stack;
+    compiler.failed = false;
+    compiler.variableCount = 0;
+    compiler.depth = 0;
+    compiler.exits = NULL;
+    compiler.exitCount = 0;
+    compiler.exitCapacity = 0;
+
+    // the variables take the registers from FIRST_REGISTER, the stack gets the ones after them
+    for (int i = 0; i < count; i++) {
+        uint8_t* ip = compiler.chunk->codes + steps[i].offset;
+        switch (ip[0]) {
+            case OP_LOAD_LOCAL: variable_register(&compiler, false, ip[1]); break;
+            case OP_LOAD_SCRIPT: variable_register(&compiler, true, ip[1]); break;
+            case OP_STORE_FAST:
+            case OP_ASSIGN_LOCAL:
+            case OP_INCREMENT_LOCAL:
+                compiler.variables[variable_register(&compiler, false, ip[1]) - FIRST_REGISTER].written = true;
+                break;
+            case OP_ASSIGN_SCRIPT:
+                compiler.variables[variable_register(&compiler, true, ip[1]) - FIRST_REGISTER].written = true;
+                break;
+            default: break;
+        }
+    }
+    compiler.stackBase = FIRST_REGISTER + compiler.variableCount;
+
+    // every variable is loaded on entry, even one the trace writes before reading it,
+    // since an exit before the write stores it back
+    CodeBuffer* buf = &compiler.buf;
+    emit_prologue(buf, SPILL_BYTES);
+    int entry_exit = add_exit(&compiler, (int) (frame->ip - compiler.chunk->codes), false);
+    for (int i = 0; i < compiler.variableCount; i++) {
+        int base;
+        int32_t disp;
+        variable_slot(&compiler.variables[i], &base, &disp);
+        add_patch(buf, emit_number_guard(buf, base, disp), entry_exit);
+    }
+    for (int i = 0; i < compiler.variableCount; i++) {
+        int base;
+        int32_t disp;
+        variable_slot(&compiler.variables[i], &base, &disp);
+        emit_sse(buf, X86_MOVSD_LOAD, FIRST_REGISTER + i, base, disp + NUMBER_OFFSET);
+    }
+
+    int loop_start = buf->count;
+    for (int i = 0; i < count && !compiler.failed; i++) {
+        compile_step(&compiler, steps[i]);
+    }
+
+    int* exit_offsets = (int*) malloc(sizeof(int) * compiler.exitCount);
+    for (int i = 0; i < compiler.exitCount; i++) {
+        exit_offsets[i] = buf->count;
+        emit_trace_exit(&compiler, compiler.exits[i]);
+    }
+    int epilogue = buf->count;
+    emit_epilogue(buf, SPILL_BYTES);
+
+    for (int i = 0; i < buf->patchCount; i++) {
+        CodePatch patch = buf->patches[i];
+        int target = patch.target == TARGET_LOOP ? loop_start :
+                     patch.target == TARGET_EPILOGUE ? epilogue : exit_offsets[patch.target];
+        patch_rel32(buf, patch.at, target);
+    }
+    free(exit_offsets);
+    free(compiler.exits);
+
+    if (!compiler.failed) {
+        trace->code = map_code(buf, &trace->size);
+    }
+    free_code_buffer(buf);
+    return trace->code != NULL;
+}
+// <------------------------------------>
+
+static Trace* find_trace(FunctionObj* function, int header) {
+    for (Trace* trace = function->traces; trace != NULL; trace = trace->next) {
+        if (trace->header == header) {
+            return trace;
+        }
+    }
+    Trace* trace = (Trace*) malloc(sizeof(Trace));
+    trace->header = header;
+    trace->hotness = 0;
+    trace->code = NULL;
+    trace->size = 0;
+    trace->next = function->traces;
+    function->traces = trace;
+    return trace;
+}
+
+InterpretResult trace_loop(VM* vm, StackFrame* frame, uint8_t* back_edge) {
+    Chunk* chunk = &frame->function->body;
+    Trace* trace = find_trace(frame->function, (int) (frame->ip - chunk->codes));
+    if (trace->code == NULL) {
+        if (trace->hotness == TRACE_BLACKLISTED || ++trace->hotness < TRACE_THRESHOLD) {
+            return RESULT_SUCCESS;
+        }
+        TraceStep steps[TRACE_MAX_LENGTH];
+        int count;
+        RecordResult recorded = record_trace(vm, frame, (int) (back_edge - chunk->codes), steps, &count);
+        if (recorded == RECORD_FAILED) {
+            return RESULT_ERROR;
+        }
+        if (recorded == RECORD_ABORTED || !compile_trace(vm, frame, trace, steps, count)) {
+            trace->hotness = TRACE_BLACKLISTED;
+            vm->tracesAborted++;
+            return RESULT_SUCCESS;
+        }
+        vm->tracesCompiled++;
+    }
+    TraceEntry entry = (TraceEntry) (void*) trace->code;
+    return entry(vm, frame);
+}
+
+void free_traces(FunctionObj* function) {
+    Trace* trace = function->traces;
+    while (trace != NULL) {
+        Trace* next = trace->next;
+        if (trace->code != NULL) {
+            unmap_code(trace->code, trace->size);
+        }
+        free(trace);
+        trace = next;
+    }
+    function->traces = NULL;
+}
+
+#else
+
+InterpretResult trace_loop(VM* vm, StackFrame* frame, uint8_t* back_edge) {
+    return RESULT_SUCCESS; // loops stay on the interpreter
+}
+
+void free_traces(FunctionObj* function) {
+}
+
+#endif
@@ -0,0 +1,29 @@
+#pragma once
+#ifndef SHIP_TRACE_H_
+#define SHIP_TRACE_H_
+
+#include "jit.h"
+
+// the tracing jit records the path one iteration of a hot loop takes, and compiles it to x86-64 machine code
+// that keeps the loop's numbers unboxed in registers, see trace.c. built where the baseline jit is.
+
+#define TRACE_THRESHOLD 100 // back edges to a loop header before its loop is recorded
+#define TRACE_MAX_LENGTH 256 // instructions in one recorded iteration
+#define TRACE_BLACKLISTED (-1) // hotness of a loop that could not be traced
+
+// a loop of a function, found by the offset of its header: the target of its back edge
+typedef struct Trace {
+    int header;
+    int hotness; // back edges taken so far, or TRACE_BLACKLISTED
+    uint8_t* code; // executable memory, NULL until the loop was recorded and compiled
+    size_t size;
+    struct Trace* next;
+} Trace;
+
+// called by run() once it took the back edge at back_edge, with frame->ip at the loop header.
+// runs the loop's trace if it has one, otherwise counts the iteration and records the loop once it is hot.
+// frame->ip and vm->sp are where run() continues when it returns.
+InterpretResult trace_loop(VM* vm, StackFrame* frame, uint8_t* back_edge);
+void free_traces(FunctionObj* function);
+
+#endif // !SHIP_TRACE_H_
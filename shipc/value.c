@@ -14,7 +14,7 @@ bool is_truthy(Value val) {
 		return AS_BOOL(val);
 	}
     if (IS_STRING(val)) {
-        return AS_STRING(val)->length != 0;
+        return string_length(AS_OBJ(val)) != 0;
     }
     if (IS_ARRAY(val)) {
         return AS_ARRAY(val)->values->count > 0;
@@ -64,16 +64,20 @@ void free_value_array_with_values(ValueArray* arr) {
 
 static void print_object(Value obj_val) {
 	switch (AS_OBJ(obj_val)->type) {
+	case OBJ_ROPE:
 	case OBJ_STRING: {
         StringObj* str_obj = AS_STRING(obj_val);
-        for (int i = 0; i < str_obj->length -1; i++) {
+        // a \n prints as a line break. strings are shared, so the translation goes to stdout, not into the string
+        int start = 0;
+        for (int i = 0; i < str_obj->length - 1; i++) {
             if (str_obj->value[i] == '\\' && str_obj->value[i + 1] == 'n') {
-                str_obj->value[i] = '\r';
-                str_obj->value[i + 1] = '\n';
+                fwrite(str_obj->value + start, 1, i - start, stdout);
+                fputs("\r\n", stdout);
+                start = i + 2;
+                i++;
             }
-
         }
-        fputs(str_obj->value, stdout);
+        fwrite(str_obj->value + start, 1, str_obj->length - start, stdout);
         break;
     }
         case OBJ_FUNCTION: {
@@ -81,6 +85,11 @@ static void print_object(Value obj_val) {
             printf("<function %.*s at %p>", func->name->length, func->name->value, func);
             break;
         }
+        case OBJ_CLOSURE: {
+            FunctionObj *func = AS_CLOSURE(obj_val)->function;
+            printf("<function %.*s at %p>", func->name->length, func->name->value, func);
+            break;
+        }
         case OBJ_NATIVE: {
             printf("<native_function at %p>", AS_NATIVE(obj_val)->function);
             break;
@@ -110,7 +119,7 @@ static void print_object(Value obj_val) {
 }
 
 void print_value(Value val) {
-	switch (val.type) {
+	switch (VALUE_TYPE(val)) {
 	case VAL_BOOL: printf("%s", AS_BOOL(val) ? "true" : "false"); break;
 	case VAL_NIL: printf("nil"); break;
 	case VAL_NUMBER:  {
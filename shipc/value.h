@@ -4,6 +4,8 @@
 
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 
 typedef enum {
 	VAL_NIL,
@@ -21,15 +23,34 @@ typedef enum {
     OBJ_ARRAY,
     OBJ_CLASS,
     OBJ_NATIVE_METHOD,
+    OBJ_CLOSURE,
+    OBJ_UPVALUE,
+    OBJ_ROPE,
 } ObjType;
 
+// the generation of an object, see memory.c
+typedef enum {
+    GEN_UNTRACKED, // new objects until add_garbage
+    GEN_YOUNG, // in the nursery
+    GEN_OLD, // survived a collection
+    GEN_PERMANENT, // never collected, so they can be shared by reference: constants and the single byte strings
+} Generation;
+
 typedef struct {
 	ObjType type;
     bool isMarked;
+    uint8_t generation; // a Generation
+    bool isRemembered; // an old object in vm->remembered
     struct Obj* next;
 } Obj;
 
 
+#ifdef SHIP_NAN_BOXING
+// A value is packed into the 8 bytes of a double.
+// numbers are stored as is, everything else lives inside the unused bits of a quiet NaN:
+// objects set the sign bit and keep their pointer in the low 48 bits, nil/false/true use small tags.
+typedef uint64_t Value;
+#else
 typedef struct {
 	ValueType type;
 	union {
@@ -38,7 +59,9 @@ typedef struct {
 		Obj* obj;
 	} as;
 } Value;
+#endif
 
+typedef Value (*NativeFn) (int arg_count, Value* args);
 
 typedef struct {
 	int count;
@@ -54,19 +77,63 @@ void print_value(Value val);
 bool is_truthy(Value val);
 
 
+#ifdef SHIP_NAN_BOXING
+
+#define SIGN_BIT ((uint64_t) 0x8000000000000000)
+#define QNAN ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+#define NIL_VAL ((Value) (QNAN | TAG_NIL))
+#define FALSE_VAL ((Value) (QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value) (QNAN | TAG_TRUE))
+
+static inline double value_to_num(Value value) {
+	double num;
+	memcpy(&num, &value, sizeof(Value));
+	return num;
+}
+
+static inline Value num_to_value(double num) {
+	Value value;
+	memcpy(&value, &num, sizeof(double));
+	return value;
+}
+
+// fetch from a boxed value
+#define AS_NUMBER(value) value_to_num(value)
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_OBJ(value) ((Obj*) (uintptr_t) ((value) & ~(SIGN_BIT | QNAN)))
+
+// create a boxed value
+#define VAR_NUMBER(value) num_to_value(value)
+#define VAR_BOOL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define VAR_NIL NIL_VAL
+#define VAR_OBJ(object) ((Value) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (object)))
+
+// type testing
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+static inline ValueType value_type(Value value) {
+	if (IS_NUMBER(value)) return VAL_NUMBER;
+	if (IS_OBJ(value)) return VAL_OBJ;
+	if (IS_NIL(value)) return VAL_NIL;
+	return VAL_BOOL;
+}
+#define VALUE_TYPE(value) value_type(value)
+
+#else
+
 // fetch from a tagged union
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_OBJ(value) ((value).as.obj)
 
-
-#define AS_STRING(obj) ((StringObj*) AS_OBJ(obj))
-#define AS_FUNCTION(obj) ((FunctionObj*) AS_OBJ(obj))
-#define AS_ITERABLE(obj) ((IterableObj*) AS_OBJ(obj))
-#define AS_ARRAY(obj) ((ArrayObj*) AS_OBJ(obj))
-#define AS_NATIVE(obj) ((NativeFuncObj*) AS_OBJ(obj))
-#define AS_ERROR(obj) ((ErrorObj*) AS_OBJ(obj))
-
 // create a tagged union
 #define VAR_NUMBER(value) ((Value) {VAL_NUMBER, { .number = value}})
 #define VAR_BOOL(value) ((Value) { VAL_BOOL, { .boolean = value }})
@@ -80,11 +147,30 @@ bool is_truthy(Value val);
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
+#define VALUE_TYPE(value) ((value).type)
+
+#endif
+
+#define AS_STRING(obj) (as_string(AS_OBJ(obj))) // flattens a rope, see objects.h
+#define AS_ROPE(obj) ((RopeObj*) AS_OBJ(obj))
+#define AS_FUNCTION(obj) ((FunctionObj*) AS_OBJ(obj))
+#define AS_ITERABLE(obj) ((IterableObj*) AS_OBJ(obj))
+#define AS_ARRAY(obj) ((ArrayObj*) AS_OBJ(obj))
+#define AS_NATIVE(obj) ((NativeFuncObj*) AS_OBJ(obj))
+#define AS_ERROR(obj) ((ErrorObj*) AS_OBJ(obj))
+#define AS_CLOSURE(obj) ((ClosureObj*) AS_OBJ(obj))
+
 static inline bool test_obj_types(Value value, ObjType type) {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
-#define IS_STRING(value) (test_obj_types(value, OBJ_STRING))
+static inline bool is_string(Value value) {
+    // a rope is a string whose characters were not copied together yet
+    return IS_OBJ(value) && (AS_OBJ(value)->type == OBJ_STRING || AS_OBJ(value)->type == OBJ_ROPE);
+}
+
+#define IS_STRING(value) (is_string(value))
+#define IS_ROPE(value) (test_obj_types(value, OBJ_ROPE))
 #define IS_FUNCTION(value) (test_obj_types(value, OBJ_FUNCTION))
 #define IS_NATIVE(value) (test_obj_types(value, OBJ_NATIVE))
 #define IS_NATIVE_METHOD(value) (test_obj_types(value, OBJ_NATIVE_METHOD))
@@ -92,6 +178,7 @@ static inline bool test_obj_types(Value value, ObjType type) {
 #define IS_ARRAY(value) (test_obj_types(value, OBJ_ARRAY))
 #define IS_CLASS(value) (test_obj_types(value, OBJ_CLASS))
 #define IS_ERROR(value) (test_obj_types(value, OBJ_ERROR))
+#define IS_CLOSURE(value) (test_obj_types(value, OBJ_CLOSURE))
 
 #endif // !SHIP_VALUE_H_
 
@@ -10,14 +10,15 @@
 #include "memory.h"
 #include "objects.h"
 #include "builtins.h"
+#include "jit.h"
+#include "trace.h"
+#include "aot.h"
 
 static InterpretResult run (VM* vm);
 
-static void push(VM* vm, Value value) {
-	if ((size_t)(vm->sp - vm->stack) == STACK_MAX) {
-		printf("Stack overflow");
-		exit(1);
-	}
+// the stack accessors don't check bounds. every frame checks once on entry that its locals and its
+// deepest operand stack fit on the stack (see reserve_frame), the compiler guarantees it never goes deeper
+static inline void push(VM* vm, Value value) {
 	*vm->sp = value;
 	vm->sp++;
 }
@@ -36,29 +37,107 @@ static void push_frame(VM* vm, StackFrame frame) {
     vm->frameCount++;
 }
 
-static Value pop(VM* vm) {
-	if (vm->stack == vm->sp) {
-		printf("Empty stack");
-		exit(1);
-	}
+static void reserve_frame(VM* vm, Value* slots, FunctionObj* function) {
+    // the only stack bounds check of a frame. one slot is kept free above it for a runtime error object.
+    // surplus arguments of a call stay on the stack, so the operand stack starts above them
+    Value* locals_end = slots + function->localCount;
+    Value* operands = vm->sp > locals_end ? vm->sp : locals_end;
+    if (operands + (function->maxStackSize - function->localCount) >= vm->stack + STACK_MAX) {
+        printf("Stack overflow");
+        exit(1);
+    }
+    // arguments already sit at the bottom of the window, the rest of the locals start as nil
+    while (vm->sp < locals_end) {
+        *vm->sp = VAR_NIL;
+        vm->sp++;
+    }
+}
+
+static bool values_equal(Value a, Value b) {
+    if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
+        return false;
+    }
+    switch (VALUE_TYPE(a)) {
+        case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NIL: return true;
+        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_OBJ: return compare_objects(AS_OBJ(a), AS_OBJ(b));
+    }
+    return false;
+}
+
+static ValueNode* resolve_global(VM* vm, Chunk* chunk, uint8_t name_index) {
+    // the cache holds the node a site resolved to, a hit costs a version check and a load. NULL if not defined
+    GlobalCache* cache = &chunk->siteCaches[name_index].global;
+    if (cache->version != vm->globals.version) {
+        StringObj* var_str = AS_STRING(chunk->constants.arr[name_index]);
+        ValueNode* glob = get_global(&vm->globals, var_str);
+        if (glob == NULL) {
+            return NULL;
+        }
+        cache->node = glob;
+        cache->version = vm->globals.version;
+    }
+    return cache->node;
+}
+
+static UpvalueObj* capture_upvalue(VM* vm, Value* local) {
+    // open upvalues are sorted by stack slot, top of the stack first. reuse one if the slot is already captured,
+    // so every closure that captured the variable sees the same value.
+    UpvalueObj* prev = NULL;
+    UpvalueObj* upvalue = vm->openUpvalues;
+    while (upvalue != NULL && upvalue->location > local) {
+        prev = upvalue;
+        upvalue = upvalue->nextOpen;
+    }
+    if (upvalue != NULL && upvalue->location == local) {
+        return upvalue;
+    }
+
+    UpvalueObj* created = create_upvalue_obj(local);
+    add_garbage(vm, VAR_OBJ(created));
+    created->nextOpen = upvalue;
+    if (prev == NULL) {
+        vm->openUpvalues = created;
+    } else {
+        prev->nextOpen = created;
+    }
+    return created;
+}
+
+static void close_upvalues(VM* vm, Value* last) {
+    // move every captured variable at or above last off the stack, before its frame goes away
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        UpvalueObj* upvalue = vm->openUpvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        write_barrier(vm, (Obj*) upvalue, upvalue->closed);
+        vm->openUpvalues = upvalue->nextOpen;
+    }
+}
+
+static inline Value pop(VM* vm) {
 	vm->sp--;
 	return *vm->sp;
 }
 
-static Value peek_behind(VM* vm, int behind) {
-    if (vm->stack >  vm->sp - behind) {
-        printf("Empty stack");
-        exit(1);
-    }
+static inline Value peek_behind(VM* vm, int behind) {
     return *(vm->sp - behind);
 }
 
 static void throw_error(VM* vm, ErrorObj* err) {
     StackFrame errored_chunk = vm->callStack[vm->frameCount - 1];
-    int code_offset = (errored_chunk.ip - errored_chunk.function->body.codes);
+    // the saved ip is past the failing instruction, its last byte still carries the instruction's line
+    int line;
+    if (errored_chunk.pc != NULL) {
+        line = errored_chunk.function->registers.lines[errored_chunk.pc - errored_chunk.function->registers.codes - 1];
+    } else {
+        int code_offset = (errored_chunk.ip - errored_chunk.function->body.codes) - 1;
+        line = errored_chunk.function->body.lines[code_offset];
+    }
 
     fprintf(stderr, "runtime error: %.*s\n  [main.ship:%i]\n",
-            err->value->length, err->value->value, errored_chunk.function->body.lines[code_offset]);
+            err->value->length, err->value->value, line);
     free_vm(vm);
     exit(1);
 }
@@ -87,11 +166,17 @@ void init_vm(VM* vm) {
     vm->frameCount = 0;
 	// set the sp to the beginning of the stack
 	vm->sp = vm->stack;
+    vm->openUpvalues = NULL;
+    vm->quickenedSites = 0;
+    vm->deoptimizedSites = 0;
+    vm->jitEnabled = false;
+    vm->jitCompiled = 0;
+    vm->traceEnabled = false;
+    vm->tracesCompiled = 0;
+    vm->tracesAborted = 0;
 
     // create the objects arrays
-    vm->objects = NULL;
-    vm->heapObjects = 0;
-    vm->heapCapacity = 8;
+    init_gc(vm);
 
     ValueTable globals;
     create_value_map(&globals);
@@ -104,18 +189,16 @@ void init_vm(VM* vm) {
 
 void free_vm(VM* vm) {
     // Free all the gc objects
-    Obj* pos = (Obj *) vm->objects;
-    while (pos != NULL) {
-        Obj* next = (Obj *) pos->next;
-        free_object(pos);
-        pos = next;
-    }
+    free_objects(vm);
 
     // Free the last stackframe
     free_stack_frame(vm->callStack[0]);
 
     // Free the globals
     free_globals(&vm->globals);
+
+    // the names of every chunk are freed by now
+    free_shared_strings();
 }
 
 InterpretResult interpret(VM* vm, FunctionObj* main_script) {
@@ -123,9 +206,25 @@ InterpretResult interpret(VM* vm, FunctionObj* main_script) {
     StackFrame main_frame;
     main_frame.ip = main_script->body.codes;
     main_frame.function = main_script;
+    main_frame.closure = NULL;
+    main_frame.slots = vm->stack;
+    main_frame.pc = NULL;
+    main_frame.top = NULL;
     push_frame(vm, main_frame);
+    reserve_frame(vm, main_frame.slots, main_script);
 
     InterpretResult end_value = run(vm);
+#ifdef SHIP_DEBUG
+    printf("Quickening: %i sites specialized, %i deoptimized\n", vm->quickenedSites, vm->deoptimizedSites);
+    printf("GC: %i minor, %i major collections, %zu heap bytes\n", vm->minorCollections, vm->majorCollections,
+           vm->heapBytes);
+    if (vm->jitEnabled) {
+        printf("JIT: %i functions compiled\n", vm->jitCompiled);
+    }
+    if (vm->traceEnabled) {
+        printf("Traces: %i compiled, %i aborted\n", vm->tracesCompiled, vm->tracesAborted);
+    }
+#endif
     if(end_value == RESULT_ERROR) {
         Value error_value = pop(vm);
         ErrorObj* err_obj = (ErrorObj*) AS_OBJ(error_value);
@@ -135,227 +234,403 @@ InterpretResult interpret(VM* vm, FunctionObj* main_script) {
     return RESULT_SUCCESS;
 }
 
+// counts a call or loop iteration of the function, and compiles it once it is hot. true if it has native code
+static inline bool tier_up(FunctionObj* function, VM* vm) {
+    if (function->jit != NULL) {
+        return true;
+    }
+    if (++function->hotness < JIT_THRESHOLD) {
+        return false;
+    }
+    function->hotness = 0;
+    if (!jit_compile(function, vm->traceEnabled)) {
+        return false;
+    }
+    vm->jitCompiled++;
+    return true;
+}
+
 static InterpretResult run(VM* vm) {
     StackFrame* frame = &vm->callStack[vm->frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
+    // the instruction pointer lives in a local so it can stay in a register,
+    // it is written back to the frame before switching frames or raising an error.
+    uint8_t* ip = frame->ip;
+#define READ_BYTE() (*ip++)
 #define READ_CONSTANT() frame->function->body.constants.arr[READ_BYTE()]
-#define THROW_IF_ERROR(value) if (IS_ERROR(value)) throw_error(vm, AS_ERROR(value))
+#define SAVE_IP() (frame->ip = ip)
+#define THROW_IF_ERROR(value) if (IS_ERROR(value)) { SAVE_IP(); throw_error(vm, AS_ERROR(value)); }
+#define RUNTIME_ERROR(...) (SAVE_IP(), runtime_error(vm, __VA_ARGS__))
+// hands the current frame to its native code, which comes back at a call, return or halt for run() to do
+#define ENTER_JIT() { \
+        SAVE_IP(); \
+        if (jit_enter(vm, frame) == RESULT_ERROR) return RESULT_ERROR; \
+        ip = frame->ip; \
+    }
+// same for a function translated to C by shipc --emit-c
+#define ENTER_AOT() { \
+        SAVE_IP(); \
+        if (((AotFunction) frame->function->aot)(vm, frame) == RESULT_ERROR) return RESULT_ERROR; \
+        ip = frame->ip; \
+    }
 #define READ_SHORT() \
-	(frame->ip += 2, (uint16_t) ((frame->ip[-2] << 8) | frame->ip[-1]))
+	(ip += 2, (uint16_t) ((ip[-2] << 8) | ip[-1]))
+// quickening: a generic op that ran on numbers rewrites itself to its number only version,
+// which goes back to the generic op (and runs it) the first time it sees anything else.
+#define QUICKEN(op) (ip[-1] = (op), vm->quickenedSites++)
+#define DEOPTIMIZE(op) { ip[-1] = (op); ip--; vm->quickenedSites--; vm->deoptimizedSites++; DISPATCH(); }
+#define NUMBER_BINARY_OP(generic_op, result_macro, operator) { \
+        Value b = vm->sp[-1]; \
+        Value a = vm->sp[-2]; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) DEOPTIMIZE(generic_op); \
+        vm->sp--; \
+        vm->sp[-1] = result_macro(AS_NUMBER(a) operator AS_NUMBER(b)); \
+        DISPATCH(); \
+    }
+
+#ifdef SHIP_COMPUTED_GOTO
+    // threaded dispatch: every handler jumps straight to the next handler through this table,
+    // instead of going back to the top of the loop and through the switch bounds check.
+    // every entry starts as label_unknown and the opcodes override it, which is what -Woverride-init warns about
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void* dispatch_table[UINT8_MAX + 1] = {
+        [0 ... UINT8_MAX] = &&label_unknown,
+        [OP_CONSTANT] = &&label_OP_CONSTANT,
+        [OP_MUL] = &&label_OP_MUL,
+        [OP_POP_TOP] = &&label_OP_POP_TOP,
+        [OP_FALSE] = &&label_OP_FALSE,
+        [OP_TRUE] = &&label_OP_TRUE,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_NIL] = &&label_OP_NIL,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_MODULO] = &&label_OP_MODULO,
+        [OP_SUB] = &&label_OP_SUB,
+        [OP_STORE_FAST] = &&label_OP_STORE_FAST,
+        [OP_LOAD_LOCAL] = &&label_OP_LOAD_LOCAL,
+        [OP_LOAD_GLOBAL] = &&label_OP_LOAD_GLOBAL,
+        [OP_ASSIGN_GLOBAL] = &&label_OP_ASSIGN_GLOBAL,
+        [OP_ASSIGN_LOCAL] = &&label_OP_ASSIGN_LOCAL,
+        [OP_JUMP_BACKWARD] = &&label_OP_JUMP_BACKWARD,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_GET_ITER] = &&label_OP_GET_ITER,
+        [OP_FOR_ITER] = &&label_OP_FOR_ITER,
+        [OP_END_FOR] = &&label_OP_END_FOR,
+        [OP_BUILD_ARRAY] = &&label_OP_BUILD_ARRAY,
+        [OP_LOAD_ATTR] = &&label_OP_LOAD_ATTR,
+        [OP_DIV] = &&label_OP_DIV,
+        [OP_RETURN] = &&label_OP_RETURN,
+        [OP_SHOW_TOP] = &&label_OP_SHOW_TOP,
+        [OP_COMPARE] = &&label_OP_COMPARE,
+        [OP_GREATER_THAN] = &&label_OP_GREATER_THAN,
+        [OP_LESS_THAN] = &&label_OP_LESS_THAN,
+        [OP_NEGATE] = &&label_OP_NEGATE,
+        [OP_POP_JUMP_IF_FALSE] = &&label_OP_POP_JUMP_IF_FALSE,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_CLOSURE] = &&label_OP_CLOSURE,
+        [OP_LOAD_UPVALUE] = &&label_OP_LOAD_UPVALUE,
+        [OP_ASSIGN_UPVALUE] = &&label_OP_ASSIGN_UPVALUE,
+        [OP_LOAD_SCRIPT] = &&label_OP_LOAD_SCRIPT,
+        [OP_ASSIGN_SCRIPT] = &&label_OP_ASSIGN_SCRIPT,
+        [OP_INVOKE] = &&label_OP_INVOKE,
+        [OP_ADD_NUM] = &&label_OP_ADD_NUM,
+        [OP_SUB_NUM] = &&label_OP_SUB_NUM,
+        [OP_MUL_NUM] = &&label_OP_MUL_NUM,
+        [OP_LESS_THAN_NUM] = &&label_OP_LESS_THAN_NUM,
+        [OP_GREATER_THAN_NUM] = &&label_OP_GREATER_THAN_NUM,
+        [OP_JUMP_IF_NOT_LESS] = &&label_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_GREATER] = &&label_OP_JUMP_IF_NOT_GREATER,
+        [OP_INCREMENT_LOCAL] = &&label_OP_INCREMENT_LOCAL,
+        [OP_HALT] = &&label_OP_HALT,
+    };
+#pragma GCC diagnostic pop
+#define CASE(op) case op: label_##op
+#define DEFAULT default: label_unknown
+#define DISPATCH() goto *dispatch_table[READ_BYTE()]
+#else
+#define CASE(op) case op
+#define DEFAULT default
+#define DISPATCH() break
+#endif
 
+    if (frame->function->aot != NULL) {
+        ENTER_AOT();
+    }
 	for (;;) {
-		uint8_t opcode = READ_BYTE();
-		switch (opcode) {
-            case OP_RETURN: {
+		switch (READ_BYTE()) {
+            CASE(OP_RETURN): {
+                // drop the frame window along with the callee, and leave the return value in its place
+                Value return_value = pop(vm);
+                close_upvalues(vm, frame->slots);
+                vm->sp = frame->slots - 1;
+                push(vm, return_value);
                 vm->frameCount--;
                 // set the new frame
                 frame = &vm->callStack[vm->frameCount - 1];
-                break;
+                ip = frame->ip;
+                if (frame->function->aot != NULL) {
+                    ENTER_AOT();
+                } else if (vm->jitEnabled && frame->function->jit != NULL) {
+                    ENTER_JIT();
+                }
+                DISPATCH();
 
             }
-            case OP_HALT: {
+            CASE(OP_HALT): {
                 // free_stack_frame(frame);
                 return RESULT_SUCCESS;
             }
-			case OP_CONSTANT: {
+			CASE(OP_CONSTANT): {
                 Value constant = READ_CONSTANT();
 				push(vm, constant);
-				break;
+				DISPATCH();
 			}
-			case OP_NOT: {
+			CASE(OP_NOT): {
 				Value value = pop(vm);
 				if (!IS_BOOL(value)) {
-					return runtime_error(vm, "'not' operator cannot be called on non boolean object", ERR_TYPE);
+					return RUNTIME_ERROR("'not' operator cannot be called on non boolean object", ERR_TYPE);
 				}
 				push(vm, VAR_BOOL(!AS_BOOL(value)));
-				break;
+				DISPATCH();
 			}
-			case OP_NEGATE: {
+			CASE(OP_NEGATE): {
 				Value value = pop(vm);
 				if (!IS_NUMBER(value)) {
-                    return runtime_error(vm, "unary operator cannot be called on non number object", ERR_TYPE);
+                    return RUNTIME_ERROR("unary operator cannot be called on non number object", ERR_TYPE);
 				}
 				push(vm, VAR_NUMBER(-AS_NUMBER(value)));
-				break;
+				DISPATCH();
 			}
-            case OP_MODULO: {
+            CASE(OP_MODULO): {
                 Value b = pop(vm);
                 Value a = pop(vm);
                 if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
-                    return runtime_error(vm, "modulos operator accepts only number types", ERR_TYPE);
+                    return RUNTIME_ERROR("modulos operator accepts only number types", ERR_TYPE);
                 }
                 double mod = fmod(AS_NUMBER(a), AS_NUMBER(b));
                 push(vm, VAR_NUMBER(mod));
-                break;
+                DISPATCH();
             }
-			case OP_MUL: {
+			CASE(OP_MUL): {
 				Value a = pop(vm);
 				Value b = pop(vm);
 				if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
-					return runtime_error(vm, "* operator accepts only numbers", ERR_TYPE);
+					return RUNTIME_ERROR("* operator accepts only numbers", ERR_TYPE);
 
 				}
 				// simple multi by 2 optimiziation
 				double mul = AS_NUMBER(a) * AS_NUMBER(b);
+				QUICKEN(OP_MUL_NUM);
 				push(vm, VAR_NUMBER(mul));
-				break;
+				DISPATCH();
 			}
-            case OP_LESS_THAN: {
+            CASE(OP_LESS_THAN): {
                 Value b = pop(vm);
                 Value a = pop(vm);
                 if (IS_NUMBER(a) && IS_NUMBER(b)) {
                     bool test = AS_NUMBER(a) < AS_NUMBER(b);
+                    QUICKEN(OP_LESS_THAN_NUM);
                     push(vm, VAR_BOOL(test));
-                    break;
+                    DISPATCH();
                 }
-                return runtime_error(vm, "non supported operands for GREATER_THAN", ERR_TYPE);
+                return RUNTIME_ERROR("non supported operands for GREATER_THAN", ERR_TYPE);
             }
-            case OP_GREATER_THAN: {
+            CASE(OP_GREATER_THAN): {
                 Value b = pop(vm);
                 Value a = pop(vm);
                 if (IS_NUMBER(a) && IS_NUMBER(b)) {
                     bool test = AS_NUMBER(a) > AS_NUMBER(b);
+                    QUICKEN(OP_GREATER_THAN_NUM);
                     push(vm, VAR_BOOL(test));
-                    break;
+                    DISPATCH();
                 }
-                return runtime_error(vm, "non supported operands for GREATER_THAN", ERR_TYPE);
+                return RUNTIME_ERROR("non supported operands for GREATER_THAN", ERR_TYPE);
             }
-			case OP_ADD: {
+			CASE(OP_ADD): {
 				Value b = pop(vm);
 				Value a = pop(vm);
 				if (IS_NUMBER(a) && IS_NUMBER(b)) {
 					double mul = AS_NUMBER(a) + AS_NUMBER(b);
+					QUICKEN(OP_ADD_NUM);
 					push(vm, VAR_NUMBER(mul));
-					break;
+					DISPATCH();
 				}
                 // if one of the values is a string, then cast everything to a string and concat it.
 				if (IS_STRING(a) && IS_STRING(b)) {
-					StringObj* str_a = AS_STRING(a);
-					StringObj* str_b = AS_STRING(b);
-
-					StringObj* concat = concat_strings(str_a->value, str_a->length, str_b->value, str_b->length);
-                    add_garbage(vm, VAR_OBJ(concat));
-
-
-
-					push(vm, VAR_OBJ(concat));
-					break;
+					Value concat = VAR_OBJ(concat_strings(AS_OBJ(a), AS_OBJ(b)));
+                    add_garbage(vm, concat);
+					push(vm, concat);
+					DISPATCH();
 				}
-				return runtime_error(vm, "unknown operands for '+' operator. have you considered using .to_str()?", ERR_TYPE);
+				return RUNTIME_ERROR("unknown operands for '+' operator. have you considered using .to_str()?", ERR_TYPE);
 
 			}
-			case OP_DIV: {
+			CASE(OP_DIV): {
 				Value b = pop(vm);
 				Value a = pop(vm);
 				if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
-					return runtime_error(vm, "/ operator accepts only numbers", ERR_TYPE);
+					return RUNTIME_ERROR("/ operator accepts only numbers", ERR_TYPE);
 				}
                 if (AS_NUMBER(b) == 0) {
-                    return runtime_error(vm, "cannot divide by 0", ERR_SYNTAX);
+                    return RUNTIME_ERROR("cannot divide by 0", ERR_SYNTAX);
                 }
 				double mul = AS_NUMBER(a) / AS_NUMBER(b);
 				push(vm, VAR_NUMBER(mul));
-				break;
+				DISPATCH();
 			}
-			case OP_SUB: {
+			CASE(OP_SUB): {
 				Value b = pop(vm);
 				Value a = pop(vm);
 				if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
-					return runtime_error(vm, "/ operator accepts only numbers", ERR_TYPE);
+					return RUNTIME_ERROR("/ operator accepts only numbers", ERR_TYPE);
 				}
 				double mul = AS_NUMBER(a) - AS_NUMBER(b);
+				QUICKEN(OP_SUB_NUM);
 				push(vm, VAR_NUMBER(mul));
-				break;
+				DISPATCH();
 			}
-            case OP_SHOW_TOP: {
+			CASE(OP_ADD_NUM): NUMBER_BINARY_OP(OP_ADD, VAR_NUMBER, +)
+			CASE(OP_SUB_NUM): NUMBER_BINARY_OP(OP_SUB, VAR_NUMBER, -)
+			CASE(OP_MUL_NUM): NUMBER_BINARY_OP(OP_MUL, VAR_NUMBER, *)
+			CASE(OP_LESS_THAN_NUM): NUMBER_BINARY_OP(OP_LESS_THAN, VAR_BOOL, <)
+			CASE(OP_GREATER_THAN_NUM): NUMBER_BINARY_OP(OP_GREATER_THAN, VAR_BOOL, >)
+            CASE(OP_SHOW_TOP): {
                 Value print_val = pop(vm);
                 print_value(print_val);
                 printf("\n");
-                break;
+                DISPATCH();
             }
-			case OP_FALSE: {
+			CASE(OP_FALSE): {
 				push(vm, VAR_BOOL(false));
-				break;
+				DISPATCH();
 			}
-			case OP_TRUE: {
+			CASE(OP_TRUE): {
 				push(vm, VAR_BOOL(true));
-				break;
+				DISPATCH();
 			}
-			case OP_NIL: {
+			CASE(OP_NIL): {
 				push(vm, VAR_NIL);
-				break;
+				DISPATCH();
 			}
-			case OP_POP_TOP: {
+			CASE(OP_POP_TOP): {
 				pop(vm);
-				break;
+				DISPATCH();
 			}
-			case OP_COMPARE: {
+			CASE(OP_COMPARE): {
 				Value b = pop(vm);
 				Value a = pop(vm);
-				if (a.type != b.type) {
-					push(vm, VAR_BOOL(false));
-					break;
-				}
-				bool equal = false;
-				switch (a.type) {
-				case VAL_BOOL: equal = AS_BOOL(a) == AS_BOOL(b); break;
-				case VAL_NIL: equal = true; break;
-				case VAL_NUMBER: equal = AS_NUMBER(a) == AS_NUMBER(b); break;
-				case VAL_OBJ: equal = compare_objects(AS_OBJ(a), AS_OBJ(b));
-				}
-				push(vm, VAR_BOOL(equal));
-				break;
+				push(vm, VAR_BOOL(values_equal(a, b)));
+				DISPATCH();
 			}
-			case OP_POP_JUMP_IF_FALSE: {
+            CASE(OP_JUMP_IF_NOT_LESS): {
+                Value b = pop(vm);
+                Value a = pop(vm);
+                uint16_t jmp_size = READ_SHORT();
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    return RUNTIME_ERROR("non supported operands for LESS_THAN", ERR_TYPE);
+                }
+                if (!(AS_NUMBER(a) < AS_NUMBER(b))) {
+                    ip += (int) jmp_size;
+                }
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_NOT_GREATER): {
+                Value b = pop(vm);
+                Value a = pop(vm);
+                uint16_t jmp_size = READ_SHORT();
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    return RUNTIME_ERROR("non supported operands for GREATER_THAN", ERR_TYPE);
+                }
+                if (!(AS_NUMBER(a) > AS_NUMBER(b))) {
+                    ip += (int) jmp_size;
+                }
+                DISPATCH();
+            }
+			CASE(OP_POP_JUMP_IF_FALSE): {
 				Value cond = pop(vm);
 				// if condition is truthy, then don't jump
 				if (is_truthy(cond)) {
 					(void) READ_SHORT(); // the byte after the op is the jmp size, so avoid reading it
-					break;
+					DISPATCH();
 				}
 				// if condition is false, jump
 				uint16_t jmp_size = READ_SHORT();
-				frame->ip += (int) jmp_size;
-				break;
+				ip += (int) jmp_size;
+				DISPATCH();
 
 			}
-            case OP_JUMP: {
+            CASE(OP_JUMP): {
                 uint16_t jmp_size = READ_SHORT();
-                frame->ip += (int) jmp_size;
-                break;
+                ip += (int) jmp_size;
+                DISPATCH();
 
             }
-            case OP_JUMP_BACKWARD: {
+            CASE(OP_JUMP_BACKWARD): {
                 uint16_t jmp_size = READ_SHORT();
-                frame->ip -= (int) jmp_size;
-                break;
+                ip -= (int) jmp_size;
+                if (vm->traceEnabled) {
+                    SAVE_IP();
+                    if (trace_loop(vm, frame, ip + jmp_size - 3) == RESULT_ERROR) {
+                        return RESULT_ERROR;
+                    }
+                    ip = frame->ip;
+                }
+                if (vm->jitEnabled && tier_up(frame->function, vm)) {
+                    ENTER_JIT();
+                }
+                DISPATCH();
             }
-			case OP_STORE_FAST: {
+			CASE(OP_STORE_FAST): {
 				Value var_value = pop(vm);
 				uint8_t variable_index = READ_BYTE();
-                frame->function->locals[variable_index].value = var_value;
-				break;
+                frame->slots[variable_index] = var_value;
+				DISPATCH();
 			}
-            case OP_LOAD_ATTR: {
-                Value attr_name = READ_CONSTANT();
+            CASE(OP_LOAD_ATTR): {
+                uint8_t name_index = READ_BYTE();
+                Value attr_name = frame->function->body.constants.arr[name_index];
                 Value attr_host = peek_behind(vm, 1);
 
                 if (!IS_STRING(attr_name)) {
-                    return runtime_error(vm, "Attribute name is expected to be a string", ERR_TYPE);
+                    return RUNTIME_ERROR("Attribute name is expected to be a string", ERR_TYPE);
                 }
                 if (IS_CLASS(attr_host)) {
                     // Classes are not implemented in ship yet..
-                    break;
+                    DISPATCH();
                 }
-                Value attr_res = get_builtin_attr(attr_host, AS_STRING(attr_name));
-                if (IS_ERROR(attr_res)) {
-                    throw_error(vm, (ErrorObj*) AS_OBJ(attr_res));
+                NativeFn method = get_cached_builtin_method(&frame->function->body.siteCaches[name_index].attr,
+                                                            attr_host, AS_STRING(attr_name));
+                if (method == NULL) {
+                    Value err = builtin_attr_error(attr_host);
+                    THROW_IF_ERROR(err);
                 }
+                // the method takes the place of its host, which stays reachable through it
+                Value attr_res = VAR_OBJ(create_native_method_obj(method, attr_host));
                 add_garbage(vm, attr_res);
-                push(vm, attr_res);
-                break;
+                vm->sp[-1] = attr_res;
+                DISPATCH();
             }
-            case OP_BUILD_ARRAY: {
+            CASE(OP_INVOKE): {
+                // host.name(args...) without materializing the bound method
+                uint8_t name_index = READ_BYTE();
+                uint8_t arg_count = READ_BYTE();
+                Value* method_args = vm->sp - arg_count - 1;
+                Value attr_host = method_args[0];
+
+                NativeFn method = get_cached_builtin_method(&frame->function->body.siteCaches[name_index].attr,
+                                                            attr_host, AS_STRING(frame->function->body.constants.arr[name_index]));
+                if (method == NULL) {
+                    Value err = builtin_attr_error(attr_host);
+                    THROW_IF_ERROR(err);
+                }
+                write_barrier_host(vm, arg_count, method_args);
+                Value return_value = method(arg_count, method_args);
+                vm->sp -= arg_count + 1;
+                THROW_IF_ERROR(return_value);
+                add_garbage(vm, return_value);
+                push(vm, return_value);
+                DISPATCH();
+            }
+            CASE(OP_BUILD_ARRAY): {
                 // Read the argument count
                 uint8_t arg_count = READ_BYTE();
 
@@ -368,148 +643,855 @@ static InterpretResult run(VM* vm) {
 
                 push(vm, VAR_OBJ(arr));
                 add_garbage(vm, VAR_OBJ(arr));
-                break;
-            }
-			case OP_ASSIGN_GLOBAL: {
-                Value  var_name = READ_CONSTANT();
-                if (!IS_STRING(var_name)) {
-                    return runtime_error(vm, "global variable should be a string.", ERR_SYNTAX);
-                }
-                StringObj* var_str = AS_STRING(var_name);
-                // loop in other frames for the value until found. this is why local variables are faster than globals;
-                for (int i = vm->frameCount - 2; i >= 0; i--) {
-                    StackFrame* curr = &vm->callStack[i];
-                    // iterate over the function locals and search for the value
-                    for(int j = 0; j< curr->function->localCount; j++) {
-                        Local current_local = curr->function->locals[j];
-                        if (current_local.length == var_str->length && strncmp(current_local.name, var_str->value, current_local.length) == 0) {
-                            curr->function->locals[j].value = pop(vm);
-                            goto var_found;
-                        }
-                    }
+                DISPATCH();
+            }
+			CASE(OP_ASSIGN_GLOBAL): {
+                // variables of the script and enclosing functions were resolved by the compiler, only real globals are left
+                uint8_t name_index = READ_BYTE();
+                ValueNode* glob = resolve_global(vm, &frame->function->body, name_index);
+                if (glob == NULL) {
+                    StringObj* var_str = AS_STRING(frame->function->body.constants.arr[name_index]);
+                    return RUNTIME_ERROR("variable '%.*s' is not defined", ERR_NAME, var_str->length, var_str->value);
                 }
-                return runtime_error(vm, "variable '%.*s' is not defined", ERR_NAME, var_str->length, var_str->value);
+                glob->val = pop(vm);
+                DISPATCH();
 			}
-            case OP_LOAD_LOCAL: {
+            CASE(OP_LOAD_SCRIPT): {
+                // the script frame is always the bottom of the stack, so its slots start at vm->stack
                 uint8_t variable_index = READ_BYTE();
-                push(vm, frame->function->locals[variable_index].value);
-                break;
+                push(vm, vm->stack[variable_index]);
+                DISPATCH();
             }
-            case OP_ASSIGN_LOCAL: {
+            CASE(OP_ASSIGN_SCRIPT): {
                 Value val = pop(vm);
                 uint8_t variable_index = READ_BYTE();
-                frame->function->locals[variable_index].value = val;
-                break;
-            }
-			case OP_LOAD_GLOBAL: {
-                Value  var_name = READ_CONSTANT();
-                if (!IS_STRING(var_name)) {
-                    return runtime_error(vm, "global variable should be a string.", ERR_SYNTAX);
-                }
-                StringObj* var_str = AS_STRING(var_name);
-                // loop in other frames for the value until found. this is why local variables are faster than globals;
-                for (int i = vm->frameCount - 2; i >= 0; i--) {
-                    StackFrame* curr = &vm->callStack[i];
-                    // iterate over the function locals and search for the value
-                    for(int j = 0; j< curr->function->localCount; j++) {
-                        Local current_local = curr->function->locals[j];
-                        if (current_local.length == var_str->length && strncmp(current_local.name, var_str->value, current_local.length) == 0) {
-                            push(vm, current_local.value);
-                            goto var_found;
-                        }
+                vm->stack[variable_index] = val;
+                DISPATCH();
+            }
+            CASE(OP_LOAD_UPVALUE): {
+                uint8_t upvalue_index = READ_BYTE();
+                push(vm, *frame->closure->upvalues[upvalue_index]->location);
+                DISPATCH();
+            }
+            CASE(OP_ASSIGN_UPVALUE): {
+                Value val = pop(vm);
+                UpvalueObj* upvalue = frame->closure->upvalues[READ_BYTE()];
+                *upvalue->location = val;
+                write_barrier(vm, (Obj*) upvalue, val);
+                DISPATCH();
+            }
+            CASE(OP_CLOSURE): {
+                FunctionObj* function = AS_FUNCTION(READ_CONSTANT());
+                uint8_t upvalue_count = READ_BYTE();
+                ClosureObj* closure = create_closure_obj(function);
+                add_garbage(vm, VAR_OBJ(closure));
+                push(vm, VAR_OBJ(closure)); // keep the closure reachable while its upvalues are allocated
+
+                for (uint8_t i = 0; i < upvalue_count; i++) {
+                    uint8_t is_local = READ_BYTE();
+                    uint8_t index = READ_BYTE();
+                    if (is_local) {
+                        closure->upvalues[i] = capture_upvalue(vm, frame->slots + index);
+                    } else {
+                        closure->upvalues[i] = frame->closure->upvalues[index];
                     }
+                    // add_garbage may have promoted the closure already
+                    write_barrier(vm, (Obj*) closure, VAR_OBJ(closure->upvalues[i]));
+                }
+                DISPATCH();
+            }
+            CASE(OP_LOAD_LOCAL): {
+                uint8_t variable_index = READ_BYTE();
+                push(vm, frame->slots[variable_index]);
+                DISPATCH();
+            }
+            CASE(OP_INCREMENT_LOCAL): {
+                Value* local = &frame->slots[READ_BYTE()];
+                Value amount = READ_CONSTANT();
+                if (!IS_NUMBER(*local)) {
+                    return RUNTIME_ERROR("unknown operands for '+' operator. have you considered using .to_str()?", ERR_TYPE);
                 }
-                ValueNode * glob = get_global(&vm->globals, var_str->value, var_str->length);
-                if (glob != NULL) {
-                    push(vm, glob->val);
-                    goto var_found;
+                *local = VAR_NUMBER(AS_NUMBER(*local) + AS_NUMBER(amount));
+                DISPATCH();
+            }
+            CASE(OP_ASSIGN_LOCAL): {
+                Value val = pop(vm);
+                uint8_t variable_index = READ_BYTE();
+                frame->slots[variable_index] = val;
+                DISPATCH();
+            }
+			CASE(OP_LOAD_GLOBAL): {
+                uint8_t name_index = READ_BYTE();
+                ValueNode* glob = resolve_global(vm, &frame->function->body, name_index);
+                if (glob == NULL) {
+                    StringObj* var_str = AS_STRING(frame->function->body.constants.arr[name_index]);
+                    return RUNTIME_ERROR("variable '%.*s' is not defined", ERR_NAME, var_str->length, var_str->value);
                 }
-                return runtime_error(vm, "variable '%.*s' is not defined", ERR_NAME, var_str->length, var_str->value);
-                var_found:
-                    break;
+                push(vm, glob->val);
+                DISPATCH();
 			}
-            case OP_GET_ITER: {
+            CASE(OP_GET_ITER): {
                 Value to_get_iter = pop(vm);
                 if (!IS_ITERABLE_ON(to_get_iter)) {
-                    return runtime_error(vm, "value is not iterable", ERR_TYPE);
+                    return RUNTIME_ERROR("value is not iterable", ERR_TYPE);
                 }
                 IterableObj* iter_obj = get_iterable(AS_OBJ(to_get_iter));
 
                 Value f_value = VAR_OBJ(iter_obj);
                 add_garbage(vm, f_value);
                 push(vm, f_value);
-                break;
+                DISPATCH();
             }
-            case OP_END_FOR: {
+            CASE(OP_END_FOR): {
                 Value iter_obj = pop(vm);
-                break;
+                DISPATCH();
             }
-            case OP_FOR_ITER: {
+            CASE(OP_FOR_ITER): {
                 Value val = peek_behind(vm, 1);
                 if (!IS_ITERABLE(val)) {
-                    return runtime_error(vm, "expected iterable", ERR_TYPE);
+                    return RUNTIME_ERROR("expected iterable", ERR_TYPE);
                 }
                 IterableObj* iter_obj = AS_ITERABLE(val);
                 if (iterable_out_of_bounds(iter_obj)) {
-                    frame->ip += READ_SHORT();
-                    break;
+                    uint16_t jmp_size = READ_SHORT();
+                    ip += jmp_size;
+                    DISPATCH();
                 }
                 READ_SHORT();
                 Value iterable_var_value = iterable_get_at(iter_obj, iter_obj->index);
                 iter_obj->index++;
-                if (IS_STRING(iterable_var_value)) { // Add string to garbage because it is immutable. therefore, a copy string is made.
-                    add_garbage(vm, iterable_var_value);
-                }
+                // an element or a single byte string, shared and already owned, nothing new for the collector
                 push(vm, iterable_var_value);
-                break;
+                DISPATCH();
             }
-			case OP_CALL: {
+			CASE(OP_CALL): {
                 uint8_t arg_count = READ_BYTE();
                 Value func_value = peek_behind(vm, arg_count + 1);
 
                 if (IS_NATIVE(func_value)) {
                     NativeFuncObj* native_obj = AS_NATIVE(func_value);
                     Value return_value = native_obj->function(arg_count, vm->sp - arg_count);
-                    vm->sp -= arg_count - 1;
+                    vm->sp -= arg_count + 1; // drop the arguments and the callee
                     push(vm, return_value);
-                    break;
+                    DISPATCH();
                 }
 
                 if (IS_NATIVE_METHOD(func_value)) {
                     NativeFuncObj* native_obj = AS_NATIVE(func_value);
-                    Value return_value = native_obj->function(arg_count, vm->sp - arg_count - 2);
-                    vm->sp -= arg_count + 2;
+                    // methods expect [host, args...], the host replaces the method in its slot
+                    Value* method_args = vm->sp - arg_count - 1;
+                    method_args[0] = native_obj->bound;
+                    write_barrier_host(vm, arg_count, method_args);
+                    Value return_value = native_obj->function(arg_count, method_args);
+                    vm->sp -= arg_count + 1;
                     THROW_IF_ERROR(return_value);
                     add_garbage(vm, return_value);
                     push(vm, return_value);
-                    break;
+                    DISPATCH();
                 }
 
 
-                if (!IS_FUNCTION(func_value)) {
-                    return runtime_error(vm, "object is not callable", ERR_NAME);
-                }
                 StackFrame func_frame;
-                func_frame.function = AS_FUNCTION(func_value);
+                if (IS_CLOSURE(func_value)) {
+                    func_frame.closure = AS_CLOSURE(func_value);
+                    func_frame.function = func_frame.closure->function;
+                } else if (IS_FUNCTION(func_value)) {
+                    func_frame.closure = NULL;
+                    func_frame.function = AS_FUNCTION(func_value);
+                } else {
+                    return RUNTIME_ERROR("object is not callable", ERR_NAME);
+                }
+                SAVE_IP();
+                // the arguments on the stack become the first locals of the new frame
                 func_frame.ip = func_frame.function->body.codes;
+                func_frame.slots = vm->sp - arg_count;
+                func_frame.pc = NULL;
+                func_frame.top = NULL;
 
                 push_frame(vm, func_frame);
-
-                for (uint8_t i = arg_count; i >0; i--) {
-                    Value curr_arg = pop(vm);
-                    func_frame.function->locals[i - 1].value = curr_arg;
-                }
-                pop(vm);
+                reserve_frame(vm, func_frame.slots, func_frame.function);
                 frame = &vm->callStack[vm->frameCount - 1];
-                break;
+                ip = frame->ip;
+                if (frame->function->aot != NULL) {
+                    ENTER_AOT();
+                } else if (vm->jitEnabled && tier_up(frame->function, vm)) {
+                    ENTER_JIT();
+                }
+                DISPATCH();
 
 			}
-            default:
-                return runtime_error(vm, "unhandled op code %d", ERR_SYNTAX, opcode);
+            DEFAULT:
+                return RUNTIME_ERROR("unhandled op code %d", ERR_SYNTAX, ip[-1]);
 		}
 	}
+#undef NUMBER_BINARY_OP
+#undef DEOPTIMIZE
+#undef QUICKEN
+#undef DISPATCH
+#undef DEFAULT
+#undef CASE
+#undef ENTER_JIT
+#undef ENTER_AOT
+#undef RUNTIME_ERROR
+#undef THROW_IF_ERROR
+#undef SAVE_IP
 #undef READ_SHORT
 #undef READ_BYTE
 #undef READ_CONSTANT
 }
 
+
+// <---- jit slow paths ----->
+// the machine code of jit.c only inlines the common case of an instruction, the rest comes here.
+// the trace recorder of trace.c runs every instruction of a loop iteration through it, and the C of shipc --emit-c
+// (aot.c) the instructions it has no inline version of.
+// same semantics as the handlers in run(), without quickening since the native code never reads the op codes again.
+JitStep jit_step(VM* vm, StackFrame* frame, uint8_t* ip) {
+    // run() raises errors with ip one past the op code, the error line is looked up from there
+    frame->ip = ip + 1;
+    Value* constants = frame->function->body.constants.arr;
+#define STEP_ERROR(...) (runtime_error(vm, __VA_ARGS__), JIT_FAILED)
+#define THROW_IF_ERROR(value) if (IS_ERROR(value)) { throw_error(vm, AS_ERROR(value)); }
+#define NUMBER_STEP(result, message) { \
+        Value b = pop(vm); \
+        Value a = pop(vm); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) return STEP_ERROR(message, ERR_TYPE); \
+        push(vm, result); \
+        return JIT_NEXT; \
+    }
+
+    switch (ip[0]) {
+        case OP_CONSTANT:
+            push(vm, constants[ip[1]]);
+            return JIT_NEXT;
+        case OP_FALSE:
+            push(vm, VAR_BOOL(false));
+            return JIT_NEXT;
+        case OP_TRUE:
+            push(vm, VAR_BOOL(true));
+            return JIT_NEXT;
+        case OP_NIL:
+            push(vm, VAR_NIL);
+            return JIT_NEXT;
+        case OP_POP_TOP:
+        case OP_END_FOR:
+            pop(vm);
+            return JIT_NEXT;
+        case OP_LOAD_LOCAL:
+            push(vm, frame->slots[ip[1]]);
+            return JIT_NEXT;
+        case OP_STORE_FAST:
+        case OP_ASSIGN_LOCAL:
+            frame->slots[ip[1]] = pop(vm);
+            return JIT_NEXT;
+        case OP_LOAD_SCRIPT:
+            push(vm, vm->stack[ip[1]]);
+            return JIT_NEXT;
+        case OP_ASSIGN_SCRIPT:
+            vm->stack[ip[1]] = pop(vm);
+            return JIT_NEXT;
+        case OP_JUMP:
+        case OP_JUMP_BACKWARD:
+            return JIT_BRANCH;
+        case OP_ADD:
+        case OP_ADD_NUM: {
+            Value b = pop(vm);
+            Value a = pop(vm);
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                push(vm, VAR_NUMBER(AS_NUMBER(a) + AS_NUMBER(b)));
+                return JIT_NEXT;
+            }
+            if (IS_STRING(a) && IS_STRING(b)) {
+                Value concat = VAR_OBJ(concat_strings(AS_OBJ(a), AS_OBJ(b)));
+                add_garbage(vm, concat);
+                push(vm, concat);
+                return JIT_NEXT;
+            }
+            return STEP_ERROR("unknown operands for '+' operator. have you considered using .to_str()?", ERR_TYPE);
+        }
+        case OP_SUB:
+        case OP_SUB_NUM: NUMBER_STEP(VAR_NUMBER(AS_NUMBER(a) - AS_NUMBER(b)), "/ operator accepts only numbers")
+        case OP_MUL:
+        case OP_MUL_NUM: NUMBER_STEP(VAR_NUMBER(AS_NUMBER(a) * AS_NUMBER(b)), "* operator accepts only numbers")
+        case OP_MODULO: NUMBER_STEP(VAR_NUMBER(fmod(AS_NUMBER(a), AS_NUMBER(b))), "modulos operator accepts only number types")
+        case OP_LESS_THAN:
+        case OP_LESS_THAN_NUM: NUMBER_STEP(VAR_BOOL(AS_NUMBER(a) < AS_NUMBER(b)), "non supported operands for GREATER_THAN")
+        case OP_GREATER_THAN:
+        case OP_GREATER_THAN_NUM: NUMBER_STEP(VAR_BOOL(AS_NUMBER(a) > AS_NUMBER(b)), "non supported operands for GREATER_THAN")
+        case OP_DIV: {
+            Value b = pop(vm);
+            Value a = pop(vm);
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                return STEP_ERROR("/ operator accepts only numbers", ERR_TYPE);
+            }
+            if (AS_NUMBER(b) == 0) {
+                return STEP_ERROR("cannot divide by 0", ERR_SYNTAX);
+            }
+            push(vm, VAR_NUMBER(AS_NUMBER(a) / AS_NUMBER(b)));
+            return JIT_NEXT;
+        }
+        case OP_COMPARE: {
+            Value b = pop(vm);
+            Value a = pop(vm);
+            push(vm, VAR_BOOL(values_equal(a, b)));
+            return JIT_NEXT;
+        }
+        case OP_NEGATE: {
+            Value value = pop(vm);
+            if (!IS_NUMBER(value)) {
+                return STEP_ERROR("unary operator cannot be called on non number object", ERR_TYPE);
+            }
+            push(vm, VAR_NUMBER(-AS_NUMBER(value)));
+            return JIT_NEXT;
+        }
+        case OP_NOT: {
+            Value value = pop(vm);
+            if (!IS_BOOL(value)) {
+                return STEP_ERROR("'not' operator cannot be called on non boolean object", ERR_TYPE);
+            }
+            push(vm, VAR_BOOL(!AS_BOOL(value)));
+            return JIT_NEXT;
+        }
+        case OP_POP_JUMP_IF_FALSE:
+            return is_truthy(pop(vm)) ? JIT_NEXT : JIT_BRANCH;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER: {
+            Value b = pop(vm);
+            Value a = pop(vm);
+            bool less = ip[0] == OP_JUMP_IF_NOT_LESS;
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                return STEP_ERROR(less ? "non supported operands for LESS_THAN" : "non supported operands for GREATER_THAN", ERR_TYPE);
+            }
+            bool test = less ? AS_NUMBER(a) < AS_NUMBER(b) : AS_NUMBER(a) > AS_NUMBER(b);
+            return test ? JIT_NEXT : JIT_BRANCH;
+        }
+        case OP_INCREMENT_LOCAL: {
+            Value* local = &frame->slots[ip[1]];
+            if (!IS_NUMBER(*local)) {
+                return STEP_ERROR("unknown operands for '+' operator. have you considered using .to_str()?", ERR_TYPE);
+            }
+            *local = VAR_NUMBER(AS_NUMBER(*local) + AS_NUMBER(constants[ip[2]]));
+            return JIT_NEXT;
+        }
+        case OP_LOAD_GLOBAL:
+        case OP_ASSIGN_GLOBAL: {
+            ValueNode* glob = resolve_global(vm, &frame->function->body, ip[1]);
+            if (glob == NULL) {
+                StringObj* var_str = AS_STRING(constants[ip[1]]);
+                return STEP_ERROR("variable '%.*s' is not defined", ERR_NAME, var_str->length, var_str->value);
+            }
+            if (ip[0] == OP_LOAD_GLOBAL) {
+                push(vm, glob->val);
+            } else {
+                glob->val = pop(vm);
+            }
+            return JIT_NEXT;
+        }
+        case OP_LOAD_UPVALUE:
+            push(vm, *frame->closure->upvalues[ip[1]]->location);
+            return JIT_NEXT;
+        case OP_ASSIGN_UPVALUE: {
+            UpvalueObj* upvalue = frame->closure->upvalues[ip[1]];
+            *upvalue->location = pop(vm);
+            write_barrier(vm, (Obj*) upvalue, *upvalue->location);
+            return JIT_NEXT;
+        }
+        case OP_CLOSURE: {
+            FunctionObj* function = AS_FUNCTION(constants[ip[1]]);
+            ClosureObj* closure = create_closure_obj(function);
+            add_garbage(vm, VAR_OBJ(closure));
+            push(vm, VAR_OBJ(closure));
+            for (uint8_t i = 0; i < ip[2]; i++) {
+                uint8_t is_local = ip[3 + 2 * i];
+                uint8_t index = ip[4 + 2 * i];
+                if (is_local) {
+                    closure->upvalues[i] = capture_upvalue(vm, frame->slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
+                }
+                write_barrier(vm, (Obj*) closure, VAR_OBJ(closure->upvalues[i]));
+            }
+            return JIT_NEXT;
+        }
+        case OP_SHOW_TOP:
+            print_value(pop(vm));
+            printf("\n");
+            return JIT_NEXT;
+        case OP_BUILD_ARRAY: {
+            ArrayObj* arr = create_array_obj();
+            for (uint8_t i = ip[1]; i > 0; i--) {
+                write_value_array(arr->values, vm->sp[-i]);
+            }
+            vm->sp -= ip[1];
+            push(vm, VAR_OBJ(arr));
+            add_garbage(vm, VAR_OBJ(arr));
+            return JIT_NEXT;
+        }
+        case OP_GET_ITER: {
+            Value to_get_iter = pop(vm);
+            if (!IS_ITERABLE_ON(to_get_iter)) {
+                return STEP_ERROR("value is not iterable", ERR_TYPE);
+            }
+            Value iter_value = VAR_OBJ(get_iterable(AS_OBJ(to_get_iter)));
+            add_garbage(vm, iter_value);
+            push(vm, iter_value);
+            return JIT_NEXT;
+        }
+        case OP_FOR_ITER: {
+            Value val = peek_behind(vm, 1);
+            if (!IS_ITERABLE(val)) {
+                return STEP_ERROR("expected iterable", ERR_TYPE);
+            }
+            IterableObj* iter_obj = AS_ITERABLE(val);
+            if (iterable_out_of_bounds(iter_obj)) {
+                return JIT_BRANCH;
+            }
+            Value iterable_var_value = iterable_get_at(iter_obj, iter_obj->index);
+            iter_obj->index++;
+            // shared, not a new object
+            push(vm, iterable_var_value);
+            return JIT_NEXT;
+        }
+        case OP_LOAD_ATTR: {
+            Value attr_name = constants[ip[1]];
+            Value attr_host = peek_behind(vm, 1);
+            if (!IS_STRING(attr_name)) {
+                return STEP_ERROR("Attribute name is expected to be a string", ERR_TYPE);
+            }
+            if (IS_CLASS(attr_host)) {
+                return JIT_NEXT; // Classes are not implemented in ship yet..
+            }
+            NativeFn method = get_cached_builtin_method(&frame->function->body.siteCaches[ip[1]].attr,
+                                                        attr_host, AS_STRING(attr_name));
+            if (method == NULL) {
+                Value err = builtin_attr_error(attr_host);
+                THROW_IF_ERROR(err);
+            }
+            Value attr_res = VAR_OBJ(create_native_method_obj(method, attr_host));
+            add_garbage(vm, attr_res);
+            vm->sp[-1] = attr_res;
+            return JIT_NEXT;
+        }
+        case OP_CALL: {
+            // only calls of native functions and methods, the ones that push a frame are left to run()
+            uint8_t arg_count = ip[1];
+            Value callee = vm->sp[-arg_count - 1];
+            if (IS_NATIVE(callee)) {
+                Value return_value = AS_NATIVE(callee)->function(arg_count, vm->sp - arg_count);
+                vm->sp -= arg_count + 1;
+                push(vm, return_value);
+                return JIT_NEXT;
+            }
+            if (!IS_NATIVE_METHOD(callee)) {
+                return STEP_ERROR("object is not callable", ERR_NAME);
+            }
+            NativeFuncObj* native_obj = AS_NATIVE(callee);
+            Value* method_args = vm->sp - arg_count - 1;
+            method_args[0] = native_obj->bound;
+            write_barrier_host(vm, arg_count, method_args);
+            Value return_value = native_obj->function(arg_count, method_args);
+            vm->sp -= arg_count + 1;
+            THROW_IF_ERROR(return_value);
+            add_garbage(vm, return_value);
+            push(vm, return_value);
+            return JIT_NEXT;
+        }
+        case OP_INVOKE: {
+            uint8_t arg_count = ip[2];
+            Value* method_args = vm->sp - arg_count - 1;
+            Value attr_host = method_args[0];
+            NativeFn method = get_cached_builtin_method(&frame->function->body.siteCaches[ip[1]].attr,
+                                                        attr_host, AS_STRING(constants[ip[1]]));
+            if (method == NULL) {
+                Value err = builtin_attr_error(attr_host);
+                THROW_IF_ERROR(err);
+            }
+            write_barrier_host(vm, arg_count, method_args);
+            Value return_value = method(arg_count, method_args);
+            vm->sp -= arg_count + 1;
+            THROW_IF_ERROR(return_value);
+            add_garbage(vm, return_value);
+            push(vm, return_value);
+            return JIT_NEXT;
+        }
+        default:
+            return STEP_ERROR("unhandled op code %d", ERR_SYNTAX, ip[0]);
+    }
+#undef NUMBER_STEP
+#undef THROW_IF_ERROR
+#undef STEP_ERROR
+}
+
+// <---- register code interpreter ----->
+// runs the code made by compile_registers. a frame's registers are its stack window slots[0 .. maxStackSize),
+// a callee's window starts right after the callee register of the call, and its result goes back into it.
+
+static void reserve_register_frame(VM* vm, StackFrame* frame, int arg_count) {
+    FunctionObj* function = frame->function;
+    if (frame->slots + function->maxStackSize >= vm->stack + STACK_MAX) {
+        printf("Stack overflow");
+        exit(1);
+    }
+    // every register but the arguments starts as nil, so the gc never sees a stale value of an older frame
+    for (Value* slot = frame->slots + arg_count; slot < frame->slots + function->maxStackSize; slot++) {
+        *slot = VAR_NIL;
+    }
+    // the gc marks up to vm->sp, which must also cover the callers' registers above this window
+    Value* frame_end = frame->slots + function->maxStackSize;
+    frame->top = frame_end > vm->sp ? frame_end : vm->sp;
+    vm->sp = frame->top;
+}
+
+static InterpretResult run_registers(VM* vm) {
+    StackFrame* frame = &vm->callStack[vm->frameCount - 1];
+    uint32_t* pc = frame->pc;
+    Value* registers = frame->slots;
+    Value* constants = frame->function->body.constants.arr;
+    uint32_t instruction;
+#define R(x) registers[x]
+#define RK(x) ((x) >= RK_CONSTANT ? constants[(x) - RK_CONSTANT] : registers[x])
+#define LOAD_FRAME() (frame = &vm->callStack[vm->frameCount - 1], pc = frame->pc, registers = frame->slots, \
+                      constants = frame->function->body.constants.arr, vm->sp = frame->top)
+#define SAVE_PC() (frame->pc = pc)
+#define THROW_IF_ERROR(value) if (IS_ERROR(value)) { SAVE_PC(); throw_error(vm, AS_ERROR(value)); }
+#define RUNTIME_ERROR(...) (SAVE_PC(), runtime_error(vm, __VA_ARGS__))
+#define A REG_A(instruction)
+#define B REG_B(instruction)
+#define C REG_C(instruction)
+#define NUMBER_OPERANDS(message) \
+    Value b = RK(B); \
+    Value c = RK(C); \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c)) { \
+        return RUNTIME_ERROR(message, ERR_TYPE); \
+    }
+
+#ifdef SHIP_COMPUTED_GOTO
+    static void* dispatch_table[] = {
+        [ROP_MOVE] = &&label_ROP_MOVE,
+        [ROP_LOADK] = &&label_ROP_LOADK,
+        [ROP_LOADNIL] = &&label_ROP_LOADNIL,
+        [ROP_LOADBOOL] = &&label_ROP_LOADBOOL,
+        [ROP_ADD] = &&label_ROP_ADD,
+        [ROP_SUB] = &&label_ROP_SUB,
+        [ROP_MUL] = &&label_ROP_MUL,
+        [ROP_DIV] = &&label_ROP_DIV,
+        [ROP_MOD] = &&label_ROP_MOD,
+        [ROP_LT] = &&label_ROP_LT,
+        [ROP_GT] = &&label_ROP_GT,
+        [ROP_EQ] = &&label_ROP_EQ,
+        [ROP_NOT] = &&label_ROP_NOT,
+        [ROP_NEG] = &&label_ROP_NEG,
+        [ROP_JMP] = &&label_ROP_JMP,
+        [ROP_JMP_IF_FALSE] = &&label_ROP_JMP_IF_FALSE,
+        [ROP_TEST_LT] = &&label_ROP_TEST_LT,
+        [ROP_TEST_GT] = &&label_ROP_TEST_GT,
+        [ROP_GETGLOBAL] = &&label_ROP_GETGLOBAL,
+        [ROP_SETGLOBAL] = &&label_ROP_SETGLOBAL,
+        [ROP_GETUPVAL] = &&label_ROP_GETUPVAL,
+        [ROP_SETUPVAL] = &&label_ROP_SETUPVAL,
+        [ROP_GETSCRIPT] = &&label_ROP_GETSCRIPT,
+        [ROP_SETSCRIPT] = &&label_ROP_SETSCRIPT,
+        [ROP_CLOSURE] = &&label_ROP_CLOSURE,
+        [ROP_CALL] = &&label_ROP_CALL,
+        [ROP_INVOKE] = &&label_ROP_INVOKE,
+        [ROP_GETATTR] = &&label_ROP_GETATTR,
+        [ROP_BUILD_ARRAY] = &&label_ROP_BUILD_ARRAY,
+        [ROP_GET_ITER] = &&label_ROP_GET_ITER,
+        [ROP_FOR_ITER] = &&label_ROP_FOR_ITER,
+        [ROP_RETURN] = &&label_ROP_RETURN,
+        [ROP_PRINT] = &&label_ROP_PRINT,
+        [ROP_HALT] = &&label_ROP_HALT,
+    };
+#define CASE(op) case op: label_##op
+#define DISPATCH() instruction = *pc++; goto *dispatch_table[REG_OP(instruction)]
+#else
+#define CASE(op) case op
+#define DISPATCH() break
+#endif
+
+    for (;;) {
+        instruction = *pc++;
+        switch (REG_OP(instruction)) {
+            CASE(ROP_MOVE): R(A) = R(B); DISPATCH();
+            CASE(ROP_LOADK): R(A) = constants[REG_BX(instruction)]; DISPATCH();
+            CASE(ROP_LOADNIL): R(A) = VAR_NIL; DISPATCH();
+            CASE(ROP_LOADBOOL): R(A) = VAR_BOOL(B); DISPATCH();
+            CASE(ROP_ADD): {
+                Value b = RK(B);
+                Value c = RK(C);
+                if (IS_NUMBER(b) && IS_NUMBER(c)) {
+                    R(A) = VAR_NUMBER(AS_NUMBER(b) + AS_NUMBER(c));
+                    DISPATCH();
+                }
+                if (IS_STRING(b) && IS_STRING(c)) {
+                    Value concat = VAR_OBJ(concat_strings(AS_OBJ(b), AS_OBJ(c)));
+                    add_garbage(vm, concat);
+                    R(A) = concat;
+                    DISPATCH();
+                }
+                return RUNTIME_ERROR("unknown operands for '+' operator. have you considered using .to_str()?", ERR_TYPE);
+            }
+            CASE(ROP_SUB): {
+                NUMBER_OPERANDS("- operator accepts only numbers");
+                R(A) = VAR_NUMBER(AS_NUMBER(b) - AS_NUMBER(c));
+                DISPATCH();
+            }
+            CASE(ROP_MUL): {
+                NUMBER_OPERANDS("* operator accepts only numbers");
+                R(A) = VAR_NUMBER(AS_NUMBER(b) * AS_NUMBER(c));
+                DISPATCH();
+            }
+            CASE(ROP_DIV): {
+                NUMBER_OPERANDS("/ operator accepts only numbers");
+                if (AS_NUMBER(c) == 0) {
+                    return RUNTIME_ERROR("cannot divide by 0", ERR_SYNTAX);
+                }
+                R(A) = VAR_NUMBER(AS_NUMBER(b) / AS_NUMBER(c));
+                DISPATCH();
+            }
+            CASE(ROP_MOD): {
+                NUMBER_OPERANDS("modulos operator accepts only number types");
+                R(A) = VAR_NUMBER(fmod(AS_NUMBER(b), AS_NUMBER(c)));
+                DISPATCH();
+            }
+            CASE(ROP_LT): {
+                NUMBER_OPERANDS("non supported operands for LESS_THAN");
+                R(A) = VAR_BOOL(AS_NUMBER(b) < AS_NUMBER(c));
+                DISPATCH();
+            }
+            CASE(ROP_GT): {
+                NUMBER_OPERANDS("non supported operands for GREATER_THAN");
+                R(A) = VAR_BOOL(AS_NUMBER(b) > AS_NUMBER(c));
+                DISPATCH();
+            }
+            CASE(ROP_EQ): R(A) = VAR_BOOL(values_equal(RK(B), RK(C))); DISPATCH();
+            CASE(ROP_NOT): {
+                if (!IS_BOOL(R(B))) {
+                    return RUNTIME_ERROR("'not' operator cannot be called on non boolean object", ERR_TYPE);
+                }
+                R(A) = VAR_BOOL(!AS_BOOL(R(B)));
+                DISPATCH();
+            }
+            CASE(ROP_NEG): {
+                if (!IS_NUMBER(R(B))) {
+                    return RUNTIME_ERROR("unary operator cannot be called on non number object", ERR_TYPE);
+                }
+                R(A) = VAR_NUMBER(-AS_NUMBER(R(B)));
+                DISPATCH();
+            }
+            CASE(ROP_JMP): pc += REG_SBX(instruction); DISPATCH();
+            CASE(ROP_JMP_IF_FALSE): {
+                if (!is_truthy(R(A))) {
+                    pc += REG_SBX(instruction);
+                }
+                DISPATCH();
+            }
+            CASE(ROP_TEST_LT): {
+                NUMBER_OPERANDS("non supported operands for LESS_THAN");
+                if (AS_NUMBER(b) < AS_NUMBER(c)) {
+                    pc++; // skip the jump out of the loop or if body
+                }
+                DISPATCH();
+            }
+            CASE(ROP_TEST_GT): {
+                NUMBER_OPERANDS("non supported operands for GREATER_THAN");
+                if (AS_NUMBER(b) > AS_NUMBER(c)) {
+                    pc++;
+                }
+                DISPATCH();
+            }
+            CASE(ROP_GETGLOBAL):
+            CASE(ROP_SETGLOBAL): {
+                uint8_t name_index = REG_BX(instruction);
+                ValueNode* glob = resolve_global(vm, &frame->function->body, name_index);
+                if (glob == NULL) {
+                    StringObj* var_str = AS_STRING(constants[name_index]);
+                    return RUNTIME_ERROR("variable '%.*s' is not defined", ERR_NAME, var_str->length, var_str->value);
+                }
+                if (REG_OP(instruction) == ROP_GETGLOBAL) {
+                    R(A) = glob->val;
+                } else {
+                    glob->val = R(A);
+                }
+                DISPATCH();
+            }
+            CASE(ROP_GETUPVAL): R(A) = *frame->closure->upvalues[B]->location; DISPATCH();
+            CASE(ROP_SETUPVAL): {
+                UpvalueObj* upvalue = frame->closure->upvalues[B];
+                *upvalue->location = R(A);
+                write_barrier(vm, (Obj*) upvalue, R(A));
+                DISPATCH();
+            }
+            CASE(ROP_GETSCRIPT): R(A) = vm->stack[B]; DISPATCH();
+            CASE(ROP_SETSCRIPT): vm->stack[B] = R(A); DISPATCH();
+            CASE(ROP_CLOSURE): {
+                FunctionObj* function = AS_FUNCTION(constants[REG_BX(instruction)]);
+                ClosureObj* closure = create_closure_obj(function);
+                add_garbage(vm, VAR_OBJ(closure));
+                R(A) = VAR_OBJ(closure); // keep the closure reachable while its upvalues are allocated
+                for (unsigned int i = 0; i < function->upvalueCount; i++) {
+                    Upvalue upvalue = function->upvalues[i];
+                    if (upvalue.isLocal) {
+                        closure->upvalues[i] = capture_upvalue(vm, frame->slots + upvalue.index);
+                    } else {
+                        closure->upvalues[i] = frame->closure->upvalues[upvalue.index];
+                    }
+                    write_barrier(vm, (Obj*) closure, VAR_OBJ(closure->upvalues[i]));
+                }
+                DISPATCH();
+            }
+            CASE(ROP_CALL): {
+                Value callee = R(A);
+                int arg_count = B;
+                if (IS_NATIVE(callee)) {
+                    R(A) = AS_NATIVE(callee)->function(arg_count, &R(A + 1));
+                    DISPATCH();
+                }
+                if (IS_NATIVE_METHOD(callee)) {
+                    NativeFuncObj* native_obj = AS_NATIVE(callee);
+                    R(A) = native_obj->bound;
+                    write_barrier_host(vm, arg_count, &R(A));
+                    Value return_value = native_obj->function(arg_count, &R(A));
+                    THROW_IF_ERROR(return_value);
+                    add_garbage(vm, return_value);
+                    R(A) = return_value;
+                    DISPATCH();
+                }
+
+                StackFrame func_frame;
+                if (IS_CLOSURE(callee)) {
+                    func_frame.closure = AS_CLOSURE(callee);
+                    func_frame.function = func_frame.closure->function;
+                } else if (IS_FUNCTION(callee)) {
+                    func_frame.closure = NULL;
+                    func_frame.function = AS_FUNCTION(callee);
+                } else {
+                    return RUNTIME_ERROR("object is not callable", ERR_NAME);
+                }
+                SAVE_PC();
+                func_frame.ip = NULL;
+                func_frame.pc = func_frame.function->registers.codes;
+                func_frame.slots = &R(A + 1);
+                reserve_register_frame(vm, &func_frame, arg_count);
+                push_frame(vm, func_frame);
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE(ROP_RETURN): {
+                // the result takes the place of the callee in the caller's registers
+                Value return_value = R(A);
+                close_upvalues(vm, frame->slots);
+                frame->slots[-1] = return_value;
+                vm->frameCount--;
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE(ROP_INVOKE): {
+                Value attr_host = R(A);
+                NativeFn method = get_cached_builtin_method(&frame->function->body.siteCaches[B].attr,
+                                                            attr_host, AS_STRING(constants[B]));
+                if (method == NULL) {
+                    Value err = builtin_attr_error(attr_host);
+                    THROW_IF_ERROR(err);
+                }
+                write_barrier_host(vm, C, &R(A));
+                Value return_value = method(C, &R(A));
+                THROW_IF_ERROR(return_value);
+                add_garbage(vm, return_value);
+                R(A) = return_value;
+                DISPATCH();
+            }
+            CASE(ROP_GETATTR): {
+                Value attr_host = R(B);
+                if (IS_CLASS(attr_host)) {
+                    // Classes are not implemented in ship yet..
+                    R(A) = attr_host;
+                    DISPATCH();
+                }
+                NativeFn method = get_cached_builtin_method(&frame->function->body.siteCaches[C].attr,
+                                                            attr_host, AS_STRING(constants[C]));
+                if (method == NULL) {
+                    Value err = builtin_attr_error(attr_host);
+                    THROW_IF_ERROR(err);
+                }
+                Value attr_res = VAR_OBJ(create_native_method_obj(method, attr_host));
+                add_garbage(vm, attr_res);
+                R(A) = attr_res;
+                DISPATCH();
+            }
+            CASE(ROP_BUILD_ARRAY): {
+                ArrayObj* arr = create_array_obj();
+                for (uint32_t i = 0; i < B; i++) {
+                    write_value_array(arr->values, R(A + i));
+                }
+                R(A) = VAR_OBJ(arr);
+                add_garbage(vm, VAR_OBJ(arr));
+                DISPATCH();
+            }
+            CASE(ROP_GET_ITER): {
+                Value to_get_iter = R(B);
+                if (!IS_ITERABLE_ON(to_get_iter)) {
+                    return RUNTIME_ERROR("value is not iterable", ERR_TYPE);
+                }
+                Value iter_value = VAR_OBJ(get_iterable(AS_OBJ(to_get_iter)));
+                add_garbage(vm, iter_value);
+                R(A) = iter_value;
+                DISPATCH();
+            }
+            CASE(ROP_FOR_ITER): {
+                if (!IS_ITERABLE(R(A))) {
+                    return RUNTIME_ERROR("expected iterable", ERR_TYPE);
+                }
+                IterableObj* iter_obj = AS_ITERABLE(R(A));
+                if (iterable_out_of_bounds(iter_obj)) {
+                    pc += REG_SBX(instruction);
+                    DISPATCH();
+                }
+                Value iterable_var_value = iterable_get_at(iter_obj, iter_obj->index);
+                iter_obj->index++;
+                // shared, not a new object
+                R(A + 1) = iterable_var_value;
+                DISPATCH();
+            }
+            CASE(ROP_PRINT): {
+                print_value(R(A));
+                printf("\n");
+                DISPATCH();
+            }
+            CASE(ROP_HALT): return RESULT_SUCCESS;
+            default:
+                return RUNTIME_ERROR("unhandled register op code %d", ERR_SYNTAX, REG_OP(instruction));
+        }
+    }
+#undef DISPATCH
+#undef CASE
+#undef NUMBER_OPERANDS
+#undef C
+#undef B
+#undef A
+#undef RUNTIME_ERROR
+#undef THROW_IF_ERROR
+#undef SAVE_PC
+#undef LOAD_FRAME
+#undef RK
+#undef R
+}
+
+InterpretResult interpret_registers(VM* vm, FunctionObj* main_script) {
+    StackFrame main_frame;
+    main_frame.ip = NULL;
+    main_frame.pc = main_script->registers.codes;
+    main_frame.function = main_script;
+    main_frame.closure = NULL;
+    main_frame.slots = vm->stack;
+    reserve_register_frame(vm, &main_frame, 0);
+    push_frame(vm, main_frame);
+
+    InterpretResult end_value = run_registers(vm);
+    if (end_value == RESULT_ERROR) {
+        Value error_value = pop(vm);
+        throw_error(vm, (ErrorObj*) AS_OBJ(error_value));
+        return RESULT_ERROR;
+    }
+    return RESULT_SUCCESS;
+}
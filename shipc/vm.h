@@ -10,8 +10,9 @@
 #include "table.h"
 #include "objects.h"
 
-#define STACK_MAX 512
 #define CALL_STACK_MAX 512
+// every frame keeps its locals and temporaries in the value stack, a byte operand addresses at most UINT8_MAX of them
+#define STACK_MAX (CALL_STACK_MAX * UINT8_MAX)
 
 
 typedef enum {
@@ -23,28 +24,83 @@ typedef enum {
 
 typedef struct {
     FunctionObj* function;
+    ClosureObj* closure; // NULL when the function captures nothing
     uint8_t* ip;
+    Value* slots; // base pointer, the frame locals are slots[0 .. function->localCount)
+    // register code frames only, see run_registers
+    uint32_t* pc; // NULL for stack code frames
+    Value* top; // end of the registers the frame and its callers use, vm->sp while the frame runs
 } StackFrame;
 
+// marked objects whose references are not marked yet, see memory.c
+typedef struct {
+    int count;
+    int capacity;
+    Obj** arr;
+    bool shared; // other threads mark at the same time, so marks are claimed atomically
+} GrayStack;
+
+// the phase of a major collection, see memory.c
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} GcState;
+
 typedef struct {
 	// pointers
 	Value* sp; // stack pointer
 
     unsigned int frameCount;
     StackFrame callStack[CALL_STACK_MAX];
+    UpvalueObj* openUpvalues; // captured variables that still live on the stack
 
 	// objects
 	Value stack[STACK_MAX]; // value stack
-    struct Obj *objects;
-    int heapObjects;
-    int heapCapacity;
+
+    // garbage collection, see memory.c
+    Obj* nursery; // young objects, collected once nurserySize bytes were allocated since the last collection
+    struct Obj *objects; // old objects, collected once the heap outgrows nextMajor
+    Obj* sweeping; // old objects a major collection didn't sweep yet
+    GcState gcState;
+    size_t heapBytes; // bytes the objects of both generations take, as of the last collection
+    size_t nextMajor;
+    size_t nurserySize;
+    size_t heapMinSize;
+    double heapGrowth;
+    long long pauseBudget; // nanoseconds, 0 when major collections are not incremental
+    Obj** remembered; // old objects that were written to since the last collection
+    int rememberedCount;
+    int rememberedCapacity;
+    GrayStack gray;
+    int markThreads; // threads a major collection marks on when it runs in one go
+    int minorCollections;
+    int majorCollections;
+    int pauses; // collections and slices of them, each holds the script up once
+    long long pauseTotal; // nanoseconds
+    long long pauseMax;
 
     ValueTable globals;
 
+    // quickening statistics
+    int quickenedSites; // sites currently running a number only op
+    int deoptimizedSites; // times a number only op met other operands and went back to the generic op
+
+    // baseline jit, see jit.c
+    bool jitEnabled; // tier hot functions up to native code, set by shipc --jit
+    int jitCompiled; // functions compiled so far
+
+    // tracing jit, see trace.c
+    bool traceEnabled; // compile hot loops to native traces, set by shipc --trace
+    int tracesCompiled;
+    int tracesAborted; // loops whose recording or compilation failed, they stay on the interpreter
+
 } VM;
 
 void init_vm(VM* vm);
 void free_vm(VM* vm);
 InterpretResult interpret(VM* vm, FunctionObj* main_script);
+// runs the register code made by compile_registers instead of the stack code
+InterpretResult interpret_registers(VM* vm, FunctionObj* main_script);
 
 #endif // !SHIP_VM_H_